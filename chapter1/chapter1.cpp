@@ -168,37 +168,45 @@ void func5() {
     //for_each对范围中的元素,依次调用用户提供的函数
 }
 
+//accumulate_block定义在headfile.h中,累加[first,last)的和,传入为迭代器首尾和累加的初值
 template<typename Iterator, typename T>
-struct accumulate_block {
-    void operator()(Iterator frist, Iterator last, T& result) {
-        result = std::accumulate(frist, last, result);
-        //累加元素序列的和,传入为迭代器首尾和累加的初值
-    }
-};
-template<typename Iterator, typename T>
-T parallel_accmulate(Iterator first, Iterator last, T init) {
+T parallel_accmulate(Iterator first, Iterator last, T init, thread_pool4& pool = default_pool(),
+                     grain_hint hint = grain_hint()) {
+    adaptive_partitioner part(pool, hint);
+    T measured = T();
+    first = part.measure(first, last, [&measured](Iterator begin, Iterator end) {
+        accumulate_block<Iterator, T>()(begin, end, measured);
+        return false;
+    });
+    init = init + measured;
+    //先串行累加一段前缀并计时,由每个元素的开销决定块的大小,而不是固定每个线程至少处理25个元素
     long const length = std::distance(first, last);
     //计算两个迭代器表示的范围内包含元素的个数
     if (!length) { return init; }
-    long const min_per_thread = 25;
-    long const max_thread = (length + min_per_thread - 1) / min_per_thread;
-    long const hardware_threads = std::thread::hardware_concurrency();
-    long const num_threads = std::min(hardware_threads != 0 ? hardware_threads : 2, max_thread);
+    long const num_threads = part.num_blocks(length);
+    //整数累加这样廉价的操作,数据量不够大时只会使用一个块,直接在调用线程上完成
     long const block_size = length / num_threads;
     std::vector<T> results(num_threads);
-    std::vector<std::thread> threads(num_threads - 1);
+    std::vector<std::future<void>> futures(num_threads - 1);
+    join_tasks<void> joiner(futures, pool);
     Iterator block_start = first;
     for (long i = 0;i < (num_threads - 1);i++) {
         Iterator block_end = block_start;
         std::advance(block_end, block_size);
         //将该迭代器前进或后退 n 个位置
-        threads[i] = std::thread(accumulate_block<Iterator, T>(),
-                                 block_start, block_end, std::ref(results[i]));
+        futures[i] = pool.submit([block_start, block_end, &results, i] {
+            accumulate_block<Iterator, T>()(block_start, block_end, results[i]);
+        });
         block_start = block_end;
     }
     accumulate_block<Iterator, T>()(block_start, last, results[num_threads - 1]);
-    std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+    for (long i = 0;i < (num_threads - 1);i++) {
+        pool.wait(futures[i]);
+        futures[i].get();
+    }
     return std::accumulate(results.begin(), results.end(), init);
+    //每次调用都创建num_threads-1个线程的开销远大于累加本身,这里将数据块提交到共享的线程池中
+    //调用线程处理最后一块,等待时也会帮助线程池执行任务
 }
 
 void func6() {
@@ -211,4 +219,8 @@ void func6() {
 
 int main() {
     func6();
+    std::vector<int> ivec(100000, 1);
+    thread_pool4 pool(4);
+    std::cout << parallel_accmulate(ivec.begin(), ivec.end(), 0, pool, grain_hint(0, 1000)) << " "
+        << parallel_accmulate(ivec.begin(), ivec.end(), 0) << "\n";
 }
\ No newline at end of file
@@ -1,3 +1,6 @@
+#define LOCK_ORDER_CHECK   //启用checked_mutex的锁顺序检查,定义NDEBUG时仍然是普通的std::mutex
+#define SCHEDULE_TEST      //启用容器中的调度点,由test_scheduler控制线程的交错执行
+#define LOCK_PROFILE       //启用profiled_mutex的锁竞争统计,main的最后输出竞争最严重的锁
 #include "../headfile.h"
 
 //并发相关的错误定位及处理方式
@@ -120,6 +123,19 @@
  * 就可以来安排一些特殊的情况,以验证代码是否会在这些特定的环境下产生期望的结果
  * C++标准库实现中,某些测试工具已经存在于标准库中,如果没有实现的测试工具,可以基于标准库进行实现
 */
+//headfile.h中的checked_mutex就是这样的库:记录每个线程的加锁顺序,以不同顺序加锁时报告潜在的死锁
+checked_mutex account_mtx("account");
+checked_mutex log_mtx("log");
+void transfer() {
+    std::lock_guard<checked_mutex> account_lk(account_mtx);
+    std::lock_guard<checked_mutex> log_lk(log_mtx);
+}
+void audit() {
+    std::lock_guard<checked_mutex> log_lk(log_mtx);
+    std::lock_guard<checked_mutex> account_lk(account_mtx);
+}
+//两个线程先后执行,这次运行不会死锁,但同时执行时transfer和audit会互相等待
+//audit添加log->account的边时,与transfer留下的account->log构成环,立即被报告
 
 //构建多线程测试代码
 /* 在特定时间内,需要安排一系列线程,同时去执行指定的代码段,两个线程的情况就很容易扩展到多个线程
@@ -129,6 +145,101 @@
  * 线程上执行的代码需要有并发性
  * 并发执行结束后,后续代码需要对代码的状态进行断言检查
  */
+//headfile.h中的run_schedule_test按照上面的结构组织测试:setup布置环境,threads中的代码并发执行,post做最后的断言
+//与蛮力测试不同,线程的交错由调度器决定,随机调度可以用种子重现,穷举调度可以覆盖少量操作的全部交错
+//每个操作同时在顺序模型上执行,历史不能解释为某个顺序执行时(不满足线性一致性)就报告错误
+typedef std::deque<int> queue_model;
+int model_pop_front(queue_model& model) {
+    if (model.empty()) { return -1; }
+    int const value = model.front();
+    model.pop_front();
+    return value;
+}
+int model_pop_back(queue_model& model) {
+    if (model.empty()) { return -1; }
+    int const value = model.back();
+    model.pop_back();
+    return value;
+}
+schedule_test<thread_safe_queue<int>, queue_model> queue_test() {
+    schedule_test<thread_safe_queue<int>, queue_model> test;
+    for (int i = 0;i < 3;i++) {
+        test.threads.push_back([](thread_safe_queue<int>& queue, operation_history<queue_model>& history, int id) {
+            int const value = id + 1;
+            history.call(id, "push(" + std::to_string(value) + ")",
+                         [&] { queue.push(value); return 0; },
+                         [value](queue_model& model) { model.push_back(value); return 0; });
+            history.call(id, "try_pop()",
+                         [&] { int res = -1; queue.try_pop(res); return res; },
+                         model_pop_front);
+        });
+    }
+    return test;
+}//三个线程各自push一个值再取出一个值,空队列时返回-1
+
+struct steal_state {
+    work_steal_queue queue;
+    int last = -1;
+    int taken = 0;
+    template<typename Take>
+    int take(Take take_task) {
+        function_wrapper task;
+        if (!take_task(task)) { return -1; }
+        taken++;
+        last = -1;
+        task();
+        return last;
+    }
+};//work_steal_queue中是function_wrapper,每个任务执行时写出自己的编号,用来与模型比较
+schedule_test<steal_state, queue_model> steal_test() {
+    schedule_test<steal_state, queue_model> test;
+    test.threads.push_back([](steal_state& state, operation_history<queue_model>& history, int id) {
+        for (int value = 1;value <= 2;value++) {
+            history.call(id, "push(" + std::to_string(value) + ")",
+                         [&] { state.queue.push(function_wrapper([&state, value] { state.last = value; })); return 0; },
+                         [value](queue_model& model) { model.push_front(value); return 0; });
+        }
+        history.call(id, "try_pop()",
+                     [&] { return state.take([&](function_wrapper& task) { return state.queue.try_pop(task); }); },
+                     model_pop_front);
+    });//所有者线程在队头插入和弹出
+    test.threads.push_back([](steal_state& state, operation_history<queue_model>& history, int id) {
+        for (int i = 0;i < 2;i++) {
+            history.call(id, "try_steal()",
+                         [&] { return state.take([&](function_wrapper& task) { return state.queue.try_steal(task); }); },
+                         model_pop_back);
+        }
+    });//窃取线程从队尾取走任务
+    test.post = [](steal_state& state) {
+        function_wrapper task;
+        while (state.queue.try_pop(task)) { state.taken++; }
+        return state.taken == 2;
+    };//每个任务恰好被取走一次:要么被某个线程取走,要么还留在队列中
+    return test;
+}
+
+struct racy_counter {
+    std::atomic<int> value{ 0 };
+    int increment() {
+        schedule_point();
+        int const old_value = value.load();
+        schedule_point();
+        value.store(old_value + 1);
+        return old_value;
+    }
+};//读取和写入是两个独立的原子操作,两个线程可能读到同一个值,其中一次增加被覆盖
+schedule_test<racy_counter, int> racy_test() {
+    schedule_test<racy_counter, int> test;
+    for (int i = 0;i < 2;i++) {
+        test.threads.push_back([](racy_counter& counter, operation_history<int>& history, int id) {
+            history.call(id, "increment()", [&] { return counter.increment(); },
+                         [](int& model) { return model++; });
+        });
+    }
+    test.post = [](racy_counter& counter) { return counter.value.load() == 2; };
+    test.model = 0;
+    return test;
+}//用来演示调度测试如何发现错误,并用报告中的选择序列重放同一次执行
 
 //多线程性能测试
 /* 选择以并发的方式开发应用,就是为了能够使用日益增长的处理器数量,通过处理器数量的增加,来提升应用的执行效率
@@ -142,10 +253,56 @@
  * 因此在对应的系统上通过不同的配置,检查多线程的性能就很有必要,这样可以得到一张性能图
  * 最起码(如果条件允许)需要在一个单处理器的系统上和一个多处理核芯的系统上进行测试
  */
+//性能图只能说明代码是否可以扩展,不能说明瓶颈在哪里,headfile.h中的profiled_mutex按位置统计每个锁的等待和持有时间
+//定义LOCK_PROFILE后thread_safe_queue和work_steal_queue(thread_pool4的本地队列)的锁都会被统计
+//hot_locks让几个线程同时使用这些结构,并用std::lock以不同的顺序锁住两个互斥量
+//std::lock先锁住一个再try_lock其余的,失败时释放后重试,这些失败的尝试记在failed_try中,不计入加锁次数和contended%
+profiled_mutex<std::mutex> source_mtx("source");
+profiled_mutex<std::mutex> target_mtx("target");
+void hot_locks() {
+    thread_safe_queue<int> queue;
+    thread_pool4 pool(4);
+    std::vector<std::thread> threads;
+    for (int i = 0;i < 4;i++) {
+        threads.push_back(std::thread([&queue, &pool, i] {
+            std::vector<std::future<void>> futures;
+            for (int j = 0;j < 2000;j++) {
+                queue.push(j);
+                int value;
+                queue.try_pop(value);
+                futures.push_back(pool.submit([] {}));
+                if (i % 2) { std::lock(source_mtx, target_mtx); }
+                else { std::lock(target_mtx, source_mtx); }
+                source_mtx.unlock();
+                target_mtx.unlock();
+            }
+            for (std::future<void>& future : futures) { pool.wait(future); }
+        }));
+    }
+    for (std::thread& thread : threads) { thread.join(); }
+}
 
+int main() {
+    std::thread(transfer).join();
+    std::thread(audit).join();
+    lock_order_report(std::cout);
 
+    schedule_options random_options;
+    random_options.executions = 200;
+    std::cout << "thread_safe_queue random: " << run_schedule_test(queue_test(), random_options) << "\n";
+    schedule_options exhaustive_options;
+    exhaustive_options.strategy = test_scheduler::mode::exhaustive;
+    exhaustive_options.executions = 5000;
+    std::cout << "work_steal_queue exhaustive: " << run_schedule_test(steal_test(), exhaustive_options) << "\n";
 
+    schedule_result const failed = run_schedule_test(racy_test(), random_options);
+    std::cout << "racy_counter random: " << failed << "\n";
+    if (!failed.passed) {
+        schedule_options replay_options;
+        replay_options.replay = failed.trace;
+        std::cout << "racy_counter replay: " << run_schedule_test(racy_test(), replay_options) << "\n";
+    }//重放得到与报告中完全相同的交错,失败可以稳定的重现
 
-
-
-
+    hot_locks();
+    lock_profile_report(std::cout);
+}
@@ -0,0 +1,713 @@
+#define CHAPTER_BENCHMARKS   //各章的文件不编译自己的main,只提供被测试的容器和算法
+#include "../headfile.h"
+#include "../chapter5/chapter5-2.cpp"
+#include "../chapter6/chapter6-2.cpp"
+#include "../chapter6/chapter6-4.cpp"
+#include "../chapter7/chapter7-1.cpp"
+#include "../chapter7/chapter7-4.cpp"
+#include "../chapter8/chapter8-1.cpp"
+
+//多线程性能测试
+//chapter10-1中提到:需要在不同的处理器数量下检查代码的性能,得到一张性能图
+//这里用headfile.h中的benchmark_suite,对容器、线程池和并行算法分别用1,2,4...个线程完成相同的工作量
+//每一项先执行一次不加锁的串行版本作为基准,加速比 = 吞吐量 / 串行吞吐量
+//加速比随线程数停止增长的位置就是可扩展性的拐点,低于1说明同步的开销已经超过了并行带来的收益
+//运行方式: chapter10-2 [csv|json] [每项的操作数],结果输出到标准输出,可以保存下来与修改后的结果比较
+//各章的数据结构和算法都在这里测试,chapter6-2用到了16字节的原子操作,链接时需要-latomic
+
+long share(long total, int index, int count) {
+    return total / count + (index < total % count);
+}//把total个操作平均分给count个线程,第index个线程的份额
+
+int busy_work(int n) {
+    int volatile res = 0;
+    for (int i = 0;i < n;i++) { res = res + i; }
+    return res;
+}//模拟一个很小的任务,volatile防止循环被优化掉
+
+void benchmark_stack(benchmark_suite& suite, long total) {
+    suite.serial("thread_safe_stack", [total](benchmark_timer& timer) {
+        std::stack<int> stk;
+        for (long i = 0;i < total / 2;i++) {
+            timer.measure([&] { stk.push(i); });
+            timer.measure([&] { stk.pop(); });
+        }
+    });
+    for (int threads : suite.thread_counts()) {
+        thread_safe_stack<int> stk;
+        suite.run("thread_safe_stack", "push+pop", threads, [&](int index, benchmark_timer& timer) {
+            int value;
+            for (long i = share(total / 2, index, threads);i > 0;i--) {
+                timer.measure([&] { stk.push(index); });
+                timer.measure([&] { stk.pop(value); });
+            }
+        });
+        //每个线程先压入再弹出,任何时刻压入的次数都不少于弹出的次数,pop不会抛出empty_stack
+    }
+}
+
+void benchmark_queue(benchmark_suite& suite, long total) {
+    long const items = total / 2;
+    suite.serial("thread_safe_queue", [items](benchmark_timer& timer) {
+        std::queue<int> queue;
+        for (long i = 0;i < items;i++) {
+            timer.measure([&] { queue.push(i); });
+            timer.measure([&] { queue.pop(); });
+        }
+    });
+    struct ratio {
+        char const* name;
+        int producers;
+        int consumers;
+    };
+    ratio const ratios[] = { { "1:1", 1, 1 }, { "1:3", 1, 3 }, { "3:1", 3, 1 } };
+    for (int threads : suite.thread_counts()) {
+        if (threads == 1) {
+            thread_safe_queue<int> queue;
+            suite.run("thread_safe_queue", "mixed", 1, [&](int, benchmark_timer& timer) {
+                int value;
+                for (long i = 0;i < items;i++) {
+                    timer.measure([&] { queue.push(i); });
+                    timer.measure([&] { queue.try_pop(value); });
+                }
+            });
+            continue;
+        }
+        for (ratio const& r : ratios) {
+            int const producers = std::max(1, std::min(threads - 1, threads * r.producers / (r.producers + r.consumers)));
+            thread_safe_queue<int> queue;
+            std::atomic<long> claimed(0);
+            suite.run("thread_safe_queue", std::string("producers:consumers=") + r.name, threads,
+                      [&](int index, benchmark_timer& timer) {
+                if (index < producers) {
+                    for (long i = share(items, index, producers);i > 0;i--) {
+                        timer.measure([&] { queue.push(index); });
+                    }
+                    return;
+                }
+                int value;
+                while (claimed.fetch_add(1, std::memory_order_relaxed) < items) {
+                    timer.measure([&] { queue.wait_pop(value); });
+                }
+                //消费者先领取名额再等待,所有元素都被取走后不会有消费者永远阻塞
+            });
+            //弹出的耗时包含等待生产者的时间,消费者多于生产者时p99主要是等待
+        }
+    }
+}
+
+void benchmark_work_steal_queue(benchmark_suite& suite, long total) {
+    long const rounds = total / 4;
+    suite.serial("work_steal_queue", [rounds](benchmark_timer& timer) {
+        std::deque<function_wrapper> queue;
+        for (long i = 0;i < rounds;i++) {
+            timer.measure([&] { queue.push_front(function_wrapper([] {})); });
+            timer.measure([&] { queue.push_front(function_wrapper([] {})); });
+            timer.measure([&] { queue.pop_front(); });
+            timer.measure([&] { queue.pop_front(); });
+        }
+    });
+    for (int threads : suite.thread_counts()) {
+        std::vector<std::unique_ptr<work_steal_queue>> queues;
+        for (int i = 0;i < threads;i++) { queues.push_back(std::unique_ptr<work_steal_queue>(new work_steal_queue)); }
+        suite.run("work_steal_queue", "owner+steal", threads, [&](int index, benchmark_timer& timer) {
+            work_steal_queue& own = *queues[index];
+            work_steal_queue& victim = *queues[(index + 1) % threads];
+            function_wrapper task;
+            for (long i = share(rounds, index, threads);i > 0;i--) {
+                timer.measure([&] { own.push(function_wrapper([] {})); });
+                timer.measure([&] { own.push(function_wrapper([] {})); });
+                timer.measure([&] { own.try_pop(task); });
+                timer.measure([&] { if (!victim.try_steal(task)) { own.try_pop(task); } });
+            }
+        });
+        //与thread_pool4相同的使用方式:所有者在队头压入和弹出,其他线程从队尾窃取,只有一个线程时窃取的是自己的队列
+    }
+}
+
+void benchmark_thread_pool4(benchmark_suite& suite, long total) {
+    int const batch = 64;
+    int const work = 200;
+    long const batches = std::max(1L, total / batch / 4);
+    suite.serial("thread_pool4", [=](benchmark_timer& timer) {
+        for (long i = 0;i < batches;i++) {
+            timer.measure([&] { for (int j = 0;j < batch;j++) { busy_work(work); } }, batch);
+        }
+    });
+    for (int threads : suite.thread_counts()) {
+        thread_pool4 pool(threads);
+        suite.run_caller("thread_pool4", "external-submit", threads, [&](benchmark_timer& timer) {
+            std::vector<std::future<int>> futures(batch);
+            for (long i = 0;i < batches;i++) {
+                timer.measure([&] {
+                    for (int j = 0;j < batch;j++) { futures[j] = pool.submit([=] { return busy_work(work); }); }
+                    for (int j = 0;j < batch;j++) { futures[j].get(); }
+                }, batch);
+            }
+        });
+        //池外的线程提交,所有任务经过全局队列,耗时是一批任务从提交到全部完成的时间
+        suite.run_caller("thread_pool4", "nested-submit", threads, [&](benchmark_timer& timer) {
+            for (long i = 0;i < batches;i++) {
+                timer.measure([&] {
+                    std::future<void> root = pool.submit([&pool, batch, work] {
+                        std::vector<std::future<int>> futures(batch);
+                        for (int j = 0;j < batch;j++) { futures[j] = pool.submit([=] { return busy_work(work); }); }
+                        for (int j = 0;j < batch;j++) {
+                            pool.wait(futures[j]);
+                            futures[j].get();
+                        }
+                    });
+                    pool.wait(root);
+                    root.get();
+                }, batch);
+            }
+        });
+        //工作线程提交的任务进入本地队列,其他线程通过窃取分担,等待时工作线程会执行其他任务
+    }
+}
+
+void benchmark_algorithms(benchmark_suite& suite, long total) {
+    long const length = std::max(1L << 16, total * 8);
+    int const reps = 16;
+    std::vector<long> data(length);
+    std::iota(data.begin(), data.end(), 0);
+    std::vector<long> out(length);
+    auto square_sum = [](long& acc, long value) { acc += value; };
+    auto square = [](long value) { return value * value; };
+    suite.serial("parallel_transform_reduce", [&](benchmark_timer& timer) {
+        for (int i = 0;i < reps;i++) {
+            timer.measure([&] {
+                long acc = 0;
+                for (long value : data) { square_sum(acc, square(value)); }
+                return acc;
+            }, length);
+        }
+    });
+    suite.serial("parallel_inclusive_scan", [&](benchmark_timer& timer) {
+        for (int i = 0;i < reps;i++) {
+            timer.measure([&] { std::partial_sum(data.begin(), data.end(), out.begin()); }, length);
+        }
+    });
+    for (int threads : suite.thread_counts()) {
+        thread_pool4 pool(threads);
+        suite.run_caller("parallel_transform_reduce", "sum-of-squares", threads, [&](benchmark_timer& timer) {
+            for (int i = 0;i < reps;i++) {
+                timer.measure([&] {
+                    return parallel_transform_reduce(data.begin(), data.end(), 0L, square, square_sum,
+                                                     [](long& into, long from) { into += from; }, pool);
+                }, length);
+            }
+        });
+        suite.run_caller("parallel_inclusive_scan", "plus", threads, [&](benchmark_timer& timer) {
+            for (int i = 0;i < reps;i++) {
+                timer.measure([&] { parallel_inclusive_scan(data.begin(), data.end(), out.begin(), std::plus<>(), pool); }, length);
+            }
+        });
+    }
+    //并行算法的吞吐量按元素计算,耗时是一次完整调用的时间
+}
+
+//以下测试的容器和算法定义在各章的文件中,包含时定义了CHAPTER_BENCHMARKS,各章的main不参与编译
+//每个线程使用自己的xorshift随机数选择键
+struct benchmark_keys {
+    std::uint64_t state;
+    explicit benchmark_keys(int index) :state(0x9E3779B97F4A7C15ull * (index + 1)) {}
+    int next(int range) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state % range;
+    }
+};
+
+//chapter5-2:读写比例由名字给出,串行版本使用不加锁的标准库容器
+void benchmark_table(benchmark_suite& suite, long total) {
+    int const key_range = 1024;
+    for (int read_percent : { 90, 50 }) {
+        std::string const name = "thread_safe_table read-" + std::to_string(read_percent) + "%";
+        suite.serial(name, [=](benchmark_timer& timer) {
+            std::unordered_map<int, int> map;
+            benchmark_keys keys(0);
+            for (long i = 0;i < total;i++) {
+                int const key = keys.next(key_range);
+                if (int(i % 100) < read_percent) { timer.measure([&] { auto const found = map.find(key); return found == map.end() ? -1 : found->second; }); }
+                else { timer.measure([&] { map[key] = key; }); }
+            }
+        });
+        //每种读写比例有自己的串行基准,加速比只与相同比例的串行版本比较
+        for (int threads : suite.thread_counts()) {
+            for (bool filtered : { false, true }) {
+                std::unique_ptr<thread_safe_table<int, int>> table(filtered ?
+                    new thread_safe_table<int, int>(19, key_range) : new thread_safe_table<int, int>(19));
+                suite.run(name, filtered ? "filtered" : "unfiltered", threads, [&](int index, benchmark_timer& timer) {
+                    benchmark_keys keys(index);
+                    for (long i = 0;i < total / threads;i++) {
+                        int const key = keys.next(key_range);
+                        if (int(i % 100) < read_percent) { timer.measure([&] { table->value_for(key, -1); }); }
+                        else { timer.measure([&] { table->update_map(key, key); }); }
+                    }
+                });
+            }
+        }
+    }
+    //读多写少时读写锁允许同一个桶上的读者并行,布隆过滤器让未命中的查询不需要获取桶的锁
+}
+void benchmark_cache(benchmark_suite& suite, long total) {
+    int const key_range = 2048;
+    std::size_t const capacity = 1024;
+    char const* const name = "thread_safe_cache read-90%";
+    suite.serial(name, [=](benchmark_timer& timer) {
+        std::unordered_map<int, int> map;
+        benchmark_keys keys(0);
+        for (long i = 0;i < total;i++) {
+            int const key = keys.next(key_range);
+            if (i % 10) {
+                timer.measure([&] {
+                    auto const found = map.find(key);
+                    if (found == map.end()) { map[key] = key; return key; }
+                    return found->second;
+                });
+            }
+            else { timer.measure([&] { map[key] = key; }); }
+        }
+    });
+    //串行基准没有容量限制,缓存只能容纳一半的键,未命中时回源再写入,淘汰的开销也计入测试
+    for (int threads : suite.thread_counts()) {
+        for (int num_shards : { 1, 19 }) {
+            thread_safe_cache<int, int> cache(capacity, num_shards);
+            suite.run(name, "shards-" + std::to_string(num_shards), threads, [&](int index, benchmark_timer& timer) {
+                benchmark_keys keys(index);
+                for (long i = 0;i < total / threads;i++) {
+                    int const key = keys.next(key_range);
+                    if (i % 10) {
+                        timer.measure([&] {
+                            int const value = cache.value_for(key, -1);
+                            if (value < 0) { cache.update_map(key, key); return key; }
+                            return value;
+                        });
+                    }
+                    else { timer.measure([&] { cache.update_map(key, key); }); }
+                }
+            });
+        }
+    }
+    //只有一个分片时所有线程竞争同一把读写锁,未命中的写入会阻塞所有读者
+}
+template<typename List>
+void benchmark_list(benchmark_suite& suite, char const* name, long total) {
+    int const length = 256;
+    suite.serial(name, [=](benchmark_timer& timer) {
+        std::list<int> list;
+        for (int i = 0;i < length;i++) { list.push_front(i); }
+        benchmark_keys keys(0);
+        for (long i = 0;i < total;i++) {
+            int const key = keys.next(length);
+            if (i % 16) { timer.measure([&] { return std::find(list.begin(), list.end(), key) != list.end(); }); }
+            else {
+                timer.measure([&] { list.push_front(length + key); });
+                timer.measure([&] { list.remove(length + key); });
+            }
+        }
+    });
+    for (int threads : suite.thread_counts()) {
+        List list;
+        for (int i = 0;i < length;i++) { list.push_front(i); }
+        suite.run(name, "find-88%", threads, [&](int index, benchmark_timer& timer) {
+            benchmark_keys keys(index);
+            for (long i = 0;i < total / threads;i++) {
+                int const key = keys.next(length);
+                if (i % 16) { timer.measure([&] { list.find_first_if([key](int value) { return value == key; }); }); }
+                else {
+                    timer.measure([&] { list.push_front(length + key); });
+                    timer.measure([&] { list.remove_if([&](int value) { return value == length + key; }); });
+                }
+            }
+        });
+        //每16次操作中有一次插入再删除一个临时元素,链表的长度基本不变
+    }
+}
+
+//chapter6-2:与thread_safe_stack的结果对比,每次push都要分配节点,pop要对head做两次比较交换
+void benchmark_lock_free_stack(benchmark_suite& suite, long total) {
+    suite.serial("lock_free_stack", [=](benchmark_timer& timer) {
+        std::stack<int> stk;
+        for (long i = 0;i < total / 2;i++) {
+            timer.measure([&] { stk.push(i); });
+            timer.measure([&] { stk.pop(); });
+        }
+    });
+    for (int threads : suite.thread_counts()) {
+        lock_free_stack<int> stk;
+        suite.run("lock_free_stack", "push+pop", threads, [&](int index, benchmark_timer& timer) {
+            for (long i = 0;i < total / 2 / threads;i++) {
+                timer.measure([&] { stk.push(index); });
+                timer.measure([&] { return stk.pop(); });
+            }
+        });
+    }
+}
+
+//lock_free_queue的push和pop都要在head或tail上增加外部计数,再通过内部计数释放节点,开销比栈更大
+void benchmark_lock_free_queue(benchmark_suite& suite, long total) {
+    suite.serial("lock_free_queue", [=](benchmark_timer& timer) {
+        std::queue<int> que;
+        for (long i = 0;i < total / 2;i++) {
+            timer.measure([&] { que.push(i); });
+            timer.measure([&] { que.pop(); });
+        }
+    });
+    for (int threads : suite.thread_counts()) {
+        lock_free_queue<int> que;
+        suite.run("lock_free_queue", "push+pop", threads, [&](int index, benchmark_timer& timer) {
+            for (long i = 0;i < total / 2 / threads;i++) {
+                timer.measure([&] { que.push(index); });
+                timer.measure([&] { return que.pop(); });
+            }
+        });
+        //每个线程先push后pop,pop时队列不会为空,结束后队列应为空
+        if (que.pop()) { std::cout << "lock_free_queue: not empty after " << threads << " threads\n"; }
+    }
+}
+
+//chapter6-4:90%查找,5%插入,5%删除,键在[0, key_range)中随机选择,开始前插入一半的键
+//串行基准使用不加锁的std::map,另外与std::map加全局读写锁(dns_cache的做法)比较
+template<typename Find, typename Insert, typename Erase>
+void skip_list_ops(benchmark_timer& timer, long count, int index, int key_range, Find find, Insert insert, Erase erase) {
+    benchmark_keys keys(index);
+    for (long i = 0;i < count;i++) {
+        int const key = keys.next(key_range);
+        int const op = int(i % 20);
+        if (op == 0) { timer.measure([&] { return insert(key); }); }
+        else if (op == 1) { timer.measure([&] { return erase(key); }); }
+        else { timer.measure([&] { return find(key); }); }
+    }
+}
+void benchmark_skip_list(benchmark_suite& suite, long total) {
+    int const key_range = 1 << 14;
+    char const* const name = "lock_free_skip_list find-90%";
+    suite.serial(name, [=](benchmark_timer& timer) {
+        std::map<int, int> map;
+        for (int key = 0;key < key_range;key += 2) { map.emplace(key, key); }
+        skip_list_ops(timer, total, 0, key_range,
+                      [&](int key) { return map.find(key) != map.end(); },
+                      [&](int key) { return map.emplace(key, key).second; },
+                      [&](int key) { return map.erase(key) != 0; });
+    });
+    for (int threads : suite.thread_counts()) {
+        lock_free_skip_list<int, int> list;
+        for (int key = 0;key < key_range;key += 2) { list.insert(key, key); }
+        suite.run(name, "lock-free", threads, [&](int index, benchmark_timer& timer) {
+            skip_list_ops(timer, total / threads, index, key_range,
+                          [&](int key) { return list.contains(key); },
+                          [&](int key) { return list.insert(key, key); },
+                          [&](int key) { return list.erase(key); });
+        });
+        std::map<int, int> map;
+        std::shared_mutex mtx;
+        for (int key = 0;key < key_range;key += 2) { map.emplace(key, key); }
+        suite.run(name, "map+shared_mutex", threads, [&](int index, benchmark_timer& timer) {
+            skip_list_ops(timer, total / threads, index, key_range,
+                          [&](int key) { std::shared_lock<std::shared_mutex> lock(mtx); return map.find(key) != map.end(); },
+                          [&](int key) { std::lock_guard<std::shared_mutex> lock(mtx); return map.emplace(key, key).second; },
+                          [&](int key) { std::lock_guard<std::shared_mutex> lock(mtx); return map.erase(key) != 0; });
+        });
+        bool ordered = true;
+        int previous = -1;
+        list.for_each([&](int key, int value) {
+            if (key <= previous || key != value) { ordered = false; }
+            previous = key;
+        });
+        if (!ordered) { std::cout << "lock_free_skip_list: out of order after " << threads << " threads\n"; }
+    }
+    //读者不获取任何锁,写者只在插入和删除的节点附近做CAS,线程数增加时不会像全局读写锁那样在同一个缓存行上竞争
+}
+
+//chapter7-1:每次测量前把数据恢复为同一组随机键,恢复的时间不计入
+//吞吐量按元素计算,串行基准分别是std::sort和对下标的std::stable_sort
+void benchmark_sorts(benchmark_suite& suite, long length) {
+    int const reps = 4;
+    std::vector<std::uint32_t> data(length);
+    std::uint64_t state = 0x9E3779B97F4A7C15ull;
+    for (std::uint32_t& key : data) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        key = std::uint32_t(state);
+    }
+    std::vector<std::uint32_t> work(length);
+    for (char const* name : { "parallel_sort", "parallel_radix_sort" }) {
+        suite.serial(name, [&](benchmark_timer& timer) {
+            for (int i = 0;i < reps;i++) {
+                work = data;
+                timer.measure([&] { std::sort(work.begin(), work.end()); }, length);
+            }
+        });
+    }
+    suite.serial("parallel_radix_argsort", [&](benchmark_timer& timer) {
+        for (int i = 0;i < reps;i++) {
+            timer.measure([&] {
+                std::vector<std::size_t> indices(data.size());
+                std::iota(indices.begin(), indices.end(), std::size_t(0));
+                std::stable_sort(indices.begin(), indices.end(),
+                                 [&](std::size_t a, std::size_t b) { return data[a] < data[b]; });
+                return indices.size();
+            }, length);
+        }
+    });
+    for (int threads : suite.thread_counts()) {
+        thread_pool4 pool(threads);
+        suite.run_caller("parallel_sort", "merge", threads, [&](benchmark_timer& timer) {
+            for (int i = 0;i < reps;i++) {
+                work = data;
+                timer.measure([&] { parallel_sort(work.begin(), work.end(), std::less<>(), pool); }, length);
+            }
+        });
+        if (!std::is_sorted(work.begin(), work.end())) { std::cout << "parallel_sort: not sorted\n"; }
+        suite.run_caller("parallel_radix_sort", "lsd", threads, [&](benchmark_timer& timer) {
+            for (int i = 0;i < reps;i++) {
+                work = data;
+                timer.measure([&] { parallel_radix_sort(work.begin(), work.end(), pool); }, length);
+            }
+        });
+        if (!std::is_sorted(work.begin(), work.end())) { std::cout << "parallel_radix_sort: not sorted\n"; }
+        std::vector<std::size_t> order;
+        suite.run_caller("parallel_radix_argsort", "lsd", threads, [&](benchmark_timer& timer) {
+            for (int i = 0;i < reps;i++) {
+                timer.measure([&] { order = parallel_radix_argsort(data.begin(), data.end(), pool); }, length);
+            }
+        });
+        if (!std::is_sorted(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+            return data[a] < data[b] || (data[a] == data[b] && a < b); })) {
+            std::cout << "parallel_radix_argsort: not stable\n";
+        }
+    }
+}
+
+//chapter7-4:吞吐量按元素计算,串行基准是对应的标准库算法
+//数据使用无符号类型,变换和前缀和的溢出是定义良好的回绕
+void benchmark_adaptive_algorithms(benchmark_suite& suite, long length) {
+    int const reps = 8;
+    std::vector<std::uint32_t> data(length);
+    std::vector<unsigned long> sums(length);
+    auto const mix = [](std::uint32_t& value) { value = value * 2654435761u + 1; };
+    std::uint32_t const needle = std::uint32_t(length - length / 4);
+    //查找的目标在3/4处,左侧的块都要扫描完,右侧的块应该被取消,吞吐量只计算到匹配为止的元素
+    auto const match = [needle](std::uint32_t value) { return value == needle; };
+    suite.serial("parallel_for_each", [&](benchmark_timer& timer) {
+        for (int i = 0;i < reps;i++) {
+            timer.measure([&] { std::for_each(data.begin(), data.end(), mix); }, length);
+        }
+    });
+    std::iota(data.begin(), data.end(), 0u);
+    suite.serial("parallel_find_if", [&](benchmark_timer& timer) {
+        for (int i = 0;i < reps;i++) {
+            timer.measure([&] { return std::find_if(data.begin(), data.end(), match) - data.begin(); }, needle + 1);
+        }
+    });
+    suite.serial("parallel_partal_sum", [&](benchmark_timer& timer) {
+        for (int i = 0;i < reps;i++) {
+            std::fill(sums.begin(), sums.end(), 1ul);
+            timer.measure([&] { std::partial_sum(sums.begin(), sums.end(), sums.begin()); }, length);
+        }
+    });
+    for (int threads : suite.thread_counts()) {
+        thread_pool4 pool(threads);
+        suite.run_caller("parallel_for_each", "adaptive", threads, [&](benchmark_timer& timer) {
+            for (int i = 0;i < reps;i++) {
+                timer.measure([&] { parallel_for_each(data.begin(), data.end(), mix, pool); }, length);
+            }
+        });
+        std::iota(data.begin(), data.end(), 0u);
+        std::vector<std::uint32_t>::iterator found;
+        suite.run_caller("parallel_find_if", "adaptive", threads, [&](benchmark_timer& timer) {
+            for (int i = 0;i < reps;i++) {
+                timer.measure([&] { found = parallel_find_if(data.begin(), data.end(), match, pool); }, needle + 1);
+            }
+        });
+        if (found == data.end() || *found != needle) { std::cout << "parallel_find_if: wrong match\n"; }
+        suite.run_caller("parallel_partal_sum", "scan", threads, [&](benchmark_timer& timer) {
+            for (int i = 0;i < reps;i++) {
+                std::fill(sums.begin(), sums.end(), 1ul);
+                timer.measure([&] { parallel_partal_sum(sums.begin(), sums.end(), pool); }, length);
+            }
+        });
+        if (sums.back() != static_cast<unsigned long>(length)) { std::cout << "parallel_partal_sum: wrong sum\n"; }
+    }
+}
+
+//chapter7-2:缓存行填充的效果(cache_padded定义在headfile.h中)
+//第一项测试在同一个程序中对比:每个线程只修改自己的计数器,计数器连续存放或者各自独占一个缓存行
+//连续存放时没有任何数据被共享,但8个计数器落在同一个缓存行上,每次修改都要从其他核心取回缓存行的所有权
+//第二项测试使用headfile.h中已经填充过的容器,分别用默认方式和-DNO_CACHE_PADDING编译,比较两次输出的CSV
+//单核的机器上线程不会同时运行,看不到差别
+template<typename Counter>
+void benchmark_per_thread_counters(benchmark_suite& suite, char const* config, long total) {
+    for (int threads : suite.thread_counts()) {
+        std::vector<Counter> counters(threads);
+        suite.run("per-thread counters", config, threads, [&](int index, benchmark_timer& timer) {
+            Counter& counter = counters[index];
+            for (long i = total / threads;i > 0;i--) {
+                timer.measure([&] { counter.fetch_add(1, std::memory_order_relaxed); });
+            }
+        });
+    }
+}
+
+void benchmark_counters(benchmark_suite& suite, long total) {
+    suite.serial("per-thread counters", [=](benchmark_timer& timer) {
+        long counter = 0;
+        for (long i = 0;i < total;i++) { timer.measure([&] { return ++counter; }); }
+    });
+    benchmark_per_thread_counters<std::atomic<long>>(suite, "adjacent", total);
+    benchmark_per_thread_counters<cache_padded<std::atomic<long>>>(suite, "cache_padded", total);
+}
+
+void benchmark_padded_structures(benchmark_suite& suite, long total) {
+    std::string const padding = cache_padding_alignment > 1 ? "padded" : "unpadded";
+    for (int threads : suite.thread_counts()) {
+        if (threads > 1) {
+            thread_safe_queue<int> queue;
+            suite.run("thread_safe_queue", padding + " producers:consumers=1:1", threads, [&](int index, benchmark_timer& timer) {
+                int const producers = threads / 2;
+                long const items = total / 2;
+                if (index < producers) {
+                    for (long i = items / producers + (index < items % producers);i > 0;i--) {
+                        timer.measure([&] { queue.push(index); });
+                    }
+                    return;
+                }
+                int const consumers = threads - producers;
+                int value;
+                for (long i = items / consumers + (index - producers < items % consumers);i > 0;i--) {
+                    timer.measure([&] { queue.wait_pop(value); });
+                }
+            });
+            //两把锁在不同的缓存行上,但消费者也要获取tail_mtx读取tail,生产者也要获取一次head_mtx,两侧仍然共享缓存行
+        }
+        std::vector<std::unique_ptr<work_steal_queue>> queues;
+        for (int i = 0;i < threads;i++) { queues.push_back(std::unique_ptr<work_steal_queue>(new work_steal_queue)); }
+        suite.run("work_steal_queue", padding + " owner-only", threads, [&](int index, benchmark_timer& timer) {
+            work_steal_queue& own = *queues[index];
+            function_wrapper task;
+            for (long i = total / 2 / threads;i > 0;i--) {
+                timer.measure([&] { own.push(function_wrapper([] {})); });
+                timer.measure([&] { own.try_pop(task); });
+            }
+        });
+        //每个线程只访问自己的队列,没有填充时相邻分配的队列的锁可能在同一个缓存行上
+        thread_pool4 pool(threads);
+        suite.run_caller("thread_pool4", padding + " nested-submit", threads, [&](benchmark_timer& timer) {
+            int const batch = 64;
+            for (long i = total / batch / 4;i > 0;i--) {
+                timer.measure([&] {
+                    std::future<void> root = pool.submit([&pool] {
+                        std::vector<std::future<void>> futures(batch);
+                        for (int j = 0;j < batch;j++) { futures[j] = pool.submit([] {}); }
+                        for (int j = 0;j < batch;j++) { pool.wait(futures[j]); }
+                    });
+                    pool.wait(root);
+                }, batch);
+            }
+        });
+        //每个任务都会修改pending并读取done,sleepers和future_waiters
+    }
+}
+
+//processing_loop的三种写法:每项fetch_add一次共享计数器,分片计数,批量领取
+//"work claiming"测试领取工作项的开销,"event counter"测试统计计数器的开销,两者的串行基准都是普通的long
+void benchmark_contended_counters(benchmark_suite& suite, long total) {
+    suite.serial("work claiming", [=](benchmark_timer& timer) {
+        long next = 0;
+        bool more = true;
+        while (more) { timer.measure_counted([&] { more = next++ < total; return more ? 1 : 0; }); }
+    });
+    suite.serial("event counter", [=](benchmark_timer& timer) {
+        long counter = 0;
+        for (long i = 0;i < total;i++) { timer.measure([&] { return ++counter; }); }
+    });
+    long const batch = 64;
+    for (int threads : suite.thread_counts()) {
+        std::atomic<long> next(0);
+        suite.run("work claiming", "atomic fetch_add", threads, [&](int, benchmark_timer& timer) {
+            bool more = true;
+            while (more) { timer.measure_counted([&] { more = next.fetch_add(1, std::memory_order_relaxed) < total; return more ? 1 : 0; }); }
+        });
+        range_claimer work(0, total, batch);
+        suite.run("work claiming", "range_claimer batch=64", threads, [&](int, benchmark_timer& timer) {
+            long begin = 0, end = 0;
+            bool more = true;
+            while (more) { timer.measure_counted([&] { more = work.claim(begin, end); return more ? end - begin : 0; }); }
+        });
+        //吞吐量按实际领取到的项数计算:最后一段可能不足batch项,每个线程最后一次失败的领取不计入
+        std::atomic<long> shared(0);
+        suite.run("event counter", "atomic fetch_add", threads, [&](int index, benchmark_timer& timer) {
+            for (long i = total / threads + (index < total % threads);i > 0;i--) {
+                timer.measure([&] { shared.fetch_add(1, std::memory_order_relaxed); });
+            }
+        });
+        sharded_counter counter;
+        suite.run("event counter", "sharded_counter", threads, [&](int index, benchmark_timer& timer) {
+            for (long i = total / threads + (index < total % threads);i > 0;i--) {
+                timer.measure([&] { counter.add(); });
+            }
+        });
+        if (counter.exact() != total || shared.load() != total) {
+            std::cerr << "event counter: expected " << total << ", sharded " << counter.exact()
+                << ", shared " << shared.load() << "\n";
+        }
+        //所有线程结束后exact()一定等于total,approximate()最多少 分片数 * batch
+    }
+}
+
+//chapter8-1:thread_pool的任务没有返回值,用计数器等待一批任务完成
+//thread_pool2和thread_pool3只是书中的示意(没有创建工作线程,thread_pool2的submit也没有把任务放入队列),无法参与测试
+void benchmark_thread_pool(benchmark_suite& suite, long total) {
+    int const batch = 64;
+    int const work = 200;
+    long const batches = std::max(1L, total / batch / 4);
+    suite.serial("thread_pool", [=](benchmark_timer& timer) {
+        for (long i = 0;i < batches;i++) {
+            timer.measure([&] { for (int j = 0;j < batch;j++) { busy_work(work); } }, batch);
+        }
+    });
+    for (int threads : suite.thread_counts()) {
+        thread_pool pool(threads);
+        suite.run_caller("thread_pool", "external-submit", threads, [&](benchmark_timer& timer) {
+            std::atomic<int> remaining(0);
+            for (long i = 0;i < batches;i++) {
+                timer.measure([&] {
+                    remaining = batch;
+                    for (int j = 0;j < batch;j++) { pool.submit([&remaining, work] { busy_work(work); remaining--; }); }
+                    while (remaining.load()) { std::this_thread::yield(); }
+                }, batch);
+            }
+        });
+        //与thread_pool4的external-submit是同样的工作量,所有任务都经过一个加锁的全局队列
+    }
+}
+
+int main(int argc, char* argv[]) {
+    std::string const format = argc > 1 ? argv[1] : "csv";
+    long const total = argc > 2 ? std::atol(argv[2]) : 200000;
+    benchmark_suite suite;
+    benchmark_stack(suite, total);
+    benchmark_queue(suite, total);
+    benchmark_work_steal_queue(suite, total);
+    benchmark_thread_pool4(suite, total);
+    benchmark_algorithms(suite, total);
+    benchmark_table(suite, total);
+    benchmark_cache(suite, total);
+    benchmark_list<thread_safe_list<int>>(suite, "thread_safe_list", total / 10);
+    benchmark_list<lazy_thread_safe_list<int>>(suite, "lazy_thread_safe_list", total / 10);
+    benchmark_list<unrolled_thread_safe_list<int>>(suite, "unrolled_thread_safe_list", total / 10);
+    benchmark_lock_free_stack(suite, total);
+    benchmark_lock_free_queue(suite, total);
+    benchmark_skip_list(suite, total);
+    benchmark_sorts(suite, std::max(1L << 16, total * 4));
+    benchmark_adaptive_algorithms(suite, std::max(1L << 16, total * 4));
+    benchmark_counters(suite, total * 10);
+    benchmark_padded_structures(suite, total);
+    benchmark_contended_counters(suite, total * 10);
+    benchmark_thread_pool(suite, total);
+    suite.write(std::cout, format);
+}
@@ -387,6 +387,7 @@ void func7() {
 //find_entry使用shared_lock来保护共享和只读数据,使得多线程可同时调用且不会出错
 //update_entry使用lock_guard在表格需要更新时为其提供独占访问权
 //并阻止其他线程修改数据或调用find_entry;
+//这里的entries会无限增长,并且所有读者都争用同一个读写锁,需要限制内存时可以使用chapter5中分片的thread_safe_cache
 
 //大多数情况当需要嵌套锁时,就要对代码设计进行改动
 //嵌套锁一般用在可并发访问的类上,所以使用互斥量保护其成员数据
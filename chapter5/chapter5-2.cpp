@@ -1,50 +1,223 @@
+#if !defined(CHAPTER_BENCHMARKS)
+#define SCHEDULE_TEST   //启用调度点,main中用run_schedule_test检查thread_safe_table
+#endif
+//chapter10-2包含这个文件做性能测试时定义了CHAPTER_BENCHMARKS,调度点是空函数,这里的main不参与编译
 #include "../headfile.h"
 
 //线程安全查询表 map
 
+//并发的布隆过滤器
+//用一组位表示"可能存在"的集合:插入时将k个哈希位置的位置为1,查询时只要有一个位为0,则该元素一定不存在
+//位数组由原子的64位字组成,插入使用fetch_or,查询只需要relaxed读取,读者之间完全不会互相影响
+//布隆过滤器不支持删除,删除的数据只能通过重建来清除,否则过滤器会逐渐失去作用
+class concurrent_bloom_filter {
+private:
+    std::vector<std::atomic<std::uint64_t>> words;
+    std::size_t const num_bits;
+    int const num_hashes;
+    static constexpr int max_hashes = 16;
+    static std::uint64_t mix(std::uint64_t x) {
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }//std::hash对整数通常是恒等映射,需要打散后再使用
+public:
+    static std::size_t bits_for(std::size_t expected, double false_positive) {
+        double const bits = -double(expected) * std::log(false_positive) / (std::log(2.0) * std::log(2.0));
+        return std::max<std::size_t>(64, (std::size_t(bits) + 63) / 64 * 64);
+    }
+    concurrent_bloom_filter(std::size_t expected, double false_positive = 0.01) :
+        words(bits_for(expected, false_positive) / 64),
+        num_bits(bits_for(expected, false_positive)),
+        num_hashes(std::min(max_hashes, std::max(1, int(std::lround(double(num_bits) / std::max<std::size_t>(1, expected) * std::log(2.0)))))) {
+        clear();
+    }//m = -n*ln(p)/(ln2)^2 个位, k = m/n*ln2 个哈希函数
+    //expected很小时最少的64个位会让k变得很大,每次查询都要读取几十个位,k限制在max_hashes以内
+    concurrent_bloom_filter(concurrent_bloom_filter const& other) = delete;
+    concurrent_bloom_filter& operator=(concurrent_bloom_filter const& other) = delete;
+    void insert(std::size_t hash) {
+        std::uint64_t const h1 = mix(hash);
+        std::uint64_t const h2 = mix(h1) | 1;
+        for (int i = 0;i < num_hashes;i++) {
+            std::size_t const bit = (h1 + i * h2) % num_bits;
+            std::uint64_t const mask = std::uint64_t(1) << (bit % 64);
+            std::atomic<std::uint64_t>& word = words[bit / 64];
+            if (!(word.load(std::memory_order_relaxed) & mask)) {
+                word.fetch_or(mask, std::memory_order_release);
+            }
+            //已经置位时不再写入,避免无意义的缓存行转移
+        }
+    }//使用双重哈希(h1 + i*h2)由一个哈希值得到k个位置
+    bool may_contain(std::size_t hash) const {
+        std::uint64_t const h1 = mix(hash);
+        std::uint64_t const h2 = mix(h1) | 1;
+        for (int i = 0;i < num_hashes;i++) {
+            std::size_t const bit = (h1 + i * h2) % num_bits;
+            if (!(words[bit / 64].load(std::memory_order_relaxed) & (std::uint64_t(1) << (bit % 64)))) {
+                return false;
+            }
+        }
+        return true;
+    }
+    void clear() {
+        for (std::size_t i = 0;i < words.size();i++) { words[i].store(0, std::memory_order_relaxed); }
+    }
+    std::size_t bit_count() const { return num_bits; }
+};
+
 template <typename Key, typename Value, typename Hash = std::hash<Key>>
 class thread_safe_table {
 private:
     using bucket_value = std::pair<Key, Value>;
     using bucket_data = std::list<bucket_value>;
     using bucket_iterator = typename bucket_data::iterator;
+    using bucket_const_iterator = typename bucket_data::const_iterator;
+    class table_filter;
+    typedef profiled_mutex<std::shared_mutex> bucket_mutex;
     class bucket_type {
     private:
+        friend class thread_safe_table;
         bucket_data data;
-        mutable std::shared_mutex mtx;
+        mutable cache_padded<bucket_mutex> mtx{ "thread_safe_table::bucket" };
         //这里的锁只在共享所有权和获取唯一读写权时上锁使用
-        bucket_iterator find_entry(Key const& key) const {
+        //定义LOCK_PROFILE时统计所有桶的锁竞争,否则就是std::shared_mutex
+        //每个桶单独分配,填充后相邻的两个桶的锁不会落在同一个缓存行上
+        bucket_iterator find_entry(Key const& key) {
             return std::find_if(data.begin(), data.end(),
                                 [&](bucket_value const& item) { return item.first == key; });
         }//确认数据是否在桶中
+        bucket_const_iterator find_entry(Key const& key) const {
+            return std::find_if(data.begin(), data.end(),
+                                [&](bucket_value const& item) { return item.first == key; });
+        }
     public:
-        Value value(Key const& key, Value const& default_value) const {
-            std::shared_lock<std::shared_mutex> lk(mtx);
-            bucket_iterator const found_entry = find_entry(key);
+        Value value_for(Key const& key, Value const& default_value) const {
+            schedule_point();
+            std::shared_lock<bucket_mutex> lk(mtx);
+            bucket_const_iterator const found_entry = find_entry(key);
             return (found_entry == data.end() ? default_value : found_entry->second);
         }
-        void update_map(Key const& key, Value const& value) {
-            std::unique_lock<std::shared_mutex> lk(mtx);
+        void update_map(Key const& key, Value const& value,
+                        table_filter* filter = nullptr, std::size_t hash = 0) {
+            schedule_point();
+            std::unique_lock<bucket_mutex> lk(mtx);
             bucket_iterator const found_entry = find_entry(key);
             if (found_entry == data.end()) {
+                if (filter) { filter->insert(hash); }
                 data.push_back(bucket_value(key, value));
             }
             else { found_entry->second = value; }
+            //过滤器的位在持有桶锁时,并且在数据可见之前设置
+            //这样重建过滤器(会锁住所有桶)时不会遗漏正在插入的键
         }
-        void remove_map(Key const& key) {
-            std::unique_lock<std::shared_mutex> lk(mtx);
+        bool remove_map(Key const& key, table_filter* filter = nullptr) {
+            schedule_point();
+            std::unique_lock<bucket_mutex> lk(mtx);
             bucket_iterator const found_entry = find_entry(key);
             if (found_entry != data.end()) {
                 data.erase(found_entry);
+                if (filter) { filter->erase(); }
+                return true;
             }
+            return false;
+        }
+        //删除的计数也在持有桶锁时增加,重建(锁住所有桶)把计数清零后,不会再有重建之前的删除被计入
+    };
+    //查询表前的过滤器
+    //大部分查询未命中时,每次查询都要获取桶的共享锁并遍历整条链表,而过滤器可以在不接触桶的情况下直接排除不存在的键
+    //删除操作会使过滤器中留下无用的位,删除过多或者元素数量超过过滤器的预期容量时需要重建
+    //重建在一个备用的过滤器上进行,完成后再切换,读者通过版本号(类似顺序锁)判断读取期间过滤器是否被重写
+    class table_filter {
+    private:
+        std::atomic<concurrent_bloom_filter*> active;
+        std::atomic<Ulong> version;
+        std::vector<std::unique_ptr<concurrent_bloom_filter>> filters;
+        //被替换下来的过滤器不会释放,仍可能有读者在读取它,过滤器按倍数增长,所以总内存不超过最终大小的两倍
+        std::atomic<std::size_t> expected;
+        cache_padded<std::atomic<std::size_t>> inserted;
+        std::atomic<std::size_t> removed;
+        //每次查询都读取active和version,而每次插入都修改inserted,计数器从新的缓存行开始,插入不会让查询的缓存行失效
+        std::mutex rebuild_mtx;
+        friend class thread_safe_table;
+    public:
+        explicit table_filter(std::size_t expected_) :
+            version(0), expected(expected_), inserted(0), removed(0) {
+            filters.push_back(std::unique_ptr<concurrent_bloom_filter>(new concurrent_bloom_filter(expected_)));
+            active.store(filters.back().get());
+        }
+        void insert(std::size_t hash) {
+            active.load(std::memory_order_acquire)->insert(hash);
+            inserted.fetch_add(1, std::memory_order_relaxed);
+        }
+        void erase() { removed.fetch_add(1, std::memory_order_relaxed); }
+        bool definitely_absent(std::size_t hash) const {
+            Ulong const version_before = version.load(std::memory_order_acquire);
+            schedule_point();
+            bool const maybe = active.load(std::memory_order_acquire)->may_contain(hash);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            schedule_point();
+            return !maybe && version.load(std::memory_order_relaxed) == version_before;
+            //读取期间发生了重建,读到的位可能正在被清除,此时不能相信否定的结果,交给桶去查询
         }
+        bool need_rebuild() const {
+            std::size_t const ins = inserted.load(std::memory_order_relaxed);
+            std::size_t const rem = removed.load(std::memory_order_relaxed);
+            std::size_t const count = ins > rem ? ins - rem : 0;
+            return (rem > 64 && rem * 2 > ins) || count > expected.load(std::memory_order_relaxed) * 2;
+        }//超过一半的键已经被删除,或者元素数量超过了过滤器的预期容量
+        //两个计数器分别读取,其他线程在两次读取之间的插入和删除可能让rem大于ins,相减前需要检查
     };
     std::vector<std::unique_ptr<bucket_type>> buckets;
     Hash hashes;
-    bucket_type& get_bucket(Key const& key) const {
-        std::size_t const bucket_index = hashes(key) % buckets.size();
+    std::unique_ptr<table_filter> filter;
+    bucket_type& get_bucket(std::size_t hash) const {
+        std::size_t const bucket_index = hash % buckets.size();
         return *buckets[bucket_index];
     }
+    void rebuild_filter() {
+        std::unique_lock<std::mutex> rebuild_lk(filter->rebuild_mtx, std::try_to_lock);
+        if (!rebuild_lk.owns_lock() || !filter->need_rebuild()) { return; }
+        //同一时间只需要一个线程进行重建
+        std::vector<std::unique_lock<bucket_mutex>> lks;
+        for (std::size_t i = 0;i < buckets.size();i++) {
+            lks.push_back(std::unique_lock<bucket_mutex>(buckets[i]->mtx));
+        }
+        //和get_map一样按照桶的顺序上锁,重建期间不会有新的键插入
+        std::size_t count = 0;
+        for (std::size_t i = 0;i < buckets.size();i++) { count += buckets[i]->data.size(); }
+        std::size_t expected = filter->expected.load(std::memory_order_relaxed);
+        if (count > expected) {
+            expected = count * 2;
+            filter->expected.store(expected, std::memory_order_relaxed);
+        }
+        concurrent_bloom_filter* const current = filter->active.load(std::memory_order_relaxed);
+        concurrent_bloom_filter* target = nullptr;
+        std::size_t const bits = concurrent_bloom_filter::bits_for(expected, 0.01);
+        for (std::size_t i = 0;i < filter->filters.size();i++) {
+            if (filter->filters[i].get() != current && filter->filters[i]->bit_count() == bits) {
+                target = filter->filters[i].get();
+            }
+        }
+        if (!target) {
+            filter->filters.push_back(std::unique_ptr<concurrent_bloom_filter>(
+                new concurrent_bloom_filter(expected)));
+            target = filter->filters.back().get();
+        }
+        filter->version.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        //先增加版本号再清除位,读到被清除的位的读者一定能看到新的版本号
+        target->clear();
+        for (std::size_t i = 0;i < buckets.size();i++) {
+            for (bucket_iterator it = buckets[i]->data.begin();it != buckets[i]->data.end();it++) {
+                target->insert(hashes(it->first));
+            }
+        }
+        filter->active.store(target, std::memory_order_release);
+        filter->version.fetch_add(1, std::memory_order_release);
+        filter->inserted.store(count, std::memory_order_relaxed);
+        filter->removed.store(0, std::memory_order_relaxed);
+    }
 public:
     thread_safe_table(int num_buckets = 19, Hash const& hashes_ = Hash()) :
         buckets(num_buckets), hashes(hashes_) {
@@ -52,27 +225,38 @@ public:
             buckets[i].reset(new bucket_type);
         }
     }//指定默认数量为19(哈希表在质数个桶时效率最高)
+    thread_safe_table(int num_buckets, std::size_t expected_elements, Hash const& hashes_ = Hash()) :
+        thread_safe_table(num_buckets, hashes_) {
+        filter.reset(new table_filter(expected_elements));
+    }//指定预期的元素数量时,在查询表前维护一个布隆过滤器
     thread_safe_table(thread_safe_table const& other) = delete;
     thread_safe_table& operator=(thread_safe_table const& other) = delete;
     Value value_for(Key const& key, Value const& default_value = Value()) const {
-        return get_bucket(key).value_for(key, default_value);
+        std::size_t const hash = hashes(key);
+        if (filter && filter->definitely_absent(hash)) { return default_value; }
+        //未命中的查询在这里直接返回,不需要获取桶的锁
+        return get_bucket(hash).value_for(key, default_value);
         //数量固定 因此可以无锁调用
     }
     void update_map(Key const& key, Value const& value) {
-        get_bucket(key).update_map(key, value);
+        std::size_t const hash = hashes(key);
+        get_bucket(hash).update_map(key, value, filter.get(), hash);
+        if (filter && filter->need_rebuild()) { rebuild_filter(); }
     }
     void remove_map(Key const& key) {
-        get_bucket(key).remove_map(key);
+        std::size_t const hash = hashes(key);
+        if (get_bucket(hash).remove_map(key, filter.get()) && filter && filter->need_rebuild()) { rebuild_filter(); }
     }
     std::map<Key, Value> get_map() const {
-        std::vector<std::unique_lock<std::shared_mutex>> lks;
+        schedule_point();
+        std::vector<std::unique_lock<bucket_mutex>> lks;
         for (int i = 0;i < buckets.size();i++) {
-            lks.push_back(std::unique_lock<std::shared_mutex>(buckets[i].mtx));
+            lks.push_back(std::unique_lock<bucket_mutex>(buckets[i]->mtx));
         }
         std::map<Key, Value> res;
         for (int i = 0;i < buckets.size();i++) {
-            for (bucket_iterator it = buckets[i].data.begin();
-                 it != buckets[i].data.end();it++) {
+            for (bucket_iterator it = buckets[i]->data.begin();
+                 it != buckets[i]->data.end();it++) {
                 res.insert(*it);
             }
         }
@@ -86,6 +270,166 @@ public:
     //并且通过使用std::shared_mutex允许读者线程对每一个桶并发访问,增大了并发访问的能力
 };
 
+//有界的线程安全缓存
+//和thread_safe_table一样按哈希值将数据划分到多个分片(shard)中,每个分片拥有独立的读写锁
+//每个分片的槽位数量在构造时就已固定,因此缓存整体占用的内存是有上限的
+//分片满载时使用CLOCK算法淘汰:每个槽位有一个访问位,命中时置位,淘汰指针扫过时将其清零,遇到未置位的槽位就将其淘汰
+//命中路径只持有共享锁,访问位是原子变量,只需要近似的记录最近是否被访问过,因此使用relaxed内存序即可
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class thread_safe_cache {
+public:
+    struct cache_stats {
+        Ulong hits;
+        Ulong misses;
+        Ulong evictions;
+    };
+private:
+    using time_point = SteadyClock::time_point;
+    struct slot_type {
+        Key key;
+        Value value;
+        time_point expire;
+        mutable std::atomic<bool> referenced;
+        bool used;
+        slot_type() :expire(time_point::max()), referenced(false), used(false) {}
+    };
+    class shard_type {
+    private:
+        std::vector<slot_type> slots;
+        std::unordered_map<Key, std::size_t, Hash> index;
+        std::vector<std::size_t> free_slots;
+        std::size_t hand;
+        mutable cache_padded<std::shared_mutex> mtx;
+        //分片连续存放,对齐后不同分片的锁和计数器不会共享缓存行
+        mutable sharded_counter hits;
+        mutable sharded_counter misses;
+        std::atomic<Ulong> evictions;
+        //命中和未命中在只持有共享锁的读者中统计,使用分片计数器(headfile.h),读者不会修改同一个缓存行
+        //淘汰只在持有独占锁时发生,普通的原子变量就足够了
+        static bool expired(slot_type const& slot, time_point now) {
+            return slot.expire != time_point::max() && slot.expire <= now;
+        }
+        void release_slot(std::size_t i) {
+            index.erase(slots[i].key);
+            slots[i].used = false;
+        }
+        std::size_t acquire_slot() {
+            if (!free_slots.empty()) {
+                std::size_t const i = free_slots.back();
+                free_slots.pop_back();
+                return i;
+            }
+            time_point const now = SteadyClock::now();
+            for (;;) {
+                std::size_t const i = hand;
+                hand = (hand + 1) % slots.size();
+                slot_type& slot = slots[i];
+                if (!slot.used) { return i; }
+                if (expired(slot, now) || !slot.referenced.load(std::memory_order_relaxed)) {
+                    release_slot(i);
+                    evictions.fetch_add(1, std::memory_order_relaxed);
+                    return i;
+                }
+                slot.referenced.store(false, std::memory_order_relaxed);
+                //访问位被置位的槽位获得一次"第二次机会",指针最多扫过两圈就能找到可淘汰的槽位
+            }
+        }//只在持有独占锁时调用
+    public:
+        explicit shard_type(std::size_t capacity) :
+            slots(capacity), hand(0), evictions(0) {
+            index.reserve(capacity);
+            free_slots.reserve(capacity);
+            for (std::size_t i = capacity;i > 0;i--) { free_slots.push_back(i - 1); }
+        }
+        Value value_for(Key const& key, Value const& default_value) const {
+            std::shared_lock<std::shared_mutex> lk(mtx);
+            typename std::unordered_map<Key, std::size_t, Hash>::const_iterator const it = index.find(key);
+            if (it == index.end() || expired(slots[it->second], SteadyClock::now())) {
+                misses.add();
+                return default_value;
+            }
+            slot_type const& slot = slots[it->second];
+            if (!slot.referenced.load(std::memory_order_relaxed)) {
+                slot.referenced.store(true, std::memory_order_relaxed);
+            }
+            //先读后写,访问位已经置位时不会写入,避免热点数据所在的缓存行在读者之间来回传递
+            hits.add();
+            return slot.value;
+        }
+        void update_map(Key const& key, Value const& value, time_point expire) {
+            std::unique_lock<std::shared_mutex> lk(mtx);
+            typename std::unordered_map<Key, std::size_t, Hash>::iterator const it = index.find(key);
+            std::size_t i;
+            if (it != index.end()) { i = it->second; }
+            else {
+                i = acquire_slot();
+                slots[i].key = key;
+                slots[i].used = true;
+                index[key] = i;
+            }
+            slots[i].value = value;
+            slots[i].expire = expire;
+            slots[i].referenced.store(false, std::memory_order_relaxed);
+            //新数据的访问位不置位,只被写入一次而从未命中的数据会被优先淘汰
+        }
+        void remove_map(Key const& key) {
+            std::unique_lock<std::shared_mutex> lk(mtx);
+            typename std::unordered_map<Key, std::size_t, Hash>::iterator const it = index.find(key);
+            if (it != index.end()) {
+                std::size_t const i = it->second;
+                release_slot(i);
+                free_slots.push_back(i);
+            }
+        }
+        cache_stats get_stats() const {
+            cache_stats res;
+            res.hits = hits.exact();
+            res.misses = misses.exact();
+            res.evictions = evictions.load(std::memory_order_relaxed);
+            return res;
+        }
+    };
+    std::vector<std::unique_ptr<shard_type>> shards;
+    Hash hashes;
+    shard_type& get_shard(Key const& key) const {
+        std::size_t const shard_index = hashes(key) % shards.size();
+        return *shards[shard_index];
+    }
+public:
+    thread_safe_cache(std::size_t capacity, int num_shards = 19, Hash const& hashes_ = Hash()) :
+        shards(std::max(num_shards, 1)), hashes(hashes_) {
+        std::size_t const shard_capacity = std::max<std::size_t>(1, (capacity + shards.size() - 1) / shards.size());
+        for (std::size_t i = 0;i < shards.size();i++) {
+            shards[i].reset(new shard_type(shard_capacity));
+        }
+    }//capacity为缓存的总容量,平均分配到每个分片上,分片数量至少为1
+    thread_safe_cache(thread_safe_cache const& other) = delete;
+    thread_safe_cache& operator=(thread_safe_cache const& other) = delete;
+    Value value_for(Key const& key, Value const& default_value = Value()) const {
+        return get_shard(key).value_for(key, default_value);
+    }
+    void update_map(Key const& key, Value const& value) {
+        get_shard(key).update_map(key, value, SteadyClock::time_point::max());
+    }
+    template<typename Rep, typename Period>
+    void update_map(Key const& key, Value const& value, Duration<Rep, Period> const& ttl) {
+        get_shard(key).update_map(key, value, SteadyClock::now() +
+                                  std::chrono::duration_cast<SteadyClock::duration>(ttl));
+    }//带有过期时间(TTL)的更新,过期的数据在查询时视为未命中,并且会被优先淘汰
+    void remove_map(Key const& key) {
+        get_shard(key).remove_map(key);
+    }
+    std::vector<cache_stats> get_stats() const {
+        std::vector<cache_stats> res;
+        for (std::size_t i = 0;i < shards.size();i++) {
+            res.push_back(shards[i]->get_stats());
+        }
+        return res;
+    }//每个分片的命中,未命中和淘汰次数,统计值只是近似的快照
+    //和dns_cache(chapter2)相比,读者之间不会因为同一个全局锁而互相干扰,也不会因为数据无限增长而耗尽内存
+    //命中只需要共享锁,所以读多写少时分片之间几乎没有竞争
+};
+
 template<typename T>
 class thread_safe_list {
 private:
@@ -142,23 +486,342 @@ public:
         while (node* const next = current->next.get()) {
             std::unique_lock<std::mutex> next_lk(next->mtx);
             if (predcate(*next->data)) {
-                std::unique_lock<std::mutex> next_lk(next->mtx);
-                if (predcate(*next->data)) {
-                    std::unique_ptr<node> old_next = std::move(current->next);
-                    current->next = std::move(next->next);
-                    next_lk.unlock();
-                }
-                else {
-                    lk.unlock();
-                    current = next;
-                    lk = std::move(next_lk);
+                std::unique_ptr<node> old_next = std::move(current->next);
+                current->next = std::move(next->next);
+                next_lk.unlock();
+            }
+            //old_next在离开作用域时删除节点,删除前已经释放了节点的锁
+            else {
+                lk.unlock();
+                current = next;
+                lk = std::move(next_lk);
+            }
+        }
+    }
+};
+
+//惰性同步的线程安全链表
+//thread_safe_list每访问一个元素都要进行两次互斥量操作,并发的遍历也会因为交替上锁而互相阻塞
+//惰性链表的遍历完全不上锁,每个节点增加一个删除标记,删除分为两步:先设置标记(逻辑删除),再从链表中摘除(物理删除)
+//修改时只锁住需要修改的两个节点(前驱和当前节点),上锁后验证这个窗口:两个节点都没有被标记,并且前驱仍然指向当前节点
+//验证失败说明窗口被其他线程修改了,需要重新查找
+//遍历可能会经过已被摘除的节点,所以节点不能立即删除,这里使用chapter6-1的方式:等到没有线程访问链表时再删除
+//如果一直有线程在访问链表,待删除的节点会一直累积,这也是这种回收方式的缺点
+template<typename T>
+class lazy_thread_safe_list {
+private:
+    struct node {
+        std::mutex mtx;
+        std::atomic<bool> marked;
+        std::shared_ptr<T> data;
+        std::atomic<node*> next;
+        node* reclaim_next;
+        node() :marked(false), next(nullptr), reclaim_next(nullptr) {}
+        node(T const& value) :marked(false), data(std::make_shared<T>(value)),
+            next(nullptr), reclaim_next(nullptr) {}
+    };
+    node head;
+    cache_padded<std::atomic<int>> thread_in_op;
+    std::atomic<node*> to_deleted;
+    //每个操作都修改thread_in_op,而head只在插入到表头时修改,分开后查找时读取head不会因为计数器的修改而缓存失效
+    static void delete_nodes(node* nodes) {
+        while (nodes) {
+            node* next = nodes->reclaim_next;
+            delete nodes;
+            nodes = next;
+        }
+    }
+    void chain_pending_nodes(node* first, node* last) {
+        last->reclaim_next = to_deleted.load();
+        while (!to_deleted.compare_exchange_weak(last->reclaim_next, first));
+    }
+    void chain_pending_nodes(node* nodes) {
+        node* last = nodes;
+        while (node* const next = last->reclaim_next) { last = next; }
+        chain_pending_nodes(nodes, last);
+    }
+    void leave() {
+        if (thread_in_op == 1) {
+            node* nodes = to_deleted.exchange(nullptr);
+            if (!(--thread_in_op)) { delete_nodes(nodes); }
+            else if (nodes) { chain_pending_nodes(nodes); }
+        }
+        else { --thread_in_op; }
+    }
+    struct op_guard {
+        lazy_thread_safe_list* list;
+        explicit op_guard(lazy_thread_safe_list* list_) :list(list_) { ++list->thread_in_op; }
+        ~op_guard() { list->leave(); }
+    };
+    static bool validate(node* pred, node* curr) {
+        return !pred->marked.load(std::memory_order_acquire) &&
+            !curr->marked.load(std::memory_order_acquire) &&
+            pred->next.load(std::memory_order_acquire) == curr;
+    }
+public:
+    lazy_thread_safe_list() :thread_in_op(0), to_deleted(nullptr) {}
+    ~lazy_thread_safe_list() {
+        node* curr = head.next.load();
+        while (curr) {
+            node* const next = curr->next.load();
+            delete curr;
+            curr = next;
+        }
+        delete_nodes(to_deleted.exchange(nullptr));
+    }
+    lazy_thread_safe_list(lazy_thread_safe_list const& other) = delete;
+    lazy_thread_safe_list& operator=(lazy_thread_safe_list const& other) = delete;
+    void push_front(T const& value) {
+        node* const new_node = new node(value);
+        std::lock_guard<std::mutex> lk(head.mtx);
+        new_node->next.store(head.next.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        head.next.store(new_node, std::memory_order_release);
+        //头节点永远不会被标记,所以只需要锁住头节点
+    }
+    template<typename Func>
+    void for_each(Func func) {
+        op_guard guard(this);
+        for (node* curr = head.next.load(std::memory_order_acquire);curr;
+             curr = curr->next.load(std::memory_order_acquire)) {
+            if (!curr->marked.load(std::memory_order_acquire)) { func(static_cast<T const&>(*curr->data)); }
+        }
+        //遍历不获取任何锁,元素在插入后不再修改,所以func只能读取元素
+    }
+    template<typename Predcate>
+    std::shared_ptr<T> find_first_if(Predcate predcate) {
+        op_guard guard(this);
+        for (node* curr = head.next.load(std::memory_order_acquire);curr;
+             curr = curr->next.load(std::memory_order_acquire)) {
+            if (!curr->marked.load(std::memory_order_acquire) &&
+                predcate(static_cast<T const&>(*curr->data))) {
+                return curr->data;
+            }
+        }
+        return std::shared_ptr<T>();
+    }
+    template<typename Predcate>
+    void remove_if(Predcate predcate) {
+        op_guard guard(this);
+        node* pred = &head;
+        node* curr = head.next.load(std::memory_order_acquire);
+        while (curr) {
+            if (curr->marked.load(std::memory_order_acquire) ||
+                !predcate(static_cast<T const&>(*curr->data))) {
+                pred = curr;
+                curr = curr->next.load(std::memory_order_acquire);
+                continue;
+            }
+            //判断条件时不上锁,只有找到需要删除的节点后,才锁住前驱和当前节点
+            std::unique_lock<std::mutex> pred_lk(pred->mtx);
+            std::unique_lock<std::mutex> curr_lk(curr->mtx);
+            //总是按照链表的顺序上锁,所以不会产生死锁
+            if (validate(pred, curr)) {
+                curr->marked.store(true, std::memory_order_release);
+                pred->next.store(curr->next.load(std::memory_order_relaxed), std::memory_order_release);
+                curr_lk.unlock();
+                chain_pending_nodes(curr, curr);
+                curr = pred->next.load(std::memory_order_relaxed);
+                //先标记再摘除,遍历中的线程看到标记就会跳过这个节点
+            }
+            else if (!pred->marked.load(std::memory_order_acquire)) {
+                curr_lk.unlock();
+                curr = pred->next.load(std::memory_order_acquire);
+                //前驱仍然有效,只是后继发生了变化,从前驱重新开始
+            }
+            else {
+                curr_lk.unlock();
+                pred_lk.unlock();
+                pred = &head;
+                curr = head.next.load(std::memory_order_acquire);
+                //前驱也被删除了,只能从头开始
+            }
+        }
+    }
+};
+
+//展开的线程安全链表
+//thread_safe_list的每个元素都需要一个节点:一个互斥量,一个shared_ptr(控制块和数据各需要一次内存分配)和一个next指针
+//对于int这样的小元素,每个元素大约占用100字节,并且需要三次内存分配,遍历时每个元素都可能是一次缓存未命中
+//展开链表的每个节点直接存放最多K个元素,整个节点只有一把锁,元素的开销和遍历时的缓存未命中都减少为原来的1/K左右
+//接口与thread_safe_list一致,遍历仍然使用交替上锁,只是每次上锁可以处理K个元素
+template<typename T, std::size_t K = 16>
+class unrolled_thread_safe_list {
+private:
+    struct node {
+        std::mutex mtx;
+        std::size_t count;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type items[K];
+        std::unique_ptr<node> next;
+        node() :count(0), next() {}
+        ~node() {
+            for (std::size_t i = 0;i < count;i++) { item(i).~T(); }
+        }
+        T& item(std::size_t i) { return *reinterpret_cast<T*>(&items[i]); }
+        void push(T const& value) {
+            new (&items[count]) T(value);
+            ++count;
+        }
+        void erase(std::size_t i) {
+            item(i).~T();
+            for (std::size_t j = i + 1;j < count;j++) {
+                new (&items[j - 1]) T(std::move(item(j)));
+                item(j).~T();
+            }
+            --count;
+        }
+    };
+    //元素按插入顺序存放在节点中,最新的元素在末尾,遍历节点时从后往前访问,保持push_front的顺序
+    node head;
+public:
+    unrolled_thread_safe_list() {}
+    ~unrolled_thread_safe_list() {
+        std::unique_ptr<node> next = std::move(head.next);
+        while (next) { next = std::move(next->next); }
+    }//逐个释放节点,避免unique_ptr链式析构造成过深的递归
+    unrolled_thread_safe_list(unrolled_thread_safe_list const& other) = delete;
+    unrolled_thread_safe_list& operator=(unrolled_thread_safe_list const& other) = delete;
+    void push_front(T const& value) {
+        std::unique_lock<std::mutex> lk(head.mtx);
+        if (node* const first = head.next.get()) {
+            std::lock_guard<std::mutex> first_lk(first->mtx);
+            if (first->count < K) {
+                first->push(value);
+                return;
+            }
+        }
+        //第一个节点还有空位时直接放入,不需要分配内存
+        std::unique_ptr<node> new_node(new node);
+        new_node->push(value);
+        new_node->next = std::move(head.next);
+        head.next = std::move(new_node);
+    }
+    template<typename Func>
+    void for_each(Func func) {
+        node* current = &head;
+        std::unique_lock<std::mutex> lk(head.mtx);
+        while (node* const next = current->next.get()) {
+            std::unique_lock<std::mutex> next_lk(next->mtx);
+            lk.unlock();
+            for (std::size_t i = next->count;i > 0;i--) { func(next->item(i - 1)); }
+            current = next;
+            lk = std::move(next_lk);
+        }
+    }
+    template<typename Predcate>
+    std::shared_ptr<T> find_first_if(Predcate predcate) {
+        node* current = &head;
+        std::unique_lock<std::mutex> lk(head.mtx);
+        while (node* const next = current->next.get()) {
+            std::unique_lock<std::mutex> next_lk(next->mtx);
+            lk.unlock();
+            for (std::size_t i = next->count;i > 0;i--) {
+                if (predcate(next->item(i - 1))) {
+                    return std::make_shared<T>(next->item(i - 1));
                 }
             }
+            current = next;
+            lk = std::move(next_lk);
+        }
+        return std::shared_ptr<T>();
+        //元素直接存放在节点中,没有可以共享的shared_ptr,所以返回的是元素的副本
+    }
+    template<typename Predcate>
+    void remove_if(Predcate predcate) {
+        node* current = &head;
+        std::unique_lock<std::mutex> lk(head.mtx);
+        while (node* const next = current->next.get()) {
+            std::unique_lock<std::mutex> next_lk(next->mtx);
+            for (std::size_t i = next->count;i > 0;i--) {
+                if (predcate(next->item(i - 1))) { next->erase(i - 1); }
+            }
+            if (!next->count) {
+                std::unique_ptr<node> old_next = std::move(current->next);
+                current->next = std::move(next->next);
+                next_lk.unlock();
+                //节点已经为空,持有前一个节点的锁时将其摘除,old_next离开作用域时被删除
+            }
+            else {
+                lk.unlock();
+                current = next;
+                lk = std::move(next_lk);
+            }
         }
     }
 };
 
+//检查thread_safe_cache的淘汰和过期:只有一个分片,4个槽位,淘汰的顺序是确定的
+bool cache_test() {
+    thread_safe_cache<int, int> cache(4, 1);
+    bool ok = true;
+    auto expect = [&](char const* what, bool passed) {
+        if (!passed) { std::cout << "thread_safe_cache: " << what << " failed\n"; }
+        ok = ok && passed;
+    };
+    for (int i = 0;i < 4;i++) { cache.update_map(i, i); }
+    cache.value_for(0, -1);
+    cache.value_for(1, -1);
+    cache.update_map(4, 4);
+    expect("clock eviction", cache.value_for(2, -1) == -1 && cache.value_for(0, -1) == 0 &&
+           cache.value_for(1, -1) == 1 && cache.value_for(3, -1) == 3 && cache.value_for(4, -1) == 4);
+    //0和1被访问过,淘汰指针清除它们的访问位后淘汰了未被访问的2
+    cache.update_map(0, 10, std::chrono::milliseconds(1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    expect("ttl expiry", cache.value_for(0, -1) == -1);
+    cache.value_for(1, -1);
+    cache.value_for(3, -1);
+    cache.value_for(4, -1);
+    cache.update_map(5, 5);
+    expect("expired slot evicted first", cache.value_for(5, -1) == 5 && cache.value_for(1, -1) == 1 &&
+           cache.value_for(3, -1) == 3 && cache.value_for(4, -1) == 4);
+    //过期的0即使访问位被置位(更新时会清除)也会被优先淘汰
+    thread_safe_cache<int, int>::cache_stats const stats = cache.get_stats()[0];
+    expect("stats", stats.evictions == 2 && stats.misses == 2 && stats.hits == 13);
+    return ok;
+}
+
+typedef std::map<int, int> table_model;
+struct filtered_table :thread_safe_table<int, int> {
+    filtered_table() :thread_safe_table<int, int>(19, 64) {}
+};//带布隆过滤器的表,run_schedule_test每次执行都会默认构造一个新的状态
+schedule_test<filtered_table, table_model> table_test() {
+    schedule_test<filtered_table, table_model> test;
+    for (int i = 0;i < 2;i++) {
+        test.threads.push_back([](filtered_table& table, operation_history<table_model>& history, int id) {
+            int const key = 7;
+            history.call(id, "update_map(7)",
+                         [&] { table.update_map(key, id + 1); return 0; },
+                         [key, id](table_model& model) { model[key] = id + 1; return 0; });
+            history.call(id, "value_for(7)",
+                         [&] { return table.value_for(key, -1); },
+                         [key](table_model& model) { return model.count(key) ? model[key] : -1; });
+            history.call(id, "remove_map(7)",
+                         [&] { table.remove_map(key); return 0; },
+                         [key](table_model& model) { model.erase(key); return 0; });
+        });
+    }
+    test.threads.push_back([](filtered_table& table, operation_history<table_model>& history, int id) {
+        int const key = 7;
+        for (int i = 0;i < 2;i++) {
+            history.call(id, "value_for(7)",
+                         [&] { return table.value_for(key, -1); },
+                         [key](table_model& model) { return model.count(key) ? model[key] : -1; });
+        }
+    });//只读线程的查询会经过布隆过滤器,调度点让版本号的两次读取之间可以插入其他线程的写入
+    return test;
+}
+
+#if !defined(CHAPTER_BENCHMARKS)
 int main() {
+    schedule_options options;
+    options.executions = 300;
+    std::cout << "thread_safe_table random: " << run_schedule_test(table_test(), options) << "\n";
     thread_safe_table<int, int> T1;
+    thread_safe_table<int, int> T2(19, 1024);
     thread_safe_list<int> L1;
-}
\ No newline at end of file
+    lazy_thread_safe_list<int> L2;
+    unrolled_thread_safe_list<int> L3;
+    thread_safe_cache<std::string, std::string> C1(1024, 0);
+    bool const cache_passed = cache_test();
+    std::cout << "thread_safe_cache: " << (cache_passed ? "passed" : "failed") << "\n";
+}
+#endif
@@ -29,7 +29,8 @@ struct hazard_point {
     std::atomic<std::thread::id> id;
     std::atomic<void*> point;
 };
-hazard_point hazard_pointer[max_hazard_point];
+cache_padded<hazard_point> hazard_pointer[max_hazard_point];
+//每个线程频繁修改自己的风险指针,而所有线程都会扫描整个数组,每个风险指针独占一个缓存行,避免修改时的伪共享
 class hazard_owner {
 private:
     hazard_point* hp;
@@ -98,9 +99,10 @@ private:
         node* next;
         node(T const& data_) :data(data_) {}
     };
-    std::atomic<node*> head;
-    std::atomic<int> thread_pop;
+    cache_padded<std::atomic<node*>> head;
+    cache_padded<std::atomic<int>> thread_pop;
     std::atomic<node*> to_deleted;
+    //push和pop都在head上比较交换,只有pop修改thread_pop,两个计数分别独占缓存行
     static void delete_nodes(node* nodes) {
         while (nodes) {
             node* next = nodes->next;
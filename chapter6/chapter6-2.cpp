@@ -1,3 +1,7 @@
+#if !defined(CHAPTER_BENCHMARKS)
+#define SCHEDULE_TEST   //启用调度点,main中用run_schedule_test检查lock_free_stack和lock_free_queue
+#endif
+//chapter10-2包含这个文件做性能测试时定义了CHAPTER_BENCHMARKS,调度点是空函数,这里的main不参与编译
 #include "../headfile.h"
 
 template<typename T>
@@ -20,40 +24,48 @@ private:
         do {
             new_counter = old_counter;
             ++new_counter.external_count;
+            schedule_point();
         } while (!head.compare_exchange_strong(old_counter, new_counter,
                                                std::memory_order_acquire,
                                                std::memory_order_relaxed));
         old_counter.external_count = new_counter.external_count;
     }
 public:
+    lock_free_stack() { head.store(count_node{ 0, nullptr }); }
+    //std::atomic的默认构造不初始化值,空栈需要显式的把head设置为空指针
     void push(T const& data) {
         count_node new_node;
         new_node.ptr = new node(data);
         new_node.external_count = 1;
+        schedule_point();
         new_node.ptr->next = head.load();
-        while (!head.compare_exchange_weak(new_node.ptr->next, new_node,
-                                           std::memory_order_release,
-                                           std::memory_order_relaxed));
+        while (schedule_point(), !head.compare_exchange_weak(new_node.ptr->next, new_node,
+                                                             std::memory_order_release,
+                                                             std::memory_order_relaxed));
     }//分离引用计数的方式推送一个节点到无锁栈中
     std::shared_ptr<T> pop() {
+        schedule_point();
         count_node old_head = head.load(std::memory_order_relaxed);
         for (;;) {
             increase_head_count(old_head);
             node* const ptr = old_head.ptr;
             if (!ptr) { return std::shared_ptr<T>(); }
+            schedule_point();
             if (head.compare_exchange_strong(old_head, ptr->next, std::memory_order_relaxed)) {
                 std::shared_ptr<T> res;
                 res.swap(ptr->data);
                 int const count_increase = old_head.external_count - 2;
+                schedule_point();
                 if (ptr->internal_count.fetch_add(count_increase,
                                                   std::memory_order_release) == -count_increase) { delete ptr; }
                 return res;
             }
-            else if (ptr->internal_count.fetch_sub(-1, std::memory_order_relaxed) == 1) {
+            else if (schedule_point(), ptr->internal_count.fetch_add(-1, std::memory_order_relaxed) == 1) {
                 ptr->internal_count.load(std::memory_order_acquire);
                 delete ptr;
             }
         }
+        //释放引用时内部计数减一,原来的fetch_sub(-1)反而让计数加一,调度测试(main)在AddressSanitizer下会报告释放后使用
         //无锁结构的复杂性主要在于内存的管理
         //需要先检查操作之间的依赖关系,而后再去确定适合这种需求关系的最小内存序
     }//分离引用计数从无锁栈中弹出一个节点
@@ -65,20 +77,30 @@ public:
 template<typename T>
 class lock_free_queue {
 private:
-    struct count_node_ptr;
-    struct node_counter;
+    struct node;
+    struct count_node_ptr {
+        std::intptr_t external_count;
+        node* ptr;
+    };
+    //compare_exchange比较的是对象的全部字节,书中int类型的计数与指针之间有4字节的填充,填充字节的值是不确定的
+    //next的值相同时比较也可能失败,push会误以为其他线程已经设置了next,把空指针设置为tail,计数使用与指针相同大小的整数
+    struct node_counter {
+        unsigned internal_count : 30;
+        unsigned external_counters : 2;
+        //这里是将计数器总大小设置为30bit 和 2bit
+        //保证计数器大小总体为32bit 使其可以放入一个机器字中
+    };
     struct node {
-        std::atomic<T> data;
+        std::atomic<T*> data;
         std::atomic<node_counter> count;
         std::atomic<count_node_ptr> next;
-        node() {
+        node() :data(nullptr) {
             node_counter new_count;
             new_count.internal_count = 0;
-            new_count.external_count = 2;
+            new_count.external_counters = 2;
             //新节点必定会被tail 和 上一个节点的next所指向
             count.store(new_count);
-            next.ptr = nullptr;
-            next.external_count = 0;
+            next.store(count_node_ptr{ 0, nullptr });
         }
         void release_ref() {
             node_counter old_counter = count.load(std::memory_order_relaxed);
@@ -86,41 +108,27 @@ private:
             do {
                 new_counter = old_counter;
                 --new_counter.internal_count;
+                schedule_point();
             } while (!count.compare_exchange_strong(old_counter, new_counter,
-                                                    std::memory_order_acquire,
+                                                    std::memory_order_acq_rel,
                                                     std::memory_order_relaxed));
-            if (new_counter.internal_count && !new_counter.external_count) { delete this; }
+            if (!new_counter.internal_count && !new_counter.external_counters) { delete this; }
             //内部,外部计数全部为0 表示为最后一次使用 使用后可以删除
         }
     };
-    struct count_node_ptr {
-        int external_count;
-        node* ptr;
-    };
-    struct node_counter {
-        int internal_count : 30;
-        int external_counters : 2;
-        //这里是将计数器总大小设置为30bit 和 2bit
-        //保证计数器大小总体为32bit 使其可以放入一个机器字中
-    };
-    std::atomic<count_node_ptr*> head;
-    std::atomic<count_node_ptr*> tail;
-    node* pop_head() {
-        node* const old_head = head.load();
-        if (old_head == tail.load()) { return nullptr; }
-        head.store(old_head->next);
-        return old_head;
-    }
+    std::atomic<count_node_ptr> head;
+    std::atomic<count_node_ptr> tail;
     static void increase_external_count(std::atomic<count_node_ptr>& counter,
                                         count_node_ptr& old_counter) {
         count_node_ptr new_counter;
         do {
             new_counter = old_counter;
             ++new_counter.external_count;
+            schedule_point();
         } while (!counter.compare_exchange_strong(old_counter, new_counter,
                                                   std::memory_order_acquire,
                                                   std::memory_order_relaxed));
-        old_counter.external_count = new_counter.external.count;
+        old_counter.external_count = new_counter.external_count;
     }
     static void free_external_counter(count_node_ptr& old_node_ptr) {
         node* const ptr = old_node_ptr.ptr;
@@ -131,16 +139,18 @@ private:
             new_counter = old_counter;
             --new_counter.external_counters;
             new_counter.internal_count += count_increase;
+            schedule_point();
         } while (!ptr->count.compare_exchange_strong(old_counter, new_counter,
-                                                     std::memory_order_acquire,
+                                                     std::memory_order_acq_rel,
                                                      std::memory_order_relaxed));
         //对计数结构体中的计数器进行更新
+        //书中使用acquire,但删除节点的线程需要看到其他线程减少计数之前对节点的所有访问,减少计数必须同时是release
         if (!new_counter.internal_count && !new_counter.external_counters) { delete ptr; }
         //内外计数值都为0,没有更多的节点可以被引用,所以可以安全的删除节点
     }
     void set_new_tail(count_node_ptr& old_tail, count_node_ptr const& new_tail) {
         node* const current_tail_ptr = old_tail.ptr;
-        while (!tail.compare_exchange_weak(old_tail, new_tail) &&
+        while (schedule_point(), !tail.compare_exchange_weak(old_tail, new_tail) &&
                old_tail.ptr == current_tail_ptr) { ; }
         if (old_tail.ptr == current_tail_ptr) { free_external_counter(old_tail); }
         //当新旧ptr相同时,循环退出,代表对tail的设置已经完成,所以需要释放旧外部计数器
@@ -148,26 +158,31 @@ private:
         //当ptr值不一样时另一线程可能已经将计数器释放了,所以只需要对该线程持有的单次引用进行释放即可
     }
 public:
-    lock_free_queue() :head(new node), tail(head.load()) {}
+    lock_free_queue() {
+        count_node_ptr const dummy{ 1, new node };
+        head.store(dummy);
+        tail.store(dummy);
+    }//head和tail指向同一个不存放数据的节点,节点的两个外部计数器分别属于head和tail
     lock_free_queue(const lock_free_queue& other) = delete;
     lock_free_queue& operator=(const lock_free_queue& other) = delete;
     ~lock_free_queue() {
-        while (node* const old_head = head.load()) {
-            head.store(old_head->next);
-            delete old_head;
-        }
-    }
+        while (pop());
+        delete head.load().ptr;
+    }//析构时不能有其他线程访问队列,弹出所有数据后只剩下最后的空节点
     void push(T value) {
         std::unique_ptr<T> new_data(new T(value));
         count_node_ptr new_next;
         new_next.ptr = new node;
         new_next.external_count = 1;
+        schedule_point();
         count_node_ptr old_tail = tail.load();
         for (;;) {
             increase_external_count(tail, old_tail);
             T* old_data = nullptr;
+            schedule_point();
             if (old_tail.ptr->data.compare_exchange_strong(old_data, new_data.get())) {
-                count_node_ptr old_next = { 0 };
+                count_node_ptr old_next{ 0, nullptr };
+                schedule_point();
                 if (!old_tail.ptr->next.compare_exchange_strong(old_next, new_next)) {
                 //当交换失败就能知道另有线程对next指针进行设置,所以就可以删除一开始分配的那个新节点
                     delete new_next.ptr;
@@ -178,7 +193,8 @@ public:
                 break;
             }
             else {
-                count_node_ptr old_next = { 0 };
+                count_node_ptr old_next{ 0, nullptr };
+                schedule_point();
                 if (old_tail.ptr->next.compare_exchange_strong(old_next, new_next)) {
                 //尝试更新next指针，让其指向该线程分配出来的新节点
                 //指针更新成功时，就可以将这个新节点作为新的tail节点
@@ -194,29 +210,93 @@ public:
         //高效的内存分配器也很重要(其他途径了解)
     }
     std::unique_ptr<T> pop() {
+        schedule_point();
         count_node_ptr old_head = head.load(std::memory_order_relaxed);
         for (;;) {
             increase_external_count(head, old_head);
             node* const ptr = old_head.ptr;
+            schedule_point();
             if (ptr == tail.load().ptr) {
+                ptr->release_ref();
                 return std::unique_ptr<T>();
             }
+            //队列为空时也要释放刚刚增加的引用,否则这个节点永远不会被删除
+            schedule_point();
             count_node_ptr next = ptr->next.load();
+            schedule_point();
             if (head.compare_exchange_strong(old_head, next)) {
-                T* const res = ptr->data.exchange(nullptr);
-                free_external_count(old_head);
+                T* const res = ptr->data.load();
+                //书中用exchange(nullptr)取出数据,但仍持有旧tail引用的push线程可能会把数据放进这个已经弹出的节点
+                //节点释放时这份数据就丢失了,这里保留data不为空,让这样的比较交换失败并重新读取tail
+                free_external_counter(old_head);
                 return std::unique_ptr<T>(res);
             }
             ptr->release_ref();
         }
     }
 };
+//原来的代码中data是std::atomic<T>,head和tail是指针,计数器的位域名与使用处不一致,并且调用了不存在的free_external_count
+//模板没有被实例化所以没有编译错误,这里按书中最终的版本(清单7.16到7.21)修正后才能在main中测试
 //设计无锁数据结构是一项很困难的任务,并且很容易犯错
 //不过这样的数据结构在某些重要情况下可对其性能会有加强
 //无锁数据结构的实现过程中,需要小心使用原子操作的内存序
 //保证无数据竞争,以及让每个线程看到一个数据结构实例
 //在无锁结构中对内存的管理很难
 //不管在线程间共享怎么样的数据,需要考虑数据结构应该如何使用,并且如何在线程间同步数据
+typedef std::vector<int> stack_model;
+int model_pop(stack_model& model) {
+    if (model.empty()) { return -1; }
+    int const value = model.back();
+    model.pop_back();
+    return value;
+}
+typedef std::deque<int> queue_model;
+int model_pop_front(queue_model& model) {
+    if (model.empty()) { return -1; }
+    int const value = model.front();
+    model.pop_front();
+    return value;
+}
+
+#if !defined(CHAPTER_BENCHMARKS)
 int main() {
     lock_free_stack<int> stk1;
-}
\ No newline at end of file
+    schedule_test<lock_free_stack<int>, stack_model> test;
+    for (int i = 0;i < 3;i++) {
+        test.threads.push_back([](lock_free_stack<int>& stk, operation_history<stack_model>& history, int id) {
+            int const value = id + 1;
+            history.call(id, "push(" + std::to_string(value) + ")",
+                         [&] { stk.push(value); return 0; },
+                         [value](stack_model& model) { model.push_back(value); return 0; });
+            history.call(id, "pop()",
+                         [&] { std::shared_ptr<int> const res = stk.pop(); return res ? *res : -1; },
+                         model_pop);
+        });
+    }
+    schedule_options options;
+    options.executions = 500;
+    std::cout << "lock_free_stack random: " << run_schedule_test(test, options) << "\n";
+    schedule_test<lock_free_queue<int>, queue_model> queue_test;
+    for (int i = 0;i < 3;i++) {
+        queue_test.threads.push_back([](lock_free_queue<int>& que, operation_history<queue_model>& history, int id) {
+            int const value = id + 1;
+            history.call(id, "push(" + std::to_string(value) + ")",
+                         [&] { que.push(value); return 0; },
+                         [value](queue_model& model) { model.push_back(value); return 0; });
+            history.call(id, "pop()",
+                         [&] { std::unique_ptr<int> const res = que.pop(); return res ? *res : -1; },
+                         model_pop_front);
+        });
+    }
+    queue_test.threads.push_back([](lock_free_queue<int>& que, operation_history<queue_model>& history, int id) {
+        history.call(id, "pop()",
+                     [&] { std::unique_ptr<int> const res = que.pop(); return res ? *res : -1; },
+                     model_pop_front);
+    });
+    //只弹出的线程可能遇到空队列,覆盖pop在队列为空时释放引用的路径
+    queue_test.post = [](lock_free_queue<int>& que) { return !que.pop(); };
+    //三次push,成功的pop也一定是三次:只弹出的线程取走一个数据时,必然有一个先push后pop的线程遇到空队列
+    std::cout << "lock_free_queue random: " << run_schedule_test(queue_test, options) << "\n";
+    //每个原子操作前都有调度点,随机调度会覆盖引用计数在各个位置被其他线程打断的情况
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,264 @@
+#include "../headfile.h"
+
+//无锁的有序映射(跳表)
+//thread_safe_list(chapter5)是唯一有序的并发容器,但它的查找是O(n)的,并且每个节点都要上锁
+//跳表在有序链表之上增加了多层"快速通道",每个节点以1/2的概率出现在上一层中,查找只需要O(log n)步
+//每一层都是一个无锁的有序链表,使用CAS插入和删除节点,不需要全局锁
+
+//删除使用标记指针:节点的next指针最低位为1时表示这个节点已经在该层被逻辑删除
+//节点对齐保证了指针的最低位一定为0,所以可以用它来存放标记,标记和指针可以在一次CAS中同时修改
+//逻辑删除(标记)后,任何经过这个节点的线程都会帮忙把它从链表中摘除(物理删除)
+//最底层的标记决定了节点是否属于这个集合,成功标记最底层的线程是这个节点唯一的"所有者",负责回收它
+
+//内存回收使用chapter6-1中的第一种方式:记录正在操作跳表的线程数量
+//被摘除的节点先放入待删除链表,只有当最后一个线程离开跳表时,才真正删除这些节点
+//所有原子操作都使用默认的memory_order_seq_cst,回收的正确性依赖于标记与摘除之间的全序
+
+template<typename Key, typename Value, typename Compare = std::less<Key>>
+class lock_free_skip_list {
+private:
+    static int const max_level = 24;
+    struct node {
+        Key key;
+        std::shared_ptr<Value> data;
+        int const top_level;
+        std::unique_ptr<std::atomic<node*>[]> next;
+        node* reclaim_next;
+        node(int top_level_) :key(), top_level(top_level_),
+            next(new std::atomic<node*>[top_level_ + 1]), reclaim_next(nullptr) {
+            for (int i = 0;i <= top_level;i++) { next[i].store(nullptr, std::memory_order_relaxed); }
+        }//头节点,不存放数据
+        node(Key const& key_, Value const& value, int top_level_) :key(key_),
+            data(std::make_shared<Value>(value)), top_level(top_level_),
+            next(new std::atomic<node*>[top_level_ + 1]), reclaim_next(nullptr) {}
+    };
+    static bool is_marked(node* p) { return reinterpret_cast<std::uintptr_t>(p) & 1; }
+    static node* get_marked(node* p) {
+        return reinterpret_cast<node*>(reinterpret_cast<std::uintptr_t>(p) | 1);
+    }
+    static node* get_unmarked(node* p) {
+        return reinterpret_cast<node*>(reinterpret_cast<std::uintptr_t>(p) & ~std::uintptr_t(1));
+    }
+    node head;
+    Compare comp;
+    cache_padded<std::atomic<int>> thread_in_op;
+    std::atomic<node*> to_deleted;
+    //每个操作都修改thread_in_op,它与所有查找都要读取的head分别在不同的缓存行上
+
+    static void delete_nodes(node* nodes) {
+        while (nodes) {
+            node* next = nodes->reclaim_next;
+            delete nodes;
+            nodes = next;
+        }
+    }
+    void chain_pending_nodes(node* first, node* last) {
+        last->reclaim_next = to_deleted.load();
+        while (!to_deleted.compare_exchange_weak(last->reclaim_next, first));
+    }
+    void chain_pending_nodes(node* nodes) {
+        node* last = nodes;
+        while (node* const next = last->reclaim_next) { last = next; }
+        chain_pending_nodes(nodes, last);
+    }
+    void retire(node* n) { chain_pending_nodes(n, n); }
+    void leave() {
+        if (thread_in_op == 1) {
+            node* nodes = to_deleted.exchange(nullptr);
+            if (!(--thread_in_op)) { delete_nodes(nodes); }
+            else if (nodes) { chain_pending_nodes(nodes); }
+        }
+        else { --thread_in_op; }
+    }//与lock_free_stack::try_reclaim相同,计数器为1时说明只有当前线程能看到待删除的节点
+    struct op_guard {
+        lock_free_skip_list* list;
+        explicit op_guard(lock_free_skip_list* list_) :list(list_) { ++list->thread_in_op; }
+        ~op_guard() { list->leave(); }
+    };//每个公共操作都在op_guard的生命周期内访问节点
+
+    static int random_level() {
+        thread_local std::uint64_t state =
+            std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        int level = 0;
+        std::uint64_t bits = state;
+        while ((bits & 1) && level < max_level - 1) {
+            level++;
+            bits >>= 1;
+        }
+        return level;
+    }//每个线程使用独立的xorshift随机数,避免共享随机数生成器带来的竞争
+    bool less(node* n, Key const& key) const { return comp(n->key, key); }
+    bool equal(node* n, Key const& key) const { return n && !comp(n->key, key) && !comp(key, n->key); }
+
+    bool search(Key const& key, node** preds, node** succs) {
+    retry:
+        node* pred = &head;
+        for (int level = max_level - 1;level >= 0;level--) {
+            node* curr = get_unmarked(pred->next[level].load());
+            while (curr) {
+                node* succ = curr->next[level].load();
+                while (is_marked(succ)) {
+                    node* expected = curr;
+                    if (!pred->next[level].compare_exchange_strong(expected, get_unmarked(succ))) {
+                        goto retry;
+                    }
+                    //pred被修改或者pred本身也被标记了,只能从头开始查找
+                    curr = get_unmarked(succ);
+                    if (!curr) { break; }
+                    succ = curr->next[level].load();
+                }
+                if (!curr || !less(curr, key)) { break; }
+                pred = curr;
+                curr = get_unmarked(succ);
+            }
+            preds[level] = pred;
+            succs[level] = curr;
+        }
+        return equal(succs[0], key);
+        //查找时会顺路摘除所有被标记的节点,返回时每一层的pred < key <= succ
+    }
+    node* first_not_less(Key const& key) const {
+        node const* pred = &head;
+        node* curr = nullptr;
+        for (int level = max_level - 1;level >= 0;level--) {
+            curr = get_unmarked(pred->next[level].load());
+            while (curr) {
+                node* const succ = curr->next[level].load();
+                if (!is_marked(succ) && !less(curr, key)) { break; }
+                if (!is_marked(succ)) { pred = curr; }
+                curr = get_unmarked(succ);
+            }
+        }
+        return curr;
+        //只读的查找不会摘除节点,遇到被标记的节点直接跳过
+    }
+public:
+    lock_free_skip_list(Compare const& comp_ = Compare()) :
+        head(max_level - 1), comp(comp_), thread_in_op(0), to_deleted(nullptr) {}
+    lock_free_skip_list(lock_free_skip_list const& other) = delete;
+    lock_free_skip_list& operator=(lock_free_skip_list const& other) = delete;
+    ~lock_free_skip_list() {
+        node* curr = get_unmarked(head.next[0].load());
+        while (curr) {
+            node* const next = get_unmarked(curr->next[0].load());
+            delete curr;
+            curr = next;
+        }
+        delete_nodes(to_deleted.exchange(nullptr));
+    }//析构时不能有其他线程访问跳表
+    bool insert(Key const& key, Value const& value) {
+        op_guard guard(this);
+        int const top_level = random_level();
+        node* preds[max_level];
+        node* succs[max_level];
+        for (;;) {
+            if (search(key, preds, succs)) { return false; }
+            node* const new_node = new node(key, value, top_level);
+            for (int level = 0;level <= top_level;level++) {
+                new_node->next[level].store(succs[level], std::memory_order_relaxed);
+            }
+            node* expected = succs[0];
+            if (!preds[0]->next[0].compare_exchange_strong(expected, new_node)) {
+                delete new_node;
+                continue;
+            }
+            //节点链接到最底层的那一刻就已经属于跳表了,上层只是加速查找的索引
+            for (int level = 1;level <= top_level;level++) {
+                for (;;) {
+                    node* next = new_node->next[level].load();
+                    if (is_marked(next)) { goto linked; }
+                    if (next != succs[level] &&
+                        !new_node->next[level].compare_exchange_strong(next, succs[level])) {
+                        goto linked;
+                    }
+                    //节点已经被其他线程标记删除,不再继续建立上层的索引
+                    expected = succs[level];
+                    if (preds[level]->next[level].compare_exchange_strong(expected, new_node)) { break; }
+                    search(key, preds, succs);
+                    if (succs[0] != new_node) { goto linked; }
+                }
+            }
+        linked:
+            if (is_marked(new_node->next[0].load())) { search(key, preds, succs); }
+            //链接上层时节点可能已被删除,删除者的查找有可能先于这里的链接完成
+            //所以由插入者再查找一次,保证被删除的节点不会残留在任何一层上
+            return true;
+        }
+    }
+    bool erase(Key const& key) {
+        op_guard guard(this);
+        node* preds[max_level];
+        node* succs[max_level];
+        if (!search(key, preds, succs)) { return false; }
+        node* const victim = succs[0];
+        for (int level = victim->top_level;level >= 1;level--) {
+            node* succ = victim->next[level].load();
+            while (!is_marked(succ)) {
+                victim->next[level].compare_exchange_weak(succ, get_marked(succ));
+            }
+        }
+        //从上往下标记,最后标记最底层
+        node* succ = victim->next[0].load();
+        while (!is_marked(succ)) {
+            if (victim->next[0].compare_exchange_strong(succ, get_marked(succ))) {
+                search(key, preds, succs);
+                retire(victim);
+                return true;
+                //标记成功的线程负责摘除节点,然后将其放入待删除链表
+            }
+        }
+        return false;
+        //其他线程已经删除了这个节点
+    }
+    std::shared_ptr<Value> find(Key const& key) const {
+        op_guard guard(const_cast<lock_free_skip_list*>(this));
+        node* const found = first_not_less(key);
+        return equal(found, key) ? found->data : std::shared_ptr<Value>();
+    }
+    bool contains(Key const& key) const { return static_cast<bool>(find(key)); }
+    std::pair<Key, std::shared_ptr<Value>> lower_bound(Key const& key) const {
+        op_guard guard(const_cast<lock_free_skip_list*>(this));
+        node* const found = first_not_less(key);
+        return found ? std::make_pair(found->key, found->data) :
+            std::make_pair(Key(), std::shared_ptr<Value>());
+    }//返回第一个不小于key的键值对,不存在时值为空指针
+    template<typename Func>
+    void for_each_range(Key const& first, Key const& last, Func func) const {
+        op_guard guard(const_cast<lock_free_skip_list*>(this));
+        for (node* curr = first_not_less(first);curr && less(curr, last);) {
+            node* const next = curr->next[0].load();
+            if (!is_marked(next)) { func(curr->key, *curr->data); }
+            curr = get_unmarked(next);
+        }
+    }//按顺序访问[first, last)中的元素
+    template<typename Func>
+    void for_each(Func func) const {
+        op_guard guard(const_cast<lock_free_skip_list*>(this));
+        for (node* curr = get_unmarked(head.next[0].load());curr;) {
+            node* const next = curr->next[0].load();
+            if (!is_marked(next)) { func(curr->key, *curr->data); }
+            curr = get_unmarked(next);
+        }
+    }
+    //遍历是弱一致的:遍历期间插入或删除的元素可能被看到也可能看不到,但不会重复也不会乱序
+    //值在插入后不再修改,func可以安全的读取,不需要任何锁
+};
+//与dns_cache(chapter2)使用的std::map加全局读写锁相比,读者和写者都不会阻塞,有序查找和范围扫描的复杂度都是O(log n + k)
+//缺点是节点分散在堆上,遍历的缓存命中率不如连续存储的结构
+
+
+#if !defined(CHAPTER_BENCHMARKS)
+int main() {
+    lock_free_skip_list<int, std::string> SL;
+    SL.insert(3, "three");
+    SL.insert(1, "one");
+    SL.insert(2, "two");
+    SL.erase(2);
+    SL.for_each([](int key, std::string const& value) {
+        std::cout << key << ":" << value << " ";
+    });
+}
+#endif
@@ -86,6 +86,196 @@ std::list<T> parallel_quick_sort(std::list<T> input) {
     //完成任务后会再来链表提取任务(这个线程池很有问题,包括竞争等等)
 }
 
+//对连续存储的数据进行并行归并排序
+//上面的快速排序以第一个元素作为中枢元素,对已经有序的数据会退化为O(n^2),链表的节点分散在堆上,并且每次划分都要创建一对promise/future
+//这里对随机访问的范围进行归并排序:数据块足够小时使用std::sort(内省排序),再在线程池中两两归并
+//归并本身也是并行的:取较长的一半的中点,在另一半中二分查找对应的位置,就可以把一次归并拆成两个互不相关的归并
+//数据在原范围和一个同样大小的缓冲区之间来回移动,每层只移动一次,总的额外空间为n
+template<typename Iterator, typename OutIterator, typename Compare>
+void parallel_merge(Iterator first1, Iterator last1, Iterator first2, Iterator last2, OutIterator out,
+                    Compare comp, thread_pool4& pool) {
+    long const merge_cutoff = 1 << 14;
+    long const length1 = last1 - first1;
+    long const length2 = last2 - first2;
+    if (length1 + length2 <= merge_cutoff) {
+        std::merge(std::make_move_iterator(first1), std::make_move_iterator(last1),
+                   std::make_move_iterator(first2), std::make_move_iterator(last2), out, comp);
+        return;
+    }
+    Iterator mid1, mid2;
+    if (length1 >= length2) {
+        mid1 = first1 + length1 / 2;
+        mid2 = std::lower_bound(first2, last2, *mid1, comp);
+    }
+    else {
+        mid2 = first2 + length2 / 2;
+        mid1 = std::upper_bound(first1, last1, *mid2, comp);
+    }
+    //相等的元素中,前一半的元素总是被分到前面,所以归并是稳定的
+    OutIterator const out_mid = out + (mid1 - first1) + (mid2 - first2);
+    std::vector<std::future<void>> lower(1);
+    join_tasks<void> joiner(lower, pool);
+    lower[0] = pool.submit([=, &pool] { parallel_merge(first1, mid1, first2, mid2, out, comp, pool); });
+    parallel_merge(mid1, last1, mid2, last2, out_mid, comp, pool);
+    pool.wait(lower[0]);
+    lower[0].get();
+}
+template<typename Iterator, typename OutIterator, typename Compare>
+void parallel_merge_sort(Iterator first, Iterator last, OutIterator out, bool into_out, Compare comp,
+                         thread_pool4& pool, long sort_cutoff) {
+    long const length = last - first;
+    if (length <= sort_cutoff) {
+        std::sort(first, last, comp);
+        if (into_out) { std::move(first, last, out); }
+        return;
+    }
+    long const half = length / 2;
+    Iterator const mid = first + half;
+    std::vector<std::future<void>> lower(1);
+    {
+        join_tasks<void> joiner(lower, pool);
+        lower[0] = pool.submit([=, &pool] { parallel_merge_sort(first, mid, out, !into_out, comp, pool, sort_cutoff); });
+        parallel_merge_sort(mid, last, out + half, !into_out, comp, pool, sort_cutoff);
+        pool.wait(lower[0]);
+        lower[0].get();
+    }
+    //两半的结果放在另一个位置,归并后回到目标位置
+    if (into_out) { parallel_merge(first, mid, mid, last, out, comp, pool); }
+    else { parallel_merge(out, out + half, out + half, out + length, first, comp, pool); }
+}//into_out为true时结果写入out,否则写回[first,last)
+template<typename Iterator, typename Compare = std::less<>>
+void parallel_sort(Iterator first, Iterator last, Compare comp = Compare(), thread_pool4& pool = default_pool()) {
+    typedef typename std::iterator_traits<Iterator>::value_type value_type;
+    long const length = last - first;
+    long const sort_cutoff = std::max(length / (4 * (long(pool.size()) + 1)), 1L << 13);
+    //叶子的数量约为线程数的4倍,窃取足以平衡负载;叶子过小时归并的层数增加,带宽成为瓶颈
+    if (length <= sort_cutoff) {
+        std::sort(first, last, comp);
+        return;
+    }
+    std::vector<value_type> buffer(std::make_move_iterator(first), std::make_move_iterator(last));
+    parallel_merge_sort(buffer.begin(), buffer.end(), first, true, comp, pool, sort_cutoff);
+    //数据先移动到缓冲区,在缓冲区中排序,最后一次归并正好写回原范围
+}
+
+//整数和定长键的并行基数排序(LSD)
+//比较排序至少需要O(n log n)次比较,对于32/64位的整数键和时间戳(例如chapter9-1中log_info::visit_time)
+//基数排序每次按8位的数字把所有键分配到256个桶中,从最低位到最高位共sizeof(Key)趟,每趟只顺序读写一遍数据
+//每一趟分为三步:每个线程统计自己数据块的直方图;对按(数字,块)排列的直方图做前缀和,得到每个块中每个数字的写入位置;每个线程按顺序把自己的块分散写入
+//同一数字内块的顺序与数据的顺序一致,块内也按顺序写入,因此每一趟都是稳定的,LSD基数排序因此是正确的
+template<typename Key>
+struct radix_key {
+    static_assert(std::is_arithmetic<Key>::value && !std::is_same<Key, bool>::value, "radix sort needs arithmetic keys");
+    typedef typename std::conditional<sizeof(Key) == 8, std::uint64_t,
+        typename std::conditional<sizeof(Key) == 4, std::uint32_t,
+        typename std::conditional<sizeof(Key) == 2, std::uint16_t, std::uint8_t>::type>::type>::type bits_type;
+    static bits_type to_bits(Key key) {
+        bits_type bits;
+        std::memcpy(&bits, &key, sizeof(Key));
+        bits_type const sign = bits_type(1) << (sizeof(Key) * 8 - 1);
+        if constexpr (std::is_floating_point<Key>::value) { return (bits & sign) ? ~bits : (bits | sign); }
+        else if constexpr (std::is_signed<Key>::value) { return bits ^ sign; }
+        else { return bits; }
+    }
+    //把键映射为无符号整数,并保持原有的大小顺序:有符号数翻转符号位,负的浮点数翻转所有位,正的浮点数翻转符号位
+};
+struct radix_no_values {};
+//只对键排序时的占位类型
+
+template<typename Key, typename Value>
+void parallel_radix_sort_impl(Key* keys, Value* values, std::size_t length, thread_pool4& pool) {
+    bool const has_values = !std::is_same<Value, radix_no_values>::value;
+    long const bucket_count = 256;
+    long const min_per_block = 1 << 16;
+    long const num_blocks = std::max(1L, std::min(long(pool.size()) + 1, long(length / min_per_block)));
+    //每个块都有自己的直方图,块太小时统计和前缀和的开销会超过分散写入本身
+    std::size_t const block_size = length / num_blocks;
+    std::vector<Key> key_buffer(length);
+    std::vector<Value> value_buffer(has_values ? length : 0);
+    Key* key_src = keys;
+    Key* key_dst = key_buffer.data();
+    Value* value_src = values;
+    Value* value_dst = value_buffer.data();
+    std::vector<std::size_t> histogram(bucket_count * num_blocks);
+    //按数字优先排列:histogram[digit * num_blocks + block],前缀和之后就是每个块中每个数字的起始写入位置
+    auto for_each_block = [&](auto func) {
+        std::vector<std::future<void>> futures(num_blocks - 1);
+        join_tasks<void> joiner(futures, pool);
+        for (long block = 0;block < num_blocks - 1;block++) {
+            futures[block] = pool.submit([&func, block, block_size] { func(block, block * block_size, (block + 1) * block_size); });
+        }
+        func(num_blocks - 1, (num_blocks - 1) * block_size, length);
+        for (long block = 0;block < num_blocks - 1;block++) {
+            pool.wait(futures[block]);
+            futures[block].get();
+        }
+    };
+    for (unsigned shift = 0;shift < sizeof(Key) * 8;shift += 8) {
+        auto digit = [shift](Key key) { return (radix_key<Key>::to_bits(key) >> shift) & 0xFF; };
+        for_each_block([&](long block, std::size_t begin, std::size_t end) {
+            std::size_t counts[256] = {};
+            for (std::size_t i = begin;i < end;i++) { counts[digit(key_src[i])]++; }
+            for (long d = 0;d < bucket_count;d++) { histogram[d * num_blocks + block] = counts[d]; }
+        });
+        //每个线程先在栈上的数组中计数,最后才写入共享的直方图,避免不同线程频繁写同一缓存行
+        bool skip = false;
+        for (long d = 0;d < bucket_count && !skip;d++) {
+            std::size_t total = 0;
+            for (long block = 0;block < num_blocks;block++) { total += histogram[d * num_blocks + block]; }
+            skip = total == length;
+        }
+        if (skip) { continue; }
+        //所有键在这一位上都相同时,这一趟不会改变顺序,直接跳过(时间戳的高位通常都相同)
+        parallel_exclusive_scan(histogram.begin(), histogram.end(), histogram.begin(), std::size_t(0),
+                                std::plus<>(), pool);
+        for_each_block([&](long block, std::size_t begin, std::size_t end) {
+            std::size_t offsets[256];
+            for (long d = 0;d < bucket_count;d++) { offsets[d] = histogram[d * num_blocks + block]; }
+            for (std::size_t i = begin;i < end;i++) {
+                std::size_t const pos = offsets[digit(key_src[i])]++;
+                key_dst[pos] = key_src[i];
+                if constexpr (!std::is_same<Value, radix_no_values>::value) { value_dst[pos] = std::move(value_src[i]); }
+            }
+        });
+        std::swap(key_src, key_dst);
+        std::swap(value_src, value_dst);
+    }
+    if (key_src != keys) {
+        for_each_block([&](long, std::size_t begin, std::size_t end) {
+            std::copy(key_src + begin, key_src + end, keys + begin);
+            if constexpr (!std::is_same<Value, radix_no_values>::value) {
+                std::move(value_src + begin, value_src + end, values + begin);
+            }
+        });
+    }//跳过的趟数为奇数时,结果留在缓冲区中,需要复制回原来的位置
+}
+//对[first,last)中的算术类型的键排序,迭代器必须指向连续存储的数据(指针或std::vector的迭代器,见headfile.h中的is_contiguous_iterator)
+template<typename Iterator>
+void parallel_radix_sort(Iterator first, Iterator last, thread_pool4& pool = default_pool()) {
+    static_assert(is_contiguous_iterator<Iterator>::value, "radix sort needs pointers or std::vector iterators");
+    if (first == last) { return; }
+    parallel_radix_sort_impl<typename std::iterator_traits<Iterator>::value_type, radix_no_values>(
+        contiguous_data(first), nullptr, last - first, pool);
+}
+//按键排序,值随着键一起移动,键相同的元素保持原有的顺序
+template<typename KeyIterator, typename ValueIterator>
+void parallel_radix_sort_by_key(KeyIterator key_first, KeyIterator key_last, ValueIterator value_first,
+                                thread_pool4& pool = default_pool()) {
+    static_assert(is_contiguous_iterator<KeyIterator>::value && is_contiguous_iterator<ValueIterator>::value,
+                  "radix sort needs pointers or std::vector iterators");
+    if (key_first == key_last) { return; }
+    parallel_radix_sort_impl(contiguous_data(key_first), contiguous_data(value_first), key_last - key_first, pool);
+}
+//返回使键有序的下标序列,可以用于对记录按某个字段排序而不移动记录本身
+template<typename Iterator>
+std::vector<std::size_t> parallel_radix_argsort(Iterator first, Iterator last, thread_pool4& pool = default_pool()) {
+    std::vector<typename std::iterator_traits<Iterator>::value_type> keys(first, last);
+    std::vector<std::size_t> indices(keys.size());
+    std::iota(indices.begin(), indices.end(), std::size_t(0));
+    parallel_radix_sort_by_key(keys.begin(), keys.end(), indices.begin(), pool);
+    return indices;
+}
+
 /*
  * 划分可以在处理前划分 也可以递归划分
  * 但当数据为动态长度时,这些将不起作用
@@ -108,10 +298,21 @@ std::list<T> parallel_quick_sort(std::list<T> input) {
  */
 
 
+#if !defined(CHAPTER_BENCHMARKS)
 int main() {
     std::list<int> list1 = { 5, 1, 6, 7, 2, 3, 6 };
     std::list<int> list2 = parallel_quick_sort(list1);
     for (auto i : list2) {
         std::cout << i << " ";
     }
-}
\ No newline at end of file
+    std::cout << "\n";
+    std::vector<int> ivec(1000000);
+    for (std::size_t i = 0;i < ivec.size();i++) { ivec[i] = (i * 7919LL) % 1000003; }
+    parallel_sort(ivec.begin(), ivec.end());
+    std::cout << std::is_sorted(ivec.begin(), ivec.end()) << "\n";
+    std::vector<time_t> visit_times = { 1700000300, 1700000100, 1700000200 };
+    std::vector<std::size_t> order = parallel_radix_argsort(visit_times.begin(), visit_times.end());
+    parallel_radix_sort(visit_times.begin(), visit_times.end());
+    std::cout << order[0] << " " << visit_times[0] << "\n";
+}
+#endif
@@ -32,8 +32,23 @@ void processing_loop() {
  * 当新增加的处理器时,counter变量必须要在缓存内做一份拷贝,再改变自己的值,这就叫做乒乓缓存(cache ping-pong)
  * 这种情况会对应用的性能有着重大的影响,当一个处理器因为等待缓存转移而停止运行时,这个处理器就不能做任何事情
  */
+//减少对counter的竞争(sharded_counter和range_claimer定义在headfile.h中)
+//1.批量领取:每次fetch_add领取batch项,counter的缓存行转移次数减少为原来的1/batch
+//2.分片计数:只用于统计的计数器(已处理的数量,命中次数等)不需要每次都得到准确的值
+//  每个线程修改自己的分片,需要总数时再读取,读取比修改少得多时总的开销更小
+range_claimer work_items(0, 100000000, 1024);
+sharded_counter processed;
+void processing_loop_batched() {
+    long begin, end;
+    while (work_items.claim(begin, end)) {
+        for (long i = begin;i < end;i++) { do_something(); }
+        processed.add(end - begin);
+    }
+}//processed.approximate()可以随时用于显示进度,所有线程结束后processed.exact()等于100000000
 std::mutex mtx;
 int data = 1;
+bool done_processing(int& value) { return --value < 0; }
+//书中没有给出done_processing,这里每次调用处理一项数据,处理完data项后结束
 void processing_loop_with_mutex() {
     while (true)   {
         std::lock_guard<std::mutex> lk(mtx);
@@ -7,109 +7,135 @@
 //在并行算法中,因为操作运行在独立的线程上,此时的异常不再允许被传播
 //此时的异常会使调用堆栈出现问题,如果函数在创建新线程后带着异常退出将导致整个应用终止
 
-template <typename Iterator, typename T>
-struct accumulate_block {
-    void operator()(Iterator first, Iterator last, T& result) {
-        result = std::accumulate(first, last, result);
-    }
-};
+//accumulate_block定义在headfile.h中,每个块使用simd_accumulate求和
 template<typename Iterator, typename T>
-T parallel_accmulate(Iterator first, Iterator last, T init) {
+T parallel_accmulate(Iterator first, Iterator last, T init, thread_pool4& pool = default_pool(),
+                     grain_hint hint = grain_hint()) {
+    adaptive_partitioner part(pool, hint);
+    T measured = T();
+    first = part.measure(first, last, [&measured](Iterator begin, Iterator end) {
+        accumulate_block<Iterator, T>()(begin, end, measured);
+        return false;
+    });
+    init = init + measured;
     long const length = std::distance(first, last);
     if (!length) { return init; }
-    long const min_per_thread = 25;
-    long const max_thread = (length + min_per_thread - 1) / min_per_thread;
-    long const hardware_threads = std::thread::hardware_concurrency();
-    long const num_threads = std::min(hardware_threads != 0 ? hardware_threads : 2, max_thread);
+    long const num_threads = part.num_blocks(length);
+    //块的数量由划分器根据测量得到的元素开销决定(见headfile.h中的adaptive_partitioner)
     long const block_size = length / num_threads;
     std::vector<T> results(num_threads);
-    std::vector<std::thread> threads(num_threads - 1);
-    //至此,调用线程没有做任何事情或产生新的线程,而构造threads抛出的异常会被析构函数清理
+    std::vector<std::future<void>> futures(num_threads - 1);
+    //至此,调用线程没有做任何事情或产生新的任务,而构造futures抛出的异常会被析构函数清理
+    join_tasks<void> joiner(futures, pool);
+    //joiner在results之后构造,先于results析构,函数因异常退出时会先等待已提交的任务,任务不会写入已销毁的results
     Iterator block_start = first;
     for (long i = 0;i < (num_threads - 1);i++) {
         Iterator block_end = block_start;
         std::advance(block_end, block_size);
-        threads[i] = std::thread(accumulate_block<Iterator, T>(),
-                                 block_start, block_end, std::ref(results[i]));
-        //此处将创建第一个线程,如果在这里抛出异常将会使新创建的thread对象销毁
-        //同时程序将调用std::terminate来中断整体的运行
+        futures[i] = pool.submit([block_start, block_end, &results, i] {
+            accumulate_block<Iterator, T>()(block_start, block_end, results[i]);
+        });
+        //最初的版本在这里创建线程,如果抛出异常,已经创建的thread对象会在未汇入时被销毁,程序将调用std::terminate
+        //提交到线程池不会产生这个问题,但提交失败时已提交的任务仍在引用results,函数不能就这样返回,由joiner等待它们完成
         block_start = block_end;
     }
     accumulate_block<Iterator, T>()(block_start, last, results[num_threads - 1]);
-    std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+    for (long i = 0;i < (num_threads - 1);i++) {
+        pool.wait(futures[i]);
+        futures[i].get();
+    }
+    //只等待而不调用get(),任务中抛出的异常会被丢弃,调用者得到一个错误的结果
     return std::accumulate(results.begin(), results.end(), init);
-    //整体的代码是非异常安全的,很多地方的调用都可能抛出异常
+    //最初的代码是非异常安全的,很多地方的调用都可能抛出异常
     //像accumulate_block的调用处,函数的返回处
     //处理异常最好能确定所有抛出异常的地方,再来解决异常问题
-    //若允许代码产生异常,可以与std::packaged_task和std::future相结合来解决
+    //若允许代码产生异常,可以与std::packaged_task和std::future相结合来解决(下面的parallel_accmulate2)
 }
 
 //使用std::packaged_task后的处理方式
 template <typename Iterator, typename T>
 struct accumulate_block2 {
-    void operator()(Iterator first, Iterator last) {
-        return std::accumulate(first, last, T());
+    T operator()(Iterator first, Iterator last) {
+        return simd_accumulate(first, last, T());
         //结果直接返回不再储存 使用packaged_task和future是线程安全的,可以用来对结果进行转移
+        //simd_accumulate(headfile.h)对连续存储的算术类型使用AVX2,其他情况与std::accumulate相同
     }
 };
 template <typename Iterator, typename T>
-T parallel_accmulate2(Iterator first, Iterator last, T init) {
+T parallel_accmulate2(Iterator first, Iterator last, T init, thread_pool4& pool = default_pool(),
+                      grain_hint hint = grain_hint()) {
+    adaptive_partitioner part(pool, hint);
+    first = part.measure(first, last, [&init](Iterator begin, Iterator end) {
+        init += accumulate_block2<Iterator, T>()(begin, end);
+        return false;
+    });
     long const length = std::distance(first, last);
     if (!length) { return init; }
-    long const min_per_thread = 25;
-    long const max_threads = (length + min_per_thread - 1) / min_per_thread;
-    long const hardware_thread = std::thread::hardware_concurrency();
-    long const num_threads = std::min(hardware_thread != 0 ? hardware_thread : 2, max_threads);
+    long const num_threads = part.num_blocks(length);
     long const block_size = length / num_threads;
     std::vector<std::future<T>> futures(num_threads - 1);
-    //通过使用期望值储存线程的结果
-    std::vector<std::thread> threads(num_threads - 1);
-    join_threads joiner(threads);
-    //线程汇入主线程后将被自动删除
+    //通过使用期望值储存任务的结果
+    join_tasks<T> joiner(futures, pool);
+    //与join_threads相同,离开作用域时会等待所有已提交的任务完成
     Iterator block_start = first;
-    for (unsigned long i = 0;i < (num_threads - 1);i++) {
+    for (long i = 0;i < (num_threads - 1);i++) {
         Iterator block_end = block_start;
         std::advance(block_end, block_size);
-        std::packaged_task<T(Iterator, Iterator)> task(accumulate_block2<Iterator, T>());
-        futures[i] = task.get_future();
-        threads[i] = std::thread(std::move(task), block_start, block_end);
+        futures[i] = pool.submit([block_start, block_end] {
+            return accumulate_block2<Iterator, T>()(block_start, block_end);
+        });
         block_start = block_end;
-        //在此处创建任务并从任务中获取期望值,再将需要处理的数据块的开始与结束信息传入线程
+        //线程池的submit内部使用packaged_task包装任务,并返回其期望值
         //任务执行时期望值会获取对应的结果或抛出异常
     }
     T last_result = accumulate_block2<Iterator, T>()(block_start, last);
     //期望值不能获得一组结果数组,所以需要将最终数据块的结果赋给一个变量进行保存
-    std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
     T result = init;
-    for (long i = 0; i < (num_threads - 1); i++) { result += futures[i].get(); }
+    for (long i = 0; i < (num_threads - 1); i++) {
+        pool.wait(futures[i]);
+        result += futures[i].get();
+    }
     //使用简for循环在这里比使用std::accumulate好,循环从提供的初始值开始,并且将每个期望值上的值进行累加
-    //对future.get的调用会阻塞线程,直到结果准备就绪
+    //pool.wait会在结果就绪前执行线程池中的其他任务,而不是阻塞调用线程
     //如果相关任务抛出一个异常,就会被期望值捕捉到,并且使用get()的时候获取数据时,这个异常会再次抛出
-    //当生成第一个新线程和当所有线程都汇入主线程时抛出异常,会让线程产生泄露
     result += last_result;
     return result;
 }
 
 //使用std::async的处理方式
+//std::async可能为每次划分都创建一个线程,这里改为将一半数据提交到线程池中
 template <typename Iterator, typename T>
-T parallel_accmulate3(Iterator first, Iterator last, T init) {
+T parallel_accmulate3_impl(Iterator first, Iterator last, T init, thread_pool4& pool, long max_chunk_size) {
     long const length = std::distance(first, last);
-    long const max_chunk_size = 25;
-    if (length <= max_chunk_size) { return std::accumulate(first, last, init); }
+    if (length <= max_chunk_size) { return simd_accumulate(first, last, init); }
     //数据长度小于最大限制可以直接调用accumulate
     else {
         Iterator mid_point = first;
         std::advance(mid_point, length / 2);
-        std::future<T> first_half_result = std::async(parallel_accmulate3<Iterator, T>,
-                                                      first, mid_point, init);
-        T second_half_result = parallel_accmulate3(mid_point, last, T());
-        //通过递归将数据分成两部分,再生成一个异步任务对另外一半数据进行处理
-        //async能够保证充分利用硬件线程,也不会产生超额认购,同时也是异常安全的
-        //通过调用async产生的期望值,将会在异常传播时被销毁
-        //另外当异步任务抛出异常且被期望值所捕获,会在调用get()时抛出
-        return first_half_result.get() + second_half_result;
+        std::vector<std::future<T>> first_half_result(1);
+        join_tasks<T> joiner(first_half_result, pool);
+        first_half_result[0] = pool.submit([first, mid_point, init, &pool, max_chunk_size] {
+            return parallel_accmulate3_impl(first, mid_point, init, pool, max_chunk_size);
+        });
+        T second_half_result = parallel_accmulate3_impl(mid_point, last, T(), pool, max_chunk_size);
+        //通过递归将数据分成两部分,再提交一个任务对另外一半数据进行处理
+        //工作线程提交的任务进入自己的本地队列,空闲的线程会从队列尾部窃取较大的任务
+        //第二半抛出异常时,joiner会等待第一半的任务结束后再传播异常
+        pool.wait(first_half_result[0]);
+        return first_half_result[0].get() + second_half_result;
     }
 }
+template <typename Iterator, typename T>
+T parallel_accmulate3(Iterator first, Iterator last, T init, thread_pool4& pool = default_pool(),
+                      grain_hint hint = grain_hint()) {
+    adaptive_partitioner part(pool, hint);
+    first = part.measure(first, last, [&init](Iterator begin, Iterator end) {
+        init = simd_accumulate(begin, end, init);
+        return false;
+    });
+    return parallel_accmulate3_impl(first, last, init, pool, part.grain());
+    //递归的终止长度不再固定为25,而是测量得到的块大小,每个叶子任务的运行时间大致相同
+}
 
 //可扩展性
 /* 对于任意的多线程程序,运行时的工作线程数量会有所不同
@@ -132,5 +158,23 @@ T parallel_accmulate3(Iterator first, Iterator last, T init) {
  */
 
 int main() {
-    
+    std::vector<int> ivec(100000);
+    std::iota(ivec.begin(), ivec.end(), 0);
+    std::list<int> ilist(ivec.begin(), ivec.end());
+    std::vector<double> dvec(ivec.begin(), ivec.end());
+    thread_pool4 pool(4);
+    grain_hint const small_blocks(0, 1000);
+    //限制块的大小,即使累加很廉价也会拆分成多个任务提交到线程池中
+    long long const expected = std::accumulate(ivec.begin(), ivec.end(), 0LL);
+    std::cout << expected << " "
+        << parallel_accmulate(ivec.begin(), ivec.end(), 0LL, pool, small_blocks) << " "
+        << parallel_accmulate2(ivec.begin(), ivec.end(), 0LL, pool, small_blocks) << " "
+        << parallel_accmulate3(ivec.begin(), ivec.end(), 0LL, pool, small_blocks) << "\n";
+    std::cout << parallel_accmulate(ilist.begin(), ilist.end(), 0LL, pool, small_blocks) << " "
+        << parallel_accmulate2(ilist.begin(), ilist.end(), 0LL, pool, small_blocks) << " "
+        << parallel_accmulate3(ilist.begin(), ilist.end(), 0LL, pool, small_blocks) << "\n";
+    std::cout << parallel_accmulate(dvec.begin(), dvec.end(), 0.0) << " "
+        << parallel_accmulate2(dvec.begin(), dvec.end(), 0.0) << " "
+        << parallel_accmulate3(dvec.begin(), dvec.end(), 0.0) << "\n";
+    //默认参数使用共享的default_pool()和测量得到的块大小
 }
\ No newline at end of file
@@ -1,54 +1,53 @@
 #include "../headfile.h"
 
 //并行实现std::for_each
+//按线程数平均划分时,如果func的开销随元素变化,先完成的线程只能空闲等待最慢的块
+//这里使用自适应划分器的延迟二分:只有存在空闲线程时才拆分剩余部分,块的大小由测量得到的开销决定
 template<typename Iterator, typename Func>
-void parallel_for_each(Iterator first, Iterator last, Func func) {
-    long const length = std::distance(first, last);
-    if (!length) { return; }
-    long const min_per_thread = 25;
-    long const max_threads = (length + min_per_thread - 1) / min_per_thread;
-    long const hardware_threads = std::thread::hardware_concurrency();
-    long const num_threads = std::min(hardware_threads != 0 ? hardware_threads : 2, max_threads);
-    long const block_size = length / num_threads;
-    std::vector<std::future<void>> futures(num_threads - 1);
-    std::vector<std::thread> threads(num_threads - 1);
-    join_threads joiner(threads);
-
-    Iterator block_start = first;
-    for (int i = 0;i < (num_threads - 1);i++) {
-        Iterator block_end = block_start;
-        std::advance(block_end, block_size);
-        std::packaged_task<void(void)> task([=]() {std::for_each(block_start, block_end, func);});
-        //使用lambda函数使范围内的任务执行f函数
-        futures[i] = task.get_future();
-        threads[i] = std::thread(std::move(task));
-        block_start = block_end;
-    }
-    std::for_each(block_start, last, func);
-    for (int i = 0;i < (num_threads - 1);i++) { futures[i].get(); }
-    //该步骤只是为了决定是否将出现的异常进行传递
+void parallel_for_each(Iterator first, Iterator last, Func func, thread_pool4& pool = default_pool(),
+                       grain_hint hint = grain_hint()) {
+    adaptive_for_each_block(first, last, [&func](Iterator begin, Iterator end) {
+        std::for_each(begin, end, func);
+    }, pool, hint);
+    //任务中抛出的异常会通过期望值传递给调用者
 }
 //async版本
 template<typename Iterator, typename Func>
-void parallel_for_each2(Iterator first, Iterator last, Func func) {
+void parallel_for_each2_impl(Iterator first, Iterator last, Func func, thread_pool4& pool, long min_per_thread) {
     long const length = std::distance(first, last);
     if (!length) { return; }
-    long const min_per_thread = 25;
     if (length < (2 * min_per_thread)) { std::for_each(first, last, func); }
     else {
         Iterator const mid_point = first + (length / 2);
-        std::future<void> first_half = std::async(&parallel_for_each2<Iterator, Func>,
-                                                  first, mid_point, func);
-        parallel_for_each2(mid_point, last, func);
-        //同样将数据分为两部分,异步执行另外一部分
-        first_half.get();
+        std::vector<std::future<void>> first_half(1);
+        join_tasks<void> joiner(first_half, pool);
+        first_half[0] = pool.submit([first, mid_point, func, &pool, min_per_thread] {
+            parallel_for_each2_impl(first, mid_point, func, pool, min_per_thread);
+        });
+        parallel_for_each2_impl(mid_point, last, func, pool, min_per_thread);
+        //同样将数据分为两部分,另外一部分作为任务提交到线程池中
+        //std::async可能为每次划分都创建一个新线程,而线程池中的任务只需要一次入队
+        pool.wait(first_half[0]);
+        first_half[0].get();
     }
 }
+template<typename Iterator, typename Func>
+void parallel_for_each2(Iterator first, Iterator last, Func func, thread_pool4& pool = default_pool(),
+                        grain_hint hint = grain_hint()) {
+    adaptive_partitioner part(pool, hint);
+    first = part.measure(first, last, [&func](Iterator begin, Iterator end) {
+        std::for_each(begin, end, func);
+        return false;
+    });
+    parallel_for_each2_impl(first, last, func, pool, part.grain());
+}//递归的终止长度使用测量得到的块大小
 
 //并行实现std::find
 //find算法不同于上一个for_each,当元素满足中查找标准时,算法就可以直接退出而无需对其他元素进行搜索了
+//这个版本返回最先被找到的匹配元素,而不一定是最靠前的那个(与std::find的语义不同),下方的parallel_find返回最靠前的匹配
 template<typename Iterator, typename MatchT>
-Iterator parallel_find(Iterator first, Iterator last, MatchT match) {
+Iterator parallel_find_any(Iterator first, Iterator last, MatchT match, thread_pool4& pool = default_pool(),
+                       grain_hint hint = grain_hint()) {
     struct find_element {
         void operator()(Iterator begin, Iterator end, MatchT match,
                         std::promise<Iterator>* result,
@@ -76,42 +75,49 @@ Iterator parallel_find(Iterator first, Iterator last, MatchT match) {
         //循环检查给定数据块中的元素和完成标识
         //如果匹配的元素被找到,将结果设置到承诺值中,并设置标识然后返回
     };
+    adaptive_partitioner part(pool, hint);
+    Iterator found = last;
+    first = part.measure(first, last, [&found, &match](Iterator begin, Iterator end) {
+        Iterator const it = std::find(begin, end, match);
+        if (it != end) { found = it; }
+        return it != end;
+    });
+    if (found != last) { return found; }
+    //测量时已经顺序查找了一段前缀,匹配的元素靠前时不需要提交任何任务
     long const length = std::distance(first, last);
     if (!length) { return last; }
-    long const min_per_thread = 25;
-    long const max_threads = (length + min_per_thread - 1) / min_per_thread;
-    long const hardware_threads = std::thread::hardware_concurrency();
-    long const num_threads = std::min(hardware_threads != 0 ? hardware_threads : 2, max_threads);
+    long const num_threads = part.num_blocks(length);
     long const block_size = length / num_threads;
 
     std::promise<Iterator> result;
     std::atomic<bool> done_flag(false);
     //用于停止搜索的两个变量
-    std::vector<std::thread> threads(num_threads - 1);
+    std::vector<std::future<void>> futures(num_threads - 1);
     {
-        join_threads joiner(threads);
+        join_tasks<void> joiner(futures, pool);
         Iterator block_start = first;
         for (int i = 0;i < (num_threads - 1);i++) {
             Iterator block_end = block_start;
             std::advance(block_end, block_size);
-            threads[i] = std::thread(find_element(), block_start, block_end,
-                                     match, &result, &done_flag);
+            futures[i] = pool.submit([block_start, block_end, match, &result, &done_flag] {
+                find_element()(block_start, block_end, match, &result, &done_flag);
+            });
             block_start = block_end;
         }
         find_element()(block_start, last, match, &result, &done_flag);
-        //新线程在查找的过程中,主线程同时也在对剩下的元素进行查找
+        //线程池在查找的过程中,调用线程同时也在对剩下的元素进行查找
     }
     if (!done_flag.load()) { return last; }
-    //同时由于在启动-汇总在上方一个代码块中,所有线程都会在找到匹配元素时进行汇入
+    //同时由于在提交-等待在上方一个代码块中,所有任务都会在找到匹配元素时结束
     return result.get_future().get();
     //获取查找返回或是异常
 }
 template<typename Iterator, typename MatchT>
 //async版本
-Iterator parallel_find2_impl(Iterator first, Iterator last, MatchT match, std::atomic<bool>& done) {
+Iterator parallel_find2_impl(Iterator first, Iterator last, MatchT match, std::atomic<bool>& done,
+                            thread_pool4& pool, long min_per_thread) {
     try {
         long const length = std::distance(first, last);
-        long const min_per_thread = 25;
         if (length < (2 * min_per_thread)) {
             for (;(first != last) && !done.load();first++) {
                 if (*first == match) {
@@ -123,12 +129,17 @@ Iterator parallel_find2_impl(Iterator first, Iterator last, MatchT match, std::a
         }
         else {
             Iterator const mid_point = first + (length / 2);
-            std::future<Iterator> async_result =
-                std::async(&parallel_find2_impl<Iterator, MatchT>, mid_point,
-                           last, match, std::ref(done));
-            Iterator const direct_result = parallel_find2_impl(first, mid_point, match, done);
-            return (direct_result == mid_point) ? async_result.get() : direct_result;
-            //同样将数据分成两部分,通过不同线程来分别执行
+            std::vector<std::future<Iterator>> async_result(1);
+            join_tasks<Iterator> joiner(async_result, pool);
+            async_result[0] = pool.submit([mid_point, last, match, &done, &pool, min_per_thread] {
+                return parallel_find2_impl(mid_point, last, match, done, pool, min_per_thread);
+            });
+            Iterator const direct_result = parallel_find2_impl(first, mid_point, match, done, pool, min_per_thread);
+            pool.wait(async_result[0]);
+            Iterator const other_result = async_result[0].get();
+            return (direct_result == mid_point) ? other_result : direct_result;
+            //同样将数据分成两部分,通过线程池中的不同线程来分别执行
+            //任务引用了done,所以无论哪一边找到结果都要等待另一边的任务结束
         }
     }
     //函数无论是因为已经查找到最后一个,还是因为其他线程对done进行了设置,都会停止查找
@@ -139,9 +150,94 @@ Iterator parallel_find2_impl(Iterator first, Iterator last, MatchT match, std::a
     }
 }
 template <typename Iterator, typename MatchT>
-Iterator parallel_find2(Iterator first, Iterator last, MatchT match) {
-    std::atomic<bool>* done(false);
-    return parallel_find2(first, last, match, done);
+Iterator parallel_find2(Iterator first, Iterator last, MatchT match, thread_pool4& pool = default_pool(),
+                        grain_hint hint = grain_hint()) {
+    adaptive_partitioner part(pool, hint);
+    Iterator found = last;
+    first = part.measure(first, last, [&found, &match](Iterator begin, Iterator end) {
+        Iterator const it = std::find(begin, end, match);
+        if (it != end) { found = it; }
+        return it != end;
+    });
+    if (found != last) { return found; }
+    std::atomic<bool> done(false);
+    return parallel_find2_impl(first, last, match, done, pool, part.grain());
+}
+
+//按块查找,返回最靠前的匹配元素
+//上面的两个版本在每个元素上都要读取共享的完成标识,一旦有线程找到匹配并写入标识,所有线程缓存中的这一行都会失效
+//这里每个块内是不访问任何共享变量的普通循环(编译器可以向量化),只在开始一个块之前检查一次是否需要取消
+//块按从左到右的顺序被领取,找到匹配后只记录最小的下标:起点在匹配右侧的块被取消,左侧已经领取的块仍会完成,因为它们可能包含更靠前的匹配
+template<typename Iterator, typename Predicate>
+Iterator parallel_find_if(Iterator first, Iterator last, Predicate pred, thread_pool4& pool = default_pool(),
+                          grain_hint hint = grain_hint()) {
+    if constexpr (!std::is_base_of<std::random_access_iterator_tag,
+                                   typename std::iterator_traits<Iterator>::iterator_category>::value) {
+        return std::find_if(first, last, pred);
+        //块需要通过下标直接定位,非随机访问的迭代器只能顺序查找
+    }
+    else {
+        adaptive_partitioner part(pool, hint);
+        Iterator found = last;
+        first = part.measure(first, last, [&found, &pred](Iterator begin, Iterator end) {
+            Iterator const it = std::find_if(begin, end, pred);
+            if (it != end) { found = it; }
+            return it != end;
+        });
+        if (found != last) { return found; }
+        //测量时顺序查找的前缀中的匹配一定是最靠前的
+        long const length = last - first;
+        long const block_size = part.grain();
+        long const num_blocks = (length + block_size - 1) / block_size;
+        if (num_blocks <= 1) { return std::find_if(first, last, pred); }
+        std::atomic<long> next_block(0);
+        std::atomic<long> best(length);
+        auto search_blocks = [&] {
+            try {
+                for (;;) {
+                    long const block = next_block.fetch_add(1, std::memory_order_relaxed);
+                    long const begin = block * block_size;
+                    if (begin >= length || begin >= best.load(std::memory_order_relaxed)) { return; }
+                    //每个块只检查一次取消,之后领取的块只会更靠右,可以直接结束
+                    long const end = std::min(begin + block_size, length);
+                    Iterator const it = std::find_if(first + begin, first + end, pred);
+                    if (it != first + end) {
+                        long const index = it - first;
+                        long current = best.load(std::memory_order_relaxed);
+                        while (index < current && !best.compare_exchange_weak(current, index, std::memory_order_relaxed));
+                        return;
+                    }
+                }
+            }
+            catch (...) {
+                best.store(-1, std::memory_order_relaxed);
+                throw;
+                //谓词抛出异常时取消所有的块,异常通过期望值传递给调用者
+            }
+        };
+        std::vector<std::future<void>> futures(std::min(long(pool.size()), num_blocks - 1));
+        {
+            join_tasks<void> joiner(futures, pool);
+            for (std::size_t i = 0;i < futures.size();i++) { futures[i] = pool.submit(search_blocks); }
+            search_blocks();
+            for (std::size_t i = 0;i < futures.size();i++) {
+                pool.wait(futures[i]);
+                futures[i].get();
+            }
+        }
+        //任务结束时所有写入都已经同步到调用线程,best只需要relaxed的原子操作
+        return first + best.load(std::memory_order_relaxed);
+    }
+}
+template<typename Iterator, typename T>
+Iterator parallel_find(Iterator first, Iterator last, T const& value, thread_pool4& pool = default_pool(),
+                       grain_hint hint = grain_hint()) {
+    return parallel_find_if(first, last, [&value](auto const& item) { return item == value; }, pool, hint);
+}
+template<typename Iterator, typename Predicate>
+bool parallel_any_of(Iterator first, Iterator last, Predicate pred, thread_pool4& pool = default_pool(),
+                     grain_hint hint = grain_hint()) {
+    return parallel_find_if(first, last, pred, pool, hint) != last;
 }
 
 //std::partial_sum
@@ -158,70 +254,21 @@ Iterator parallel_find2(Iterator first, Iterator last, MatchT match) {
  */
 
 //并行实现std::partial_sum
+//书中的版本把序列分块,每个块先计算自己的部分和,再等待前一个块的最后一个值传递过来(promise/future),加到块中的每个元素上
+//块之间形成一条串行的依赖链,并且在线程池中会死锁:块i在pool.wait中等待块i-1时,可能从队列中取出块i+1在同一个栈上执行
+//块i+1又在等待块i,而块i要等块i+1返回后才能继续,任务不能等待依赖链上排在它后面的任务的结果
+//这里改为使用headfile.h中的parallel_inclusive_scan(两趟的分块扫描):
+//先并行归约出每个块的和,调用线程串行扫描这些和得到每个块的偏移,再并行地以偏移为初值扫描每个块
+//两趟中的任务互相独立,只有调用线程在等待,块之间只在两趟之间同步一次,总工作量约为2n
 template <typename Iterator>
-Iterator parallel_partal_sum(Iterator first, Iterator last) {
-    typedef typename Iterator::value_type value_type;
-    struct process_chunk {
-        void operator()(Iterator begin, Iterator last, std::future<value_type>* previous_end_value,
-                        std::promise<value_type>* end_value) {
-            try {
-                Iterator end = last;
-                end++;
-                std::partial_sum(begin, end, begin);
-                //此处是对最后一个值进行处理
-                if (previous_end_value) {
-                    value_type addend = previous_end_value->get();
-                    *last += addend;
-                    if (end_value) { end_value->set_value(*last); }
-                    std::for_each(begin, last, [addend](value_type& item) {item += addend;});
-                    //当前块如果不是第一块,需要等待previous_end_value的值从前方的块传递过来
-                    //为了算法的并行,将会首先对最后一个元素进行更新,以将其传递给下一个数据块
-                    //完成后就可以用for_each对剩余的数据项进行更新
-                }
-                else if (end_value) { end_value->set_value(*last); }
-                //previous_end_value的值为空,表明当前块为第一个数据块,因此只需为下一个数据块更新
-            }
-            catch (...) {
-                if (end_value) { end_value->set_exception(std::current_exception()); }
-                else { throw; }
-                //在操作出现异常时,会将其捕获并存入承诺值
-                //直到处理最后一个数据块时再抛出异常
-            }
-        }
-    };
-    long const length = std::distance(first, last);
-    if (!length) return last;
-    long const min_per_thread = 25;
-    long const max_threads = (length + min_per_thread - 1) / min_per_thread;
-    long const hardware_threads = std::thread::hardware_concurrency();
-    long const num_threads = std::min(hardware_threads != 0 ? hardware_threads : 2, max_threads);
-    long const block_size = length / num_threads;
-    typedef typename Iterator::value_type value_type;
-    std::vector<std::thread> threads(num_threads - 1);
-    std::vector<std::promise<value_type>> end_values(num_threads - 1);
-    //线程和承诺指用于储存每块中的最后一个值
-    std::vector<std::future<value_type>> previous_end_values;
-    //期望值用于对前一块中的最后一个值进行检索
-    previous_end_values.reserve(num_threads - 1);
-    join_threads joiner(threads);
-    Iterator block_start = first;
-    for (int i = 0;i < (num_threads - 1);i++) {
-        Iterator block_last = block_start;
-        std::advance(block_last, block_size - 1);
-        threads[i] = std::thread(process_chunk(), block_start, block_last,
-                                 (i != 0) ? &previous_end_values[i - 1] : 0,
-                                 &end_values[i]);
-        block_start = block_last;
-        ++block_start;
-        previous_end_values.push_back(end_values[i].get_future());
-    }
-    Iterator final_element = block_start;
-    std::advance(final_element, std::distance(block_start, last) - 1);
-    process_chunk()(block_start, final_element,
-                    (num_threads > 1) ? &previous_end_values.back() : 0, 0);
-    //获取之前数据块中最后一个元素的迭代器,并将其作为参数传入process_chunk中
-    return final_element;
+Iterator parallel_partal_sum(Iterator first, Iterator last, thread_pool4& pool = default_pool(),
+                             grain_hint hint = grain_hint()) {
+    if (first == last) return last;
+    Iterator const end = parallel_inclusive_scan(first, last, first, std::plus<>(), pool, hint);
+    return std::prev(end);
+    //与书中的版本相同,就地计算并返回指向最后一个元素的迭代器
 }
+//parallel_inclusive_scan/parallel_exclusive_scan还支持自定义的运算和不包含当前元素的前缀和
 
 //单个处理器处理对一定数量的元素执行同一条指令,这种方式称为单指令-多数据流(SIMD)
 //因此代码必须能处理通用情况,并且需要在每步上对线程进行显式同步
@@ -229,10 +276,19 @@ Iterator parallel_partal_sum(Iterator first, Iterator last) {
 
 
 
+#if !defined(CHAPTER_BENCHMARKS)
 int main() {
     std::vector<int> ivec = { 1,2,3,4,5,6,7,8,9,10 };
     parallel_partal_sum(ivec.begin(), ivec.end());
     for (auto it : ivec) {
         std::cout << it << " ";
     }
-}
\ No newline at end of file
+    std::cout << "\n";
+    std::vector<int> ovec(ivec.size());
+    parallel_exclusive_scan(ivec.begin(), ivec.end(), ovec.begin(), 0);
+    parallel_inclusive_scan(ivec.begin(), ivec.end(), ivec.begin(), [](int a, int b) { return std::max(a, b); });
+    for (auto it : ovec) {
+        std::cout << it << " ";
+    }
+}
+#endif
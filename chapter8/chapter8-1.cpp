@@ -24,10 +24,9 @@ private:
         //从任务队列中获取并执行任务,没有则休眠线程
     }
 public:
-    thread_pool() :done(false), joiner(threads) {
-        int const thread_const = std::thread::hardware_concurrency();
+    explicit thread_pool(unsigned thread_const = std::thread::hardware_concurrency()) :done(false), joiner(threads) {
         try {
-            for (int i = 0;i < thread_const;i++) {
+            for (unsigned i = 0;i < thread_const;i++) {
                 threads.push_back(std::thread(&thread_pool::worker_thread, this));
             }
         }
@@ -47,33 +46,7 @@ public:
 //使用submit()返回对任务描述的句柄,等待任务完成,任务句柄用条件变量或期望值包装
 //有些任务需要子线程返回一个结果到主线程上进行处理,在线程工作完成后会返回一个结果到等待线程中去
 //std::packaged_task<>是不可拷贝的,但std::function()是需要储存可赋值构造的函数对象
-class function_wrapper {
-private:
-    struct impl_base {
-        virtual void call() = 0;
-        virtual ~impl_base() {}
-    };
-    std::unique_ptr<impl_base> impl;
-    template<typename Func>
-    struct impl_type :impl_base {
-        Func func;
-        impl_type(Func&& func_) :func(std::move(func_)) {}
-        void call() { func(); };
-    };
-public:
-    template<typename Func>
-    function_wrapper(Func&& func) :impl(new impl_type<Func>(std::move(func))) {}
-    void operator()() { impl->call(); }
-    function_wrapper() = default;
-    function_wrapper(function_wrapper&& other) :impl(std::move(other.impl)) {}
-    function_wrapper& operator=(function_wrapper&& other) {
-        impl = std::move(other.impl);
-        return *this;
-    }
-    function_wrapper(const function_wrapper&) = delete;
-    function_wrapper(function_wrapper&) = delete;
-    function_wrapper& operator=(const function_wrapper&) = delete;
-};
+//function_wrapper定义在headfile.h中,对Func使用了std::decay,传入左值时不会保存成引用
 class thread_pool2 {
 private:
     std::atomic_bool done;
@@ -221,105 +194,18 @@ public:
 //可以通过窃取任务的方式,让没有工作的线程从其他线程的任务队列中获取任务
 
 
-class work_steal_queue {
-private:
-    typedef function_wrapper data_type;
-    std::deque<data_type> queue;
-    mutable std::mutex mtx;
-public:
-    work_steal_queue() {}
-    work_steal_queue(const work_steal_queue& other) = delete;
-    work_steal_queue& operator=(const work_steal_queue& other) = delete;
-    void push(data_type data) {
-        std::lock_guard<std::mutex> lk(mtx);
-        queue.push_front(std::move(data));
-    }
-    bool empty() const {
-        std::lock_guard<std::mutex> lk(mtx);
-        return queue.empty();
-    }
-    bool try_pop(data_type& res) {
-        std::lock_guard<std::mutex> lk(mtx);
-        if (queue.empty()) { return false; }
-        res = std::move(queue.front());
-        queue.pop_front();
-        return true;
-    }
-    bool try_steal(data_type& res) {
-        std::lock_guard<std::mutex> lk(mtx);
-        if (queue.empty()) { return false; }
-        res = std::move(queue.back());
-        queue.pop_back();
-        return true;
-    }
-    //对std::deque<fuction_wrapper>进行了简单的包装,通过一个互斥锁来对所有访问进行控制
-    //push和try_pop对队列的前端进行操作,try_steal对队列的后端进行操作
-};
+//work_steal_queue定义在headfile.h中
+//对std::deque<fuction_wrapper>进行了简单的包装,通过一个互斥锁来对所有访问进行控制
+//push和try_pop对队列的前端进行操作,try_steal对队列的后端进行操作
 //拥有任务窃取的线程池
-class thread_pool4 {
-private:
-    typedef function_wrapper task_type;
-    std::atomic_bool done;
-    thread_safe_queue<task_type> pool_work_queue;
-    std::vector<std::unique_ptr<work_steal_queue>> queues;
-    std::vector<std::thread> threads;
-    join_threads joiner;
-    static thread_local work_steal_queue* local_work_queue;
-    static thread_local int index;
-    void worker_thread(int index_) {
-        index = index_;
-        local_work_queue = queues[index].get();
-        while (!done) { run_pending_task(); }
-    }
-    bool pop_task_from_local_queue(task_type& task) {
-        return local_work_queue && local_work_queue->try_pop(task);
-    }
-    bool pop_task_from_pool_queue(task_type& task) {
-        return pool_work_queue.try_pop(task);
-    }
-    bool pop_task_from_other_thread_queue(task_type& task) {
-        for (int i = 0;i < queues.size();i++) {
-            int const new_index = (index + i + 1) % queues.size();
-            if (queues[new_index]->try_steal(task)) { return true; }
-        }
-        return false;
-    }
-public:
-    thread_pool4() :done(false), joiner(threads) {
-        int const thread_count = std::thread::hardware_concurrency();
-        try {
-            for (int i = 0;i < thread_count;i++) {
-                queues.push_back(std::unique_ptr<work_steal_queue>(new work_steal_queue));
-                threads.push_back(std::thread(&thread_pool4::worker_thread, this, i));
-            }
-        }
-        catch (...) {
-            done = true;
-            throw;
-        }
-    }
-    template <typename Function>
-    std::future<typename std::result_of<Function()>::type> submit(Function func) {
-        typedef typename std::result_of<Function()>::type result_type;
-        std::packaged_task<result_type()> task(func);
-        std::future<result_type> res(task.get_future());
-        if (local_work_queue) { local_work_queue->push(std::move(task)); }
-        else { pool_work_queue.push(std::move(task)); }
-        return res;
-    }
-    void run_pending_task() {
-        task_type task;
-        if (pop_task_from_local_queue(task) ||
-            pop_task_from_pool_queue(task) ||
-            pop_task_from_other_thread_queue(task)) {
-            task();
-        }
-        else { std::this_thread::yield(); }
-    }
-    ~thread_pool4() { done = true; }
-};
+//thread_pool4定义在headfile.h中,并通过default_pool()在进程内共享,chapter7中的并行算法都在这个线程池上运行
+//每个工作线程有自己的work_steal_queue,工作线程提交的任务放入本地队列,其他线程提交的任务放入全局队列
+//线程自己的队列和全局队列都为空时,会依次尝试从其他线程的队列尾部窃取任务
+//没有任务时工作线程会在条件变量上休眠,而不是一直调用yield()占用CPU
 
 
+#if !defined(CHAPTER_BENCHMARKS)
 int main() {
 
 }
+#endif
@@ -11,24 +11,27 @@ public:
     bool joinable() const;
     void interrupt();
 };*/
-class thread_interrupted {
+//thread_interrupted和interruption_point()已移到headfile.h中,线程池的任务也使用它们
+/*class thread_interrupted {
 private:
     std::string except;
 public:
     thread_interrupted(std::string_view str = "Thread interrupt") :except(str) {}
     //异常构造函数传入的类型为string_view
     std::string what() const { return except; }
-};
+};*/
 
 //在不添加多余的数据的前提下,为了使断点能够正常使用,就需要使用一个没有参数的函数
 //这意味着中断数据结构可以访问thread_local变量,并在线程运行时,对变量进行设置
 class interrupt_flag {
 private:
-    std::atomic<bool> flag;
+    stop_source source;
 public:
-    void set() { flag.store(true, std::memory_order_relaxed); }
-    bool is_set() const { return flag.load(std::memory_order_relaxed); }
+    void set() { source.request_stop(); }
+    bool is_set() const { return source.stop_requested(); }
+    stop_token get_token() const { return source.get_token(); }
 };
+//中断标志由stop_source实现,set()除了设置标志,还会调用线程等待时注册的回调,直接唤醒它阻塞的条件变量
 thread_local interrupt_flag this_thread_interrupt_flag;
 class interruptible_thread {
 private:
@@ -39,6 +42,7 @@ public:
     interruptible_thread(Function func) {
         std::promise<interrupt_flag*> p;
         internal_thread = std::thread([func, &p] {p.set_value(&this_thread_interrupt_flag);
+        this_thread_interrupt_context.token = this_thread_interrupt_flag.get_token();
         func(); });
         flag = p.get_future().get();
     }
@@ -46,14 +50,17 @@ public:
     //即使lambda函数在新线程上执行,对本地变量p进行悬空引用也不会出现问题
     //因为在新线程返回前,类的构造函数会等待变量p不被引用再使用
     //该实现没有考虑汇入/分离线程,所以在flag变量在线程退出/分离前声明,来避免悬空
+    //线程启动时把中断标志的令牌设置为当前线程的中断上下文,interruption_point()通过它检查中断
     void interrupt() { if (flag) { flag->set(); } }
+    void join() { internal_thread.join(); }
+    bool joinable() const { return internal_thread.joinable(); }
 };
-void interruption_point() {
+/*void interruption_point() {
     if (this_thread_interrupt_flag.is_set()) {
         throw thread_interrupted();
     }
     //通过检查线程是否被中断,并抛出一个thread_interrupted异常
-}
+}*/
 //当线程阻塞时,显式的调用函数进行中断就会没有意义
 /*
 void interruptible_wait(std::condition_variable& cv, std::unique_lock<std::mutex>& lk) {
@@ -99,6 +106,9 @@ interrupt_flag2::clear_cv::~clear_cv() {
     this_thread_interrupt_flag2.clear_condition_variable();
 };
 
+//set()在通知前获取的是set_clear_mtx而不是等待者的lk,等待者检查完标志、进入wait之前的通知仍然会丢失
+//书中的做法是每1ms醒来检查一次中断,每个等待中的线程每秒都要被唤醒1000次,中断最多延迟1ms
+/*
 void interruptible_wait2(std::condition_variable& cv, std::unique_lock<std::mutex>& lk) {
     interruption_point();
     this_thread_interrupt_flag2.set_condition_variable(cv);
@@ -107,17 +117,26 @@ void interruptible_wait2(std::condition_variable& cv, std::unique_lock<std::mute
     cv.wait_for(lk, Ms(1));
     interruption_point();
 }
+*/
+//改为在等待前向中断标志注册一个停止回调(notify_on_stop),中断时回调先获取lk再通知cv
+//等待者要么还没检查标志(之后会看到中断),要么已经在wait中(会收到通知),空闲的等待者不再占用CPU
+void interruptible_wait2(std::condition_variable& cv, std::unique_lock<std::mutex>& lk) {
+    interruption_point();
+    {
+        stop_token const& token = this_thread_interrupt_context.token;
+        stop_callback<notify_on_stop> callback(token, notify_on_stop(cv, lk));
+        if (!token.stop_requested()) { cv.wait(lk); }
+        lk.unlock();
+    }
+    lk.lock();
+    interruption_point();
+}//与cv.wait相同,可能被虚假唤醒
 template<typename Predicate>
 void interruptible_wait2(std::condition_variable& cv,
                          std::unique_lock<std::mutex>& lk, Predicate pred) {
     interruption_point();
-    this_thread_interrupt_flag2.set_condition_variable(cv);
-    interrupt_flag2::clear_cv guard;
-    while (!this_thread_interrupt_flag2.is_set() && !pred()) {
-        cv.wait_for(lk, Ms(1));
-    }
+    stoppable_wait(cv, lk, this_thread_interrupt_context.token, pred);
     interruption_point();
-    //通过设置超时变量进行等待
 }
 
 
@@ -243,5 +262,46 @@ int main() {
 */
 
 int main() {
-    ;
+    std::mutex mtx;
+    std::condition_variable cond;
+    bool ready = false;
+    interruptible_thread waiter([&] {
+        try {
+            std::unique_lock<std::mutex> lk(mtx);
+            interruptible_wait2(cond, lk, [&] { return ready; });
+        }
+        catch (thread_interrupted const& e) { std::cout << e.what() << "\n"; }
+    });
+    std::this_thread::sleep_for(Ms(10));
+    waiter.interrupt();
+    waiter.join();
+    //等待者在条件变量上休眠,中断时被立即唤醒并抛出thread_interrupted
+
+    thread_pool4& pool = default_pool();
+    stop_source request;
+    std::future<int> sub_task = pool.submit([] {
+        for (int i = 0;i < 1000;i++) {
+            interruption_point();
+            std::this_thread::sleep_for(Ms(1));
+        }
+        return 0;
+    }, request.get_token(), SteadyClock::now() + Ms(50));
+    request.request_stop();
+    try { sub_task.get(); }
+    catch (task_cancelled const& e) { std::cout << e.what() << "\n"; }
+    catch (thread_interrupted const& e) { std::cout << e.what() << "\n"; }
+    //线程池的任务:还在排队时被取消就不再执行,已经开始执行的任务在下一个检查点抛出thread_interrupted
+
+    thread_safe_queue<int> requests;
+    stop_source shutdown;
+    std::thread consumer([&] {
+        int request;
+        while (requests.wait_pop(request, shutdown.get_token())) { std::cout << "request " << request << "\n"; }
+    });
+    requests.push(1);
+    requests.push(2);
+    std::this_thread::sleep_for(Ms(10));
+    shutdown.request_stop();
+    consumer.join();
+    //关闭服务时消费者被立即唤醒并退出,不需要向队列中放入特殊的结束标记
 }
\ No newline at end of file
@@ -92,12 +92,10 @@ struct log_info {
     std::string browser;
     //...
 };
-extern log_info parse_log_line(std::string const& line) {
-    //...
-    return log_info();
-}
+extern log_info parse_log_line(std::string const& line);
+//定义在下面,使用与内存映射版本相同的parse_log_record解析
 using visit_map_type = std::unordered_map<std::string, unsigned long long>;
-visit_map_type count_visit_page(std::vector<std::string> const& log_lines) {
+visit_map_type count_visit_page_std(std::vector<std::string> const& log_lines) {
     struct combine_visits {
         visit_map_type operator()(visit_map_type lhs, visit_map_type rhs) const {
             if (lhs.size() < rhs.size()) { std::swap(lhs, rhs); }
@@ -127,7 +125,316 @@ visit_map_type count_visit_page(std::vector<std::string> const& log_lines) {
 //复杂度来源于规约操作:需要组合两个log_info结构体来生成一个映射,一个log_info结构体和一个映射(无论是哪种方式),或两个映射
 //std::transform_reduce将使用硬件并行执行此计算(因为传了std::execution::par)
 //人工编写这个算法允许将实现并行性的艰苦工作委托给标准库实现者,这样开发者就可以专注于期望的结果了
+//但combine_visits的参数都是按值传递的映射,每次组合都要复制整个unordered_map,两个log_info组合时还要新建一个映射
+//这个规约的时间主要花在分配内存上,增加线程也不会更快
+
+//使用每个线程一个局部映射的并行归约(headfile.h中的parallel_transform_reduce)
+//每个线程只在自己的映射上计数,不需要复制,最后把所有线程的映射按树形合并,合并时总是把较小的映射并入较大的映射
+visit_map_type count_visit_page(std::vector<std::string> const& log_lines) {
+    return parallel_transform_reduce(log_lines.begin(), log_lines.end(), visit_map_type(), parse_log_line,
+                                     [](visit_map_type& map, log_info const& log) { ++map[log.page]; },
+                                     [](visit_map_type& lhs, visit_map_type&& rhs) {
+                                         if (lhs.size() < rhs.size()) { std::swap(lhs, rhs); }
+                                         for (auto const& entry : rhs) { lhs[entry.first] += entry.second; }
+                                     });
+}
+
+//基于内存映射文件的流式日志统计
+//上面的版本需要先把整个日志读入std::vector<std::string>,每一行解析后的log_info又持有两个std::string
+//对于数GB的日志,内存占用翻倍,并且大部分时间都花在分配内存上
+//这里把日志文件映射到内存中,按换行符对齐切分为多个块,每个线程领取块并逐行解析
+//解析得到的记录只保存指向映射区域的std::string_view,不复制任何字符
+//计数的键只在某个页面第一次出现时复制一次,之后的查找只与复制的键比较,键的内存只与不同页面的个数有关
+//处理完的块使用madvise释放对应的物理页,映射的文件可以比内存大,内存中只保留正在处理的块和复制的键
+
+//只读的内存映射文件
+class mapped_file {
+private:
+    char const* data_;
+    std::size_t size_;
+public:
+    explicit mapped_file(char const* path) :data_(nullptr), size_(0) {
+        int const fd = ::open(path, O_RDONLY);
+        if (fd < 0) { throw std::system_error(errno, std::generic_category(), path); }
+        struct stat st;
+        if (::fstat(fd, &st) < 0) {
+            int const err = errno;
+            ::close(fd);
+            throw std::system_error(err, std::generic_category(), path);
+        }
+        size_ = st.st_size;
+        if (size_) {
+            void* const mapped = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                int const err = errno;
+                ::close(fd);
+                throw std::system_error(err, std::generic_category(), path);
+            }
+            data_ = static_cast<char const*>(mapped);
+            ::madvise(mapped, size_, MADV_SEQUENTIAL);
+            //提示内核顺序读取,可以更积极地预读
+        }
+        ::close(fd);
+        //映射建立后就不再需要文件描述符
+    }
+    mapped_file(mapped_file const&) = delete;
+    mapped_file& operator=(mapped_file const&) = delete;
+    ~mapped_file() {
+        if (data_) { ::munmap(const_cast<char*>(data_), size_); }
+    }
+    std::string_view view() const { return std::string_view(data_, size_); }
+    void release(std::string_view part) const {
+        long const page = ::sysconf(_SC_PAGESIZE);
+        std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(part.data());
+        std::uintptr_t const end = (begin + part.size()) & ~std::uintptr_t(page - 1);
+        begin = (begin + page - 1) & ~std::uintptr_t(page - 1);
+        if (begin < end) { ::madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED); }
+    }//释放完全位于part内的页,只读的映射之后再访问时会从页缓存重新读入
+};
+
+//字段都指向原始数据的日志记录,只在映射的文件存在时有效
+struct log_record {
+    std::string_view page;
+    time_t visit_time;
+    std::string_view browser;
+};
+//解析十进制的时间戳,遇到第一个非数字字符时停止
+//Unix时间戳通常有10位数字,每次把8个字符读入一个64位整数,用3次乘法同时完成8位数字的转换(SWAR)
+time_t parse_epoch(std::string_view digits) {
+    std::uint64_t value = 0;
+    std::size_t pos = 0;
+    while (digits.size() - pos >= 8) {
+        std::uint64_t chunk;
+        std::memcpy(&chunk, digits.data() + pos, 8);
+        if (((chunk & 0xF0F0F0F0F0F0F0F0) | (((chunk + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4)) !=
+            0x3333333333333333) { break; }
+        //每个字节都在'0'到'9'之间时,高4位为3,并且加6之后也不会进位到高4位
+        chunk = (chunk & 0x0F0F0F0F0F0F0F0F) * 2561 >> 8;
+        chunk = (chunk & 0x00FF00FF00FF00FF) * 6553601 >> 16;
+        chunk = (chunk & 0x0000FFFF0000FFFF) * 42949672960001 >> 32;
+        //依次把相邻的1位,2位,4位数字合并,小端序下第一个字符在最低的字节,正好是最高位的数字
+        value = value * 100000000 + chunk;
+        pos += 8;
+    }
+    for (;pos < digits.size() && digits[pos] >= '0' && digits[pos] <= '9';pos++) {
+        value = value * 10 + (digits[pos] - '0');
+    }
+    return static_cast<time_t>(value);
+}
+//日志格式:page visit_time browser,字段之间以一个空格分隔,browser为行中剩余的部分
+log_record parse_log_record(std::string_view line) {
+    log_record record{ std::string_view(), 0, std::string_view() };
+    std::size_t const page_end = line.find(' ');
+    record.page = line.substr(0, page_end);
+    if (page_end == std::string_view::npos) { return record; }
+    std::size_t const time_end = line.find(' ', page_end + 1);
+    record.visit_time = parse_epoch(line.substr(page_end + 1, time_end - page_end - 1));
+    if (time_end != std::string_view::npos) { record.browser = line.substr(time_end + 1); }
+    return record;
+}
+log_info parse_log_line(std::string const& line) {
+    log_record const record = parse_log_record(line);
+    return log_info{ std::string(record.page), record.visit_time, std::string(record.browser) };
+}
+//把数据切分为大约chunk_size字节的块,每个块都在换行符之后结束,没有一行会跨越两个块
+std::vector<std::string_view> split_line_chunks(std::string_view data, std::size_t chunk_size) {
+    std::vector<std::string_view> chunks;
+    while (!data.empty()) {
+        std::size_t end = std::min(chunk_size, data.size());
+        if (end < data.size()) {
+            std::size_t const newline = data.find('\n', end - 1);
+            end = newline == std::string_view::npos ? data.size() : newline + 1;
+        }
+        chunks.push_back(data.substr(0, end));
+        data.remove_prefix(end);
+    }
+    return chunks;
+}
+template<typename Func>
+void for_each_line(std::string_view chunk, Func func) {
+    while (!chunk.empty()) {
+        std::size_t const newline = chunk.find('\n');
+        std::string_view const line = chunk.substr(0, newline);
+        if (!line.empty()) { func(line); }
+        if (newline == std::string_view::npos) { break; }
+        chunk.remove_prefix(newline + 1);
+    }
+}
+//向量化的分词:逐行调用func(log_record const&)
+//逐个字节查找换行符和空格是解析的热点,这里每次比较64个字节(headfile.h中的byte_masks),得到换行符和空格位置的位掩码
+//按位置顺序取出掩码中的位:每行只需要前两个空格,找到之后就只保留换行符的位,browser中的空格不会被逐个处理
+template<typename Func>
+void for_each_log_record(std::string_view chunk, Func func) {
+    byte_masks_func const masks_of = select_byte_masks();
+    if (!masks_of) {
+        for_each_line(chunk, [&func](std::string_view line) { func(parse_log_record(line)); });
+        return;
+    }
+    char const* const data = chunk.data();
+    std::size_t const size = chunk.size();
+    std::size_t line_start = 0;
+    std::size_t spaces[2] = { 0, 0 };
+    int space_count = 0;
+    auto emit = [&](std::size_t line_end) {
+        if (line_end == line_start) { return; }
+        log_record record{ std::string_view(), 0, std::string_view() };
+        if (space_count == 0) { record.page = std::string_view(data + line_start, line_end - line_start); }
+        else {
+            record.page = std::string_view(data + line_start, spaces[0] - line_start);
+            std::size_t const time_end = space_count == 2 ? spaces[1] : line_end;
+            record.visit_time = parse_epoch(std::string_view(data + spaces[0] + 1, time_end - spaces[0] - 1));
+            if (space_count == 2) { record.browser = std::string_view(data + spaces[1] + 1, line_end - spaces[1] - 1); }
+        }
+        func(record);
+    };
+    auto on_byte = [&](std::size_t pos, bool newline) {
+        if (newline) {
+            emit(pos);
+            line_start = pos + 1;
+            space_count = 0;
+        }
+        else if (space_count < 2) { spaces[space_count++] = pos; }
+    };
+    std::size_t base = 0;
+    for (;base + 64 <= size;base += 64) {
+        byte_masks const masks = masks_of(data + base, '\n', ' ');
+        std::uint64_t bits = masks.first | (space_count < 2 ? masks.second : 0);
+        while (bits) {
+            int const bit = __builtin_ctzll(bits);
+            bool const newline = (masks.first >> bit) & 1;
+            on_byte(base + bit, newline);
+            std::uint64_t const above = bit == 63 ? 0 : ~std::uint64_t(0) << (bit + 1);
+            bits = (masks.first | (space_count < 2 ? masks.second : 0)) & above;
+            //每处理一个位置后重新计算剩余的位:找到两个空格后去掉空格的位,换行后重新加入
+        }
+    }
+    for (;base < size;base++) {
+        if (data[base] == '\n' || data[base] == ' ') { on_byte(base, data[base] == '\n'); }
+    }
+    emit(size);
+    //最后一行可能没有换行符
+}
+
+//每个线程的计数,键指向keys中复制的字符串
+//如果键直接指向映射的文件,release释放的页在每次比较键时都会被重新读入,内存占用也就不再有上限
+//deque在尾部插入时不会移动已有的元素,整个对象移动或交换时元素也不会移动,键始终有效
+struct visit_view_counts {
+    std::deque<std::string> keys;
+    std::unordered_map<std::string_view, unsigned long long> map;
+    void add(std::string_view page, unsigned long long count) {
+        auto const found = map.find(page);
+        if (found != map.end()) {
+            found->second += count;
+            return;
+        }
+        keys.emplace_back(page);
+        map.emplace(keys.back(), count);
+    }
+};
+visit_map_type count_visit_page_mapped(char const* path, thread_pool4& pool = default_pool(),
+                                       std::size_t chunk_size = 16 << 20) {
+    mapped_file file(path);
+    //默认每个块16MB:块的数量远多于线程数,可以动态平衡负载,同时每个线程同一时刻只占用一个块的内存
+    std::vector<std::string_view> const chunks = split_line_chunks(file.view(), chunk_size);
+    visit_view_counts const counts = parallel_transform_reduce(
+        chunks.begin(), chunks.end(), visit_view_counts(), [](std::string_view chunk) { return chunk; },
+        [&file](visit_view_counts& acc, std::string_view chunk) {
+            for_each_log_record(chunk, [&acc](log_record const& record) { acc.add(record.page, 1); });
+            file.release(chunk);
+        },
+        [](visit_view_counts& lhs, visit_view_counts&& rhs) {
+            if (lhs.map.size() < rhs.map.size()) { std::swap(lhs, rhs); }
+            for (auto const& entry : rhs.map) { lhs.add(entry.first, entry.second); }
+        }, pool, grain_hint(1, 1, 1e7));
+    //每个块作为一个元素,提示每个元素的开销很大,使每个块都可以被单独领取
+    visit_map_type result;
+    result.reserve(counts.map.size());
+    for (auto const& entry : counts.map) { result.emplace(std::string(entry.first), entry.second); }
+    return result;
+}
+
+//把一个小的日志文件分别用两种方式统计,结果应该完全相同
+//块的大小只有4KB,文件会被切分为多个块,处理完的块会被释放
+bool mapped_count_test() {
+    char path[] = "/tmp/chapter9-1-XXXXXX";
+    int const fd = ::mkstemp(path);
+    if (fd < 0) { throw std::system_error(errno, std::generic_category(), "mkstemp"); }
+    char const* const pages[] = { "/index.html", "/about", "/news/2023", "/a", "/search?q=thread+pool" };
+    char const* const browsers[] = { "Mozilla/5.0 (X11; Linux x86_64)", "curl/8.0", "Safari", "" };
+    std::vector<std::string> lines;
+    std::string content;
+    for (int i = 0;i < 20000;i++) {
+        std::string line = pages[(i * 7) % 5];
+        line += " " + std::to_string(1700000000 + i);
+        if (i % 3) { line += std::string(" ") + browsers[i % 4]; }
+        content += line + "\n";
+        lines.push_back(line);
+    }
+    content.pop_back();
+    //最后一行没有换行符
+    bool const written = ::write(fd, content.data(), content.size()) == long(content.size());
+    ::close(fd);
+    bool const passed = written && count_visit_page_mapped(path, default_pool(), 4096) == count_visit_page(lines);
+    ::unlink(path);
+    return passed;
+}
+
+//向量化的分词和SWAR的时间戳解析与逐字节的parse_log_record比较
+//随机生成的行包括:缺少字段,时间戳中混有非数字或超过8位,browser中含有空格,空行,以及最后一行有或没有换行符
+//块的长度从几个字节到几百个字节,覆盖64字节的整块和末尾不足64字节的部分
+struct fuzz_random {
+    std::uint64_t state = 0x9E3779B97F4A7C15ull;
+    std::uint64_t next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+    int below(int n) { return next() % n; }
+};
+std::string random_log_line(fuzz_random& random) {
+    char const digits_and_more[] = "0123456789/:a";
+    std::string line;
+    for (int i = random.below(12);i >= 0;i--) { line += char('a' + random.below(26)); }
+    if (random.below(8) == 0) { return line; }
+    line += ' ';
+    for (int i = random.below(22);i > 0;i--) { line += random.below(16) ? char('0' + random.below(10)) : digits_and_more[random.below(13)]; }
+    if (random.below(8) == 0) { return line; }
+    line += ' ';
+    for (int i = random.below(40);i > 0;i--) { line += random.below(5) ? char('A' + random.below(26)) : ' '; }
+    return line;
+}
+bool same_record(log_record const& lhs, log_record const& rhs) {
+    return lhs.page == rhs.page && lhs.visit_time == rhs.visit_time && lhs.browser == rhs.browser;
+}
+bool tokenizer_test() {
+    fuzz_random random;
+    for (int round = 0;round < 2000;round++) {
+        std::string chunk;
+        for (int i = random.below(30);i >= 0;i--) {
+            chunk += random.below(20) ? random_log_line(random) : std::string();
+            chunk += '\n';
+        }
+        if (random.below(2)) { chunk += random_log_line(random); }
+        //一半的块最后一行没有换行符
+        std::vector<log_record> expected, actual;
+        for_each_line(chunk, [&expected](std::string_view line) { expected.push_back(parse_log_record(line)); });
+        for_each_log_record(chunk, [&actual](log_record const& record) { actual.push_back(record); });
+        if (!std::equal(expected.begin(), expected.end(), actual.begin(), actual.end(), same_record)) { return false; }
+    }
+    for (int round = 0;round < 100000;round++) {
+        std::string digits;
+        for (int i = random.below(21);i > 0;i--) { digits += char('0' + random.below(10)); }
+        if (random.below(2)) { digits += char("/:a "[random.below(4)]); }
+        std::uint64_t value = 0;
+        for (std::size_t i = 0;i < digits.size() && digits[i] >= '0' && digits[i] <= '9';i++) { value = value * 10 + (digits[i] - '0'); }
+        if (parse_epoch(digits) != static_cast<time_t>(value)) { return false; }
+    }
+    //超过19位时两者都按模2^64计算,结果仍然相同
+    return true;
+}
 
 int main() {
-    ;
+    std::cout << "count_visit_page_mapped: " << (mapped_count_test() ? "passed" : "failed") << "\n";
+    std::cout << "for_each_log_record/parse_epoch: " << (tokenizer_test() ? "passed" : "failed") << "\n";
 }
\ No newline at end of file
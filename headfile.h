@@ -1,3 +1,4 @@
+#pragma once
 #include <thread>
 #include <iostream>
 #include <unistd.h>
@@ -13,15 +14,31 @@
 #include <list>
 #include <stack>
 #include <queue>
+#include <deque>
 #include <map>
+#include <unordered_map>
+#include <set>
+#include <sstream>
 #include <mutex>        //mutex,lock_guard,lock,scoped_lock
 #include <shared_mutex> //only in c++14,c++17 
 #include <exception>    
 #include <memory>
+#include <atomic>
+#include <cstdint>
+#include <cstring>      //memcpy
 #include <algorithm>
 #include <math.h>
 #include <stdio.h>
 #include <execution>    //执行策略
+#include <string_view>
+#include <system_error>
+#include <fcntl.h>      //open
+#include <sys/mman.h>   //mmap
+#include <sys/stat.h>   //fstat
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>   //AVX2
+#define SIMD_AVX2_DISPATCH 1
+#endif
 
 
 using Ulong = unsigned long;
@@ -65,21 +82,1048 @@ public:
 };
 //无论线程如何离开这段代码,所有线程都可以被汇入
 
+//缓存行填充(chapter7-2)
+//不同线程频繁修改的变量放在同一个缓存行中时会产生伪共享,cache_padded<T>让T从新的缓存行开始并独占整个缓存行
+//C++17的std::hardware_destructive_interference_size在GCC中会给出-Winterference-size警告:
+//它的值随-mtune等编译选项变化,用在头文件的类型布局中会让不同编译单元得到不同的布局,所以这里固定为64字节
+//定义NO_CACHE_PADDING时对齐退化为T本身的对齐,用来对比填充前后的性能(chapter7-2)
+#if defined(NO_CACHE_PADDING)
+inline constexpr std::size_t cache_padding_alignment = 1;
+#else
+inline constexpr std::size_t cache_padding_alignment = 64;
+#endif
+template<typename T, bool Inherit = std::is_class<T>::value && !std::is_final<T>::value>
+struct alignas(cache_padding_alignment) alignas(T) cache_padded :T {
+    using T::T;
+    using T::operator=;
+    cache_padded() = default;
+    T& get() { return *this; }
+    T const& get() const { return *this; }
+};//类类型直接继承T,原来的成员函数和运算符都可以使用,锁和原子变量的声明替换后调用处不需要修改
+template<typename T>
+struct alignas(cache_padding_alignment) alignas(T) cache_padded<T, false> {
+    T value;
+    cache_padded() :value() {}
+    cache_padded(T const& value_) :value(value_) {}
+    cache_padded& operator=(T const& value_) {
+        value = value_;
+        return *this;
+    }
+    operator T& () { return value; }
+    operator T const& () const { return value; }
+    T& get() { return value; }
+    T const& get() const { return value; }
+};//指针和算术类型保存在成员中
+
+//分片计数器(chapter7-2)
+//所有线程对同一个原子变量fetch_add时,缓存行在核心之间来回转移,计数器本身成为串行点
+//sharded_counter把计数分散到多个独占缓存行的分片上,每个线程固定使用一个分片,分片的数量是2的幂
+//分片的值超过batch时,把它合并到全局的总数上:approximate()只读取总数,误差不超过 分片数 * batch
+//exact()在互斥量的保护下把总数和所有分片相加,包含调用之前完成的所有add,合并也需要这个互斥量,所以不会漏算或重复
+//没有可移植的方法取得当前线程所在的CPU,这里按线程首次使用的顺序轮流分配分片,而不是每个CPU一个分片
+class sharded_counter {
+private:
+    std::size_t const mask;
+    long const batch;
+    std::unique_ptr<cache_padded<std::atomic<long>>[]> shards;
+    cache_padded<std::atomic<long>> total;
+    mutable std::mutex fold_mtx;
+    static std::size_t round_up(std::size_t n) {
+        std::size_t res = 1;
+        while (res < n) { res <<= 1; }
+        return res;
+    }
+    static std::size_t thread_slot() {
+        static std::atomic<std::size_t> next_slot(0);
+        thread_local std::size_t const slot = next_slot.fetch_add(1, std::memory_order_relaxed);
+        return slot;
+    }
+    void fold(std::atomic<long>& shard) {
+        std::lock_guard<std::mutex> lk(fold_mtx);
+        total.fetch_add(shard.exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+    }//每个线程平均batch次add才会进入一次
+public:
+    explicit sharded_counter(std::size_t shard_count = std::thread::hardware_concurrency(), long batch_ = 1024) :
+        mask(round_up(std::max<std::size_t>(shard_count, 1)) - 1), batch(std::max(batch_, 1L)),
+        shards(new cache_padded<std::atomic<long>>[mask + 1]), total(0) {
+        for (std::size_t i = 0;i <= mask;i++) { shards[i].store(0, std::memory_order_relaxed); }
+    }
+    sharded_counter(sharded_counter const& other) = delete;
+    sharded_counter& operator=(sharded_counter const& other) = delete;
+    void add(long n = 1) {
+        std::atomic<long>& shard = shards[thread_slot() & mask];
+        long const value = shard.fetch_add(n, std::memory_order_relaxed) + n;
+        if (value >= batch || value <= -batch) { fold(shard); }
+    }
+    long approximate() const { return total.load(std::memory_order_relaxed); }
+    long exact() const {
+        std::lock_guard<std::mutex> lk(fold_mtx);
+        long res = total.load(std::memory_order_relaxed);
+        for (std::size_t i = 0;i <= mask;i++) { res += shards[i].load(std::memory_order_relaxed); }
+        return res;
+    }//O(分片数),适合统计输出,不适合放在热路径上
+};
+//分片只用relaxed操作,计数器只用于统计,不能用来同步其他数据
+
+//批量领取工作(chapter7-2)
+//processing_loop每处理一项都要fetch_add一次共享的计数器,claim一次领取[begin, end)中的batch项
+//共享变量的修改次数减少为原来的1/batch,batch越大竞争越少,但最后一批的负载越不均衡
+class range_claimer {
+private:
+    cache_padded<std::atomic<long>> next;
+    long const last;
+    long const batch;
+public:
+    range_claimer(long first, long last_, long batch_) :next(first), last(last_), batch(std::max(batch_, 1L)) {}
+    range_claimer(range_claimer const& other) = delete;
+    range_claimer& operator=(range_claimer const& other) = delete;
+    bool claim(long& begin, long& end) {
+        begin = next.fetch_add(batch, std::memory_order_relaxed);
+        if (begin >= last) { return false; }
+        end = std::min(begin + batch, last);
+        return true;
+    }//每个线程在claim返回false后就不再调用,next最多超出last 线程数 * batch
+};
+
+//协作式取消(与C++20的std::stop_source/stop_token/stop_callback相同的用法)
+//stop_source发出停止请求,stop_token只能查询,多个token共享同一个停止状态
+//stop_callback在停止时被调用,等待中的线程通过它直接唤醒自己阻塞的条件变量或队列,不需要定时醒来检查
+//查询只是一次原子读取;请求停止只发生一次,只有注册和注销回调时需要获取停止状态内部的互斥量
+class stop_callback_base {
+private:
+    friend class stop_state;
+    stop_callback_base* prev = nullptr;
+    stop_callback_base* next = nullptr;
+    bool linked = false;
+public:
+    virtual void invoke() = 0;
+protected:
+    ~stop_callback_base() = default;
+};
+class stop_state {
+private:
+    std::atomic<bool> stopped;
+    std::mutex mtx;
+    std::condition_variable callback_done;
+    stop_callback_base* head;
+    stop_callback_base* running;
+    std::thread::id stopper;
+public:
+    stop_state() :stopped(false), head(nullptr), running(nullptr) {}
+    bool stop_requested() const { return stopped.load(std::memory_order_acquire); }
+    bool request_stop() {
+        if (stopped.exchange(true, std::memory_order_acq_rel)) { return false; }
+        std::unique_lock<std::mutex> lk(mtx);
+        stopper = std::this_thread::get_id();
+        while (head) {
+            stop_callback_base* const callback = head;
+            head = callback->next;
+            if (head) { head->prev = nullptr; }
+            callback->linked = false;
+            running = callback;
+            lk.unlock();
+            callback->invoke();
+            lk.lock();
+            running = nullptr;
+            callback_done.notify_all();
+        }
+        return true;
+        //回调在不持有mtx的情况下调用,回调中可以再注册或注销其他回调
+    }
+    bool add(stop_callback_base* callback) {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (stopped.load(std::memory_order_relaxed)) { return false; }
+        callback->next = head;
+        if (head) { head->prev = callback; }
+        head = callback;
+        callback->linked = true;
+        return true;
+    }//已经停止时返回false,由调用者直接调用回调
+    void remove(stop_callback_base* callback) {
+        std::unique_lock<std::mutex> lk(mtx);
+        if (callback->linked) {
+            if (callback->prev) { callback->prev->next = callback->next; }
+            else { head = callback->next; }
+            if (callback->next) { callback->next->prev = callback->prev; }
+            callback->linked = false;
+            return;
+        }
+        if (running == callback && stopper != std::this_thread::get_id()) {
+            callback_done.wait(lk, [&] { return running != callback; });
+        }
+        //回调正在其他线程中执行时,必须等它结束才能销毁;在回调内部销毁自己时不能等待
+    }
+};
+class stop_token {
+private:
+    template<typename Callback>
+    friend class stop_callback;
+    friend class stop_source;
+    std::shared_ptr<stop_state> state;
+    explicit stop_token(std::shared_ptr<stop_state> state_) :state(std::move(state_)) {}
+public:
+    stop_token() = default;
+    bool stop_requested() const { return state && state->stop_requested(); }
+    bool stop_possible() const { return static_cast<bool>(state); }
+};//默认构造的token不关联任何停止状态,永远不会被停止
+class stop_source {
+private:
+    std::shared_ptr<stop_state> state;
+public:
+    stop_source() :state(std::make_shared<stop_state>()) {}
+    stop_token get_token() const { return stop_token(state); }
+    bool request_stop() { return state->request_stop(); }
+    bool stop_requested() const { return state->stop_requested(); }
+};
+template<typename Callback>
+class stop_callback :private stop_callback_base {
+private:
+    Callback callback;
+    std::shared_ptr<stop_state> state;
+    void invoke() override { callback(); }
+public:
+    template<typename Func>
+    explicit stop_callback(stop_token const& token, Func&& func) :
+        callback(std::forward<Func>(func)), state(token.state) {
+        if (state && !state->add(this)) {
+            state.reset();
+            callback();
+        }
+    }//构造时已经停止,就在当前线程中立即调用
+    ~stop_callback() { if (state) { state->remove(this); } }
+    stop_callback(stop_callback const&) = delete;
+    stop_callback& operator=(stop_callback const&) = delete;
+};
+
+//停止时唤醒在cv上等待的线程
+//必须先获取等待者的互斥量再通知,否则等待者检查完停止状态、还没进入wait时,这次通知就会丢失
+//因此其他线程不能在持有该互斥量时请求停止;等待者自己请求停止时不需要获取互斥量
+struct notify_on_stop {
+    std::condition_variable* cv;
+    std::mutex* mtx;
+    std::thread::id waiter;
+    notify_on_stop(std::condition_variable& cv_, std::unique_lock<std::mutex>& lk) :
+        cv(&cv_), mtx(lk.mutex()), waiter(std::this_thread::get_id()) {}
+    void operator()() const {
+        if (std::this_thread::get_id() != waiter) { std::lock_guard<std::mutex> lk(*mtx); }
+        cv->notify_all();
+    }
+};
+//在cv上等待,直到pred成立、token被停止或者到达deadline,返回pred的结果
+//每次阻塞前注册回调,醒来后先释放lk再注销:回调可能正阻塞在lk上,持有lk等待回调结束会死锁
+//token不关联停止状态时不需要回调,与普通的cv.wait_until相同;deadline为max()时不会超时
+template<typename Clock, typename Dur, typename Predicate>
+bool stoppable_wait_until(std::condition_variable& cv, std::unique_lock<std::mutex>& lk,
+                          stop_token const& token, TimePoint<Clock, Dur> const& deadline, Predicate pred) {
+    bool const forever = deadline == TimePoint<Clock, Dur>::max();
+    while (!pred()) {
+        if (token.stop_requested() || (!forever && Clock::now() >= deadline)) { return false; }
+        if (!token.stop_possible()) {
+            if (forever) { cv.wait(lk); }
+            else { cv.wait_until(lk, deadline); }
+            continue;
+        }
+        {
+            stop_callback<notify_on_stop> callback(token, notify_on_stop(cv, lk));
+            if (!token.stop_requested()) {
+                if (forever) { cv.wait(lk); }
+                else { cv.wait_until(lk, deadline); }
+            }
+            lk.unlock();
+        }
+        lk.lock();
+    }
+    return true;
+}
+template<typename Predicate>
+bool stoppable_wait(std::condition_variable& cv, std::unique_lock<std::mutex>& lk,
+                    stop_token const& token, Predicate pred) {
+    return stoppable_wait_until(cv, lk, token, SteadyClock::time_point::max(), pred);
+}
+
+//线程的中断(chapter8)
+//当前线程的中断上下文:interruptible_thread在启动时设置自己的令牌,线程池在执行任务期间设置为任务的令牌和截止时间
+//interruption_point()只检查这个上下文,因此同一段代码在专用线程和线程池的任务中都能被中断
+class thread_interrupted {
+private:
+    std::string except;
+public:
+    thread_interrupted(std::string_view str = "Thread interrupt") :except(str) {}
+    std::string what() const { return except; }
+};
+struct interrupt_context {
+    stop_token token;
+    SteadyClock::time_point deadline = SteadyClock::time_point::max();
+    bool has_deadline() const { return deadline != SteadyClock::time_point::max(); }
+    bool interrupted() const {
+        return token.stop_requested() || (has_deadline() && SteadyClock::now() >= deadline);
+    }
+};
+inline thread_local interrupt_context this_thread_interrupt_context;
+inline void interruption_point() {
+    if (this_thread_interrupt_context.interrupted()) { throw thread_interrupted(); }
+}
+
+//锁顺序检查(调试模式)
+//hierarchical_mutex(chapter2)需要为每个互斥量手动指定层级,并且只对使用它的代码有效
+//checked_mutex记录每个线程获取互斥量的顺序,构成全局的锁顺序图:线程持有A时阻塞地获取B,就添加一条A->B的边
+//新的边构成环时,说明存在以不同顺序获取这些互斥量的代码路径,即使这次运行没有发生死锁,也会报告一次潜在的死锁
+//同时按锁的位置(构造互斥量的位置,或者构造时指定的名字)统计获取次数、竞争次数、等待时间和持有时间
+//定义LOCK_ORDER_CHECK并且没有定义NDEBUG时启用,否则checked_mutex就是std::mutex,没有任何额外的开销
+#if defined(LOCK_ORDER_CHECK) && !defined(NDEBUG)
+struct lock_site_stats {
+    std::string name;
+    std::atomic<std::uint64_t> acquisitions{ 0 };
+    std::atomic<std::uint64_t> contentions{ 0 };
+    std::atomic<std::uint64_t> wait_ns{ 0 };
+    std::atomic<std::uint64_t> hold_ns{ 0 };
+    std::atomic<std::uint64_t> max_hold_ns{ 0 };
+    explicit lock_site_stats(std::string name_) :name(std::move(name_)) {}
+};
+class lock_order_registry {
+private:
+    std::mutex mtx;
+    std::map<std::string, std::unique_ptr<lock_site_stats>> sites;
+    std::unordered_map<std::uint64_t, lock_site_stats*> nodes;
+    std::unordered_map<std::uint64_t, std::vector<std::uint64_t>> edges;
+    std::vector<std::string> cycles;
+    std::atomic<std::uint64_t> next_id;
+    lock_order_registry() :next_id(1) {}
+    bool find_path(std::uint64_t from, std::uint64_t to, std::vector<std::uint64_t>& path,
+                   std::set<std::uint64_t>& visited) {
+        path.push_back(from);
+        if (from == to) { return true; }
+        if (visited.insert(from).second) {
+            auto it = edges.find(from);
+            if (it != edges.end()) {
+                std::vector<std::uint64_t>& next = it->second;
+                next.erase(std::remove_if(next.begin(), next.end(),
+                                          [this](std::uint64_t id) { return !nodes.count(id); }), next.end());
+                //已销毁的互斥量在这里顺便从后继中移除
+                for (std::uint64_t id : next) {
+                    if (find_path(id, to, path, visited)) { return true; }
+                }
+            }
+        }
+        path.pop_back();
+        return false;
+    }
+    std::string node_name(std::uint64_t id) {
+        std::ostringstream os;
+        os << nodes[id]->name << "#" << id;
+        return os.str();
+    }
+public:
+    static lock_order_registry& instance() {
+        static lock_order_registry* registry = new lock_order_registry;
+        return *registry;
+    }//不析构,静态对象中的互斥量在程序退出时仍可以使用
+    std::uint64_t add_node(std::string const& site, lock_site_stats*& stats) {
+        std::uint64_t const id = next_id++;
+        std::lock_guard<std::mutex> lk(mtx);
+        std::unique_ptr<lock_site_stats>& entry = sites[site];
+        if (!entry) { entry.reset(new lock_site_stats(site)); }
+        stats = entry.get();
+        nodes[id] = stats;
+        return id;
+    }//同一位置构造的互斥量(例如同一个类的成员)共享统计数据,但在锁顺序图中是不同的节点
+    void remove_node(std::uint64_t id) {
+        std::lock_guard<std::mutex> lk(mtx);
+        nodes.erase(id);
+        edges.erase(id);
+    }
+    void add_edge(std::uint64_t from, std::uint64_t to) {
+        std::lock_guard<std::mutex> lk(mtx);
+        std::vector<std::uint64_t>& next = edges[from];
+        if (std::find(next.begin(), next.end(), to) != next.end()) { return; }
+        std::vector<std::uint64_t> path;
+        std::set<std::uint64_t> visited;
+        bool const cycle = find_path(to, from, path, visited);
+        edges[from].push_back(to);
+        if (cycle) {
+            std::ostringstream os;
+            os << "potential deadlock: " << node_name(from);
+            for (std::uint64_t id : path) { os << " -> " << node_name(id); }
+            cycles.push_back(os.str());
+            std::cerr << cycles.back() << "\n";
+        }
+        //新的边from->to与已有的路径to->...->from构成环,报告整个环
+    }
+    std::vector<std::string> potential_deadlocks() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return cycles;
+    }
+    void report(std::ostream& os) {
+        std::vector<lock_site_stats*> sorted;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            for (auto& site : sites) { sorted.push_back(site.second.get()); }
+        }
+        std::sort(sorted.begin(), sorted.end(), [](lock_site_stats* a, lock_site_stats* b) {
+            return a->wait_ns.load() > b->wait_ns.load(); });
+        os << "site\tacquisitions\tcontentions\twait_us\thold_us\tmax_hold_us\n";
+        for (lock_site_stats* site : sorted) {
+            os << site->name << "\t" << site->acquisitions << "\t" << site->contentions << "\t"
+                << site->wait_ns / 1000 << "\t" << site->hold_ns / 1000 << "\t" << site->max_hold_ns / 1000 << "\n";
+        }
+        for (std::string const& cycle : potential_deadlocks()) { os << cycle << "\n"; }
+    }//按等待时间从大到小输出每个位置的统计,最后输出检测到的潜在死锁
+};
+class checked_mutex {
+private:
+    std::mutex internal_mutex;
+    lock_site_stats* stats;
+    std::uint64_t const id;
+    SteadyClock::time_point acquired;
+    //acquired只由持有互斥量的线程读写
+    struct held_locks {
+        std::vector<checked_mutex*> locks;
+        std::set<std::pair<std::uint64_t, std::uint64_t>> known_edges;
+    };
+    static held_locks& this_thread_held_locks() {
+        thread_local held_locks held;
+        return held;
+    }//线程已经报告过的边不再获取全局的互斥量,重复的加锁模式只在第一次时有开销
+    static std::string site_name(char const* name, char const* file, int line) {
+        if (name) { return name; }
+        std::ostringstream os;
+        os << file << ":" << line;
+        return os.str();
+    }
+    void check_order(held_locks& held) {
+        for (checked_mutex* other : held.locks) {
+            if (other == this) { throw std::logic_error("checked_mutex locked recursively"); }
+            if (held.known_edges.insert(std::make_pair(other->id, id)).second) {
+                lock_order_registry::instance().add_edge(other->id, id);
+            }
+        }
+    }
+    void on_acquired(held_locks& held) {
+        acquired = SteadyClock::now();
+        ++stats->acquisitions;
+        held.locks.push_back(this);
+    }
+public:
+    explicit checked_mutex(char const* name = nullptr,
+                           char const* file = __builtin_FILE(), int line = __builtin_LINE()) :
+        stats(nullptr), id(lock_order_registry::instance().add_node(site_name(name, file, line), stats)) {}
+    //没有指定名字时,使用构造互斥量的位置作为锁的位置(默认参数在调用处求值)
+    checked_mutex(checked_mutex const&) = delete;
+    checked_mutex& operator=(checked_mutex const&) = delete;
+    ~checked_mutex() { lock_order_registry::instance().remove_node(id); }
+    void lock() {
+        held_locks& held = this_thread_held_locks();
+        check_order(held);
+        if (!internal_mutex.try_lock()) {
+            SteadyClock::time_point const start = SteadyClock::now();
+            internal_mutex.lock();
+            ++stats->contentions;
+            stats->wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(SteadyClock::now() - start).count();
+        }
+        on_acquired(held);
+    }
+    bool try_lock() {
+        held_locks& held = this_thread_held_locks();
+        if (!internal_mutex.try_lock()) { return false; }
+        on_acquired(held);
+        return true;
+    }//try_lock不会阻塞,也就不会造成死锁,因此不添加边(std::lock依赖这一点)
+    void unlock() {
+        std::uint64_t const hold =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(SteadyClock::now() - acquired).count();
+        std::vector<checked_mutex*>& locks = this_thread_held_locks().locks;
+        auto const it = std::find(locks.rbegin(), locks.rend(), this);
+        if (it == locks.rend()) { throw std::logic_error("checked_mutex unlocked by a thread that does not own it"); }
+        locks.erase(std::next(it).base());
+        stats->hold_ns += hold;
+        std::uint64_t max_hold = stats->max_hold_ns.load(std::memory_order_relaxed);
+        while (hold > max_hold && !stats->max_hold_ns.compare_exchange_weak(max_hold, hold, std::memory_order_relaxed));
+        internal_mutex.unlock();
+    }
+};
+inline std::vector<std::string> lock_order_violations() {
+    return lock_order_registry::instance().potential_deadlocks();
+}
+inline void lock_order_report(std::ostream& os) { lock_order_registry::instance().report(os); }
+#else
+class checked_mutex :public std::mutex {
+public:
+    explicit checked_mutex(char const* = nullptr) {}
+};
+inline std::vector<std::string> lock_order_violations() { return std::vector<std::string>(); }
+inline void lock_order_report(std::ostream& os) { os << "lock order checking disabled\n"; }
+#endif
+
+//锁竞争分析
+//profiled_mutex<Mutex>包装任意互斥量(包括std::shared_mutex和checked_mutex),按位置记录加锁次数、发生竞争的次数、等待时间和持有时间
+//try_lock失败不算作加锁,单独记为failed(例如std::lock在互斥量之间退让时的尝试),不会抬高contended%
+//位置默认是互斥量的名字(或构造的位置);使用profiled_lock加锁时,位置是加锁的代码所在的行
+//每个线程把数据写入自己的缓冲区,只有这个线程写入,因此不需要原子的读-改-写,也不需要任何锁
+//lock_profile_report合并所有线程(包括已经退出的线程)的缓冲区,按总等待时间从大到小输出,用来判断哪个结构最值得改为无锁的实现
+//定义LOCK_PROFILE时启用,否则profiled_mutex<Mutex>就是Mutex
+template<typename Mutex, bool Named = std::is_constructible<Mutex, char const*>::value>
+struct named_mutex :Mutex {
+    explicit named_mutex(char const* name) :Mutex(name) {}
+};
+template<typename Mutex>
+struct named_mutex<Mutex, false> :Mutex {
+    explicit named_mutex(char const*) {}
+};//把名字传给能接受名字的互斥量(checked_mutex)
+#if defined(LOCK_PROFILE)
+struct lock_profile_counters {
+    static int const buckets = 40;
+    std::atomic<std::uint64_t> attempts{ 0 };
+    std::atomic<std::uint64_t> contended{ 0 };
+    std::atomic<std::uint64_t> failed{ 0 };
+    std::atomic<std::uint64_t> wait_ns{ 0 };
+    std::atomic<std::uint64_t> hold_ns{ 0 };
+    std::atomic<std::uint64_t> wait_hist[buckets] = {};
+    std::atomic<std::uint64_t> hold_hist[buckets] = {};
+    //直方图的第i个桶记录[2^(i-1), 2^i)纳秒的次数,第0个桶记录0纳秒
+    static void add(std::atomic<std::uint64_t>& counter, std::uint64_t value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }//只有所属的线程写入,读取的线程最多看到稍旧的值
+    static int bucket_of(std::uint64_t ns) {
+        int bucket = 0;
+        while (ns && bucket < buckets - 1) {
+            ns >>= 1;
+            bucket++;
+        }
+        return bucket;
+    }
+    void record_wait(std::uint64_t ns) {
+        add(wait_ns, ns);
+        add(wait_hist[bucket_of(ns)], 1);
+    }
+    void record_hold(std::uint64_t ns) {
+        add(hold_ns, ns);
+        add(hold_hist[bucket_of(ns)], 1);
+    }
+};
+struct lock_profile_buffer {
+    static int const max_sites = 256;
+    std::atomic<lock_profile_counters*> slots[max_sites] = {};
+    std::vector<std::unique_ptr<lock_profile_counters>> owned;
+    //owned只由所属的线程修改,slots通过release发布给生成报告的线程
+    lock_profile_counters& at(int site) {
+        lock_profile_counters* counters = slots[site].load(std::memory_order_relaxed);
+        if (!counters) {
+            owned.push_back(std::unique_ptr<lock_profile_counters>(new lock_profile_counters));
+            counters = owned.back().get();
+            slots[site].store(counters, std::memory_order_release);
+        }
+        return *counters;
+    }
+};
+class lock_profile_registry {
+private:
+    std::mutex mtx;
+    std::vector<std::string> sites;
+    std::map<std::string, int> site_index;
+    std::vector<std::unique_ptr<lock_profile_buffer>> buffers;
+    //线程退出后缓冲区仍然保留,报告中包含已经退出的线程的数据
+    lock_profile_registry() { sites.push_back("(other sites)"); }
+    static std::uint64_t percentile(std::uint64_t const* hist, std::uint64_t total, double q) {
+        std::uint64_t seen = 0;
+        for (int i = 0;i < lock_profile_counters::buckets;i++) {
+            seen += hist[i];
+            if (total && seen >= q * total) { return i ? std::uint64_t(1) << i : 0; }
+        }
+        return 0;
+    }//直方图只能给出分位数所在桶的上界
+public:
+    static lock_profile_registry& instance() {
+        static lock_profile_registry* registry = new lock_profile_registry;
+        return *registry;
+    }
+    int site(std::string const& name) {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto const it = site_index.find(name);
+        if (it != site_index.end()) { return it->second; }
+        if (sites.size() == lock_profile_buffer::max_sites) { return 0; }
+        sites.push_back(name);
+        return site_index[name] = sites.size() - 1;
+    }//位置过多时,之后的位置都合并到第0个位置中
+    lock_profile_buffer& this_thread_buffer() {
+        thread_local lock_profile_buffer* buffer = nullptr;
+        if (!buffer) {
+            std::lock_guard<std::mutex> lk(mtx);
+            buffers.push_back(std::unique_ptr<lock_profile_buffer>(new lock_profile_buffer));
+            buffer = buffers.back().get();
+        }
+        return *buffer;
+    }
+    void report(std::ostream& os) {
+        struct row {
+            std::string name;
+            std::uint64_t attempts, contended, failed, wait_ns, hold_ns;
+            std::uint64_t wait_hist[lock_profile_counters::buckets], hold_hist[lock_profile_counters::buckets];
+        };
+        std::vector<row> rows;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            for (std::size_t site = 0;site < sites.size();site++) {
+                row r{ sites[site], 0, 0, 0, 0, 0, {}, {} };
+                for (auto const& buffer : buffers) {
+                    lock_profile_counters const* c = buffer->slots[site].load(std::memory_order_acquire);
+                    if (!c) { continue; }
+                    r.attempts += c->attempts.load(std::memory_order_relaxed);
+                    r.contended += c->contended.load(std::memory_order_relaxed);
+                    r.failed += c->failed.load(std::memory_order_relaxed);
+                    r.wait_ns += c->wait_ns.load(std::memory_order_relaxed);
+                    r.hold_ns += c->hold_ns.load(std::memory_order_relaxed);
+                    for (int i = 0;i < lock_profile_counters::buckets;i++) {
+                        r.wait_hist[i] += c->wait_hist[i].load(std::memory_order_relaxed);
+                        r.hold_hist[i] += c->hold_hist[i].load(std::memory_order_relaxed);
+                    }
+                }
+                if (r.attempts || r.failed) { rows.push_back(r); }
+            }
+        }
+        std::sort(rows.begin(), rows.end(), [](row const& a, row const& b) { return a.wait_ns > b.wait_ns; });
+        os << "site\tattempts\tcontended\tcontended%\tfailed_try\twait_us\twait_p50_ns\twait_p99_ns\thold_us\thold_p50_ns\thold_p99_ns\n";
+        for (row const& r : rows) {
+            std::uint64_t waits = 0, holds = 0;
+            for (int i = 0;i < lock_profile_counters::buckets;i++) {
+                waits += r.wait_hist[i];
+                holds += r.hold_hist[i];
+            }
+            os << r.name << "\t" << r.attempts << "\t" << r.contended << "\t"
+                << (r.attempts ? 100.0 * r.contended / r.attempts : 0.0) << "\t" << r.failed << "\t" << r.wait_ns / 1000 << "\t"
+                << percentile(r.wait_hist, waits, 0.5) << "\t" << percentile(r.wait_hist, waits, 0.99) << "\t"
+                << r.hold_ns / 1000 << "\t"
+                << percentile(r.hold_hist, holds, 0.5) << "\t" << percentile(r.hold_hist, holds, 0.99) << "\n";
+        }
+    }
+};
+inline lock_profile_counters& lock_profile_at(int site) {
+    return lock_profile_registry::instance().this_thread_buffer().at(site);
+}
+inline std::uint64_t ns_since(SteadyClock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(SteadyClock::now() - start).count();
+}
+template<typename Mutex>
+class profiled_mutex {
+private:
+    named_mutex<Mutex> inner;
+    int const site;
+    SteadyClock::time_point acquired;
+    int holder_site;
+    //独占锁的持有者信息只由持有者读写;共享锁可能同时有多个持有者,记录在各自线程的列表中
+    struct shared_hold {
+        profiled_mutex const* mtx;
+        SteadyClock::time_point acquired;
+        int site;
+    };
+    static std::vector<shared_hold>& this_thread_shared_holds() {
+        thread_local std::vector<shared_hold> holds;
+        return holds;
+    }
+    static std::string site_name(char const* name, char const* file, int line) {
+        if (name) { return name; }
+        std::ostringstream os;
+        os << file << ":" << line;
+        return os.str();
+    }
+public:
+    explicit profiled_mutex(char const* name = nullptr,
+                            char const* file = __builtin_FILE(), int line = __builtin_LINE()) :
+        inner(name), site(lock_profile_registry::instance().site(site_name(name, file, line))), holder_site(0) {}
+    profiled_mutex(profiled_mutex const&) = delete;
+    profiled_mutex& operator=(profiled_mutex const&) = delete;
+    void lock() { lock_at(site); }
+    void lock_at(int call_site) {
+        lock_profile_counters& counters = lock_profile_at(call_site);
+        lock_profile_counters::add(counters.attempts, 1);
+        if (inner.try_lock()) { counters.record_wait(0); }
+        else {
+            SteadyClock::time_point const start = SteadyClock::now();
+            inner.lock();
+            lock_profile_counters::add(counters.contended, 1);
+            counters.record_wait(ns_since(start));
+        }
+        acquired = SteadyClock::now();
+        holder_site = call_site;
+    }//先try_lock,失败时才计时,没有竞争的加锁只多一次读取时钟
+    bool try_lock() {
+        lock_profile_counters& counters = lock_profile_at(site);
+        if (!inner.try_lock()) {
+            lock_profile_counters::add(counters.failed, 1);
+            return false;
+        }
+        lock_profile_counters::add(counters.attempts, 1);
+        counters.record_wait(0);
+        acquired = SteadyClock::now();
+        holder_site = site;
+        return true;
+    }
+    void unlock() {
+        lock_profile_at(holder_site).record_hold(ns_since(acquired));
+        inner.unlock();
+    }
+    void lock_shared() { lock_shared_at(site); }
+    void lock_shared_at(int call_site) {
+        lock_profile_counters& counters = lock_profile_at(call_site);
+        lock_profile_counters::add(counters.attempts, 1);
+        if (inner.try_lock_shared()) { counters.record_wait(0); }
+        else {
+            SteadyClock::time_point const start = SteadyClock::now();
+            inner.lock_shared();
+            lock_profile_counters::add(counters.contended, 1);
+            counters.record_wait(ns_since(start));
+        }
+        this_thread_shared_holds().push_back(shared_hold{ this, SteadyClock::now(), call_site });
+    }
+    bool try_lock_shared() {
+        lock_profile_counters& counters = lock_profile_at(site);
+        if (!inner.try_lock_shared()) {
+            lock_profile_counters::add(counters.failed, 1);
+            return false;
+        }
+        lock_profile_counters::add(counters.attempts, 1);
+        counters.record_wait(0);
+        this_thread_shared_holds().push_back(shared_hold{ this, SteadyClock::now(), site });
+        return true;
+    }
+    void unlock_shared() {
+        std::vector<shared_hold>& holds = this_thread_shared_holds();
+        for (std::size_t i = holds.size();i-- > 0;) {
+            if (holds[i].mtx == this) {
+                lock_profile_at(holds[i].site).record_hold(ns_since(holds[i].acquired));
+                holds.erase(holds.begin() + i);
+                break;
+            }
+        }
+        inner.unlock_shared();
+    }
+    //共享锁的函数只在Mutex支持时才能使用(模板的成员函数只在调用时实例化)
+    int default_site() const { return site; }
+};
+//在加锁的代码处记录:同一个互斥量在不同位置的等待和持有时间分别统计
+template<typename Mutex>
+class profiled_lock {
+private:
+    profiled_mutex<Mutex>& mtx;
+    static int call_site(char const* file, int line) {
+        thread_local std::map<std::pair<char const*, int>, int> cache;
+        int& site = cache[std::make_pair(file, line)];
+        if (!site) {
+            std::ostringstream os;
+            os << file << ":" << line;
+            site = lock_profile_registry::instance().site(os.str());
+        }
+        return site;
+    }//每个线程缓存位置的编号,同一行代码只在第一次加锁时查询全局的位置表
+public:
+    explicit profiled_lock(profiled_mutex<Mutex>& mtx_,
+                           char const* file = __builtin_FILE(), int line = __builtin_LINE()) :mtx(mtx_) {
+        mtx.lock_at(call_site(file, line));
+    }
+    ~profiled_lock() { mtx.unlock(); }
+    profiled_lock(profiled_lock const&) = delete;
+    profiled_lock& operator=(profiled_lock const&) = delete;
+};
+inline void lock_profile_report(std::ostream& os) { lock_profile_registry::instance().report(os); }
+#else
+template<typename Mutex>
+class profiled_mutex :public named_mutex<Mutex> {
+public:
+    explicit profiled_mutex(char const* name = nullptr) :named_mutex<Mutex>(name) {}
+};
+template<typename Mutex>
+class profiled_lock {
+private:
+    profiled_mutex<Mutex>& mtx;
+public:
+    explicit profiled_lock(profiled_mutex<Mutex>& mtx_) :mtx(mtx_) { mtx.lock(); }
+    ~profiled_lock() { mtx.unlock(); }
+    profiled_lock(profiled_lock const&) = delete;
+    profiled_lock& operator=(profiled_lock const&) = delete;
+};
+inline void lock_profile_report(std::ostream& os) { os << "lock profiling disabled\n"; }
+#endif
+
+//确定性调度测试(chapter10)
+//被测试的线程由调度器逐个运行:任意时刻只有一个线程在执行,线程在调度点把控制权交还给调度器,由调度器选择下一个运行的线程
+//选择只取决于种子(随机调度)或者给定的选择序列(穷举和重放),同样的种子一定得到同样的交错执行,失败的执行可以被原样重放
+//容器在加锁前和原子操作前调用schedule_point(),只有定义SCHEDULE_TEST时才会让出,否则是空函数
+//调度点不能放在临界区内:持有互斥量的线程让出后,被调度的线程会在该互斥量上真正阻塞,整个调度就停止了
+//同样的原因,被测试的代码不能在条件变量上等待(使用try_pop而不是wait_pop)
+class test_scheduler {
+public:
+    enum class mode { random, exhaustive };
+private:
+    std::mutex mtx;
+    std::condition_variable cond;
+    int running;
+    std::vector<char> finished;
+    std::uint64_t rng;
+    mode strategy;
+    std::vector<int> forced;
+    std::vector<std::pair<int, int>> decisions;
+    //每次有多个线程可以运行时记录一次选择:(选择的序号, 可选的线程数)
+    inline static thread_local int self = -1;
+    int choose(int options) {
+        std::size_t const step = decisions.size();
+        int index;
+        if (step < forced.size()) { index = forced[step] % options; }
+        else if (strategy == mode::exhaustive) { index = 0; }
+        else {
+            rng ^= rng << 13;
+            rng ^= rng >> 7;
+            rng ^= rng << 17;
+            index = static_cast<int>(rng % options);
+        }
+        decisions.push_back(std::make_pair(index, options));
+        return index;
+    }
+    int pick_next() {
+        std::vector<int> runnable;
+        for (int i = 0;i < int(finished.size());i++) {
+            if (!finished[i]) { runnable.push_back(i); }
+        }
+        if (runnable.empty()) { return -1; }
+        if (runnable.size() == 1) { return runnable[0]; }
+        return runnable[choose(runnable.size())];
+    }//调用者持有mtx
+public:
+    test_scheduler(mode strategy_ = mode::random, std::uint64_t seed = 1, std::vector<int> forced_ = std::vector<int>()) :
+        running(-1), rng(seed * 0x9E3779B97F4A7C15ull | 1), strategy(strategy_), forced(std::move(forced_)) {}
+    void yield() {
+        std::unique_lock<std::mutex> lk(mtx);
+        int const next = pick_next();
+        if (next == self) { return; }
+        running = next;
+        cond.notify_all();
+        cond.wait(lk, [this] { return running == self; });
+    }
+    void run(std::vector<std::function<void()>> const& bodies) {
+        finished.assign(bodies.size(), 0);
+        decisions.clear();
+        std::vector<std::thread> threads;
+        join_threads joiner(threads);
+        for (int i = 0;i < int(bodies.size());i++) {
+            threads.push_back(std::thread([this, i, &bodies] {
+                self = i;
+                this_thread_scheduler() = this;
+                {
+                    std::unique_lock<std::mutex> lk(mtx);
+                    cond.wait(lk, [this, i] { return running == i; });
+                }
+                bodies[i]();
+                this_thread_scheduler() = nullptr;
+                std::lock_guard<std::mutex> lk(mtx);
+                finished[i] = 1;
+                running = pick_next();
+                cond.notify_all();
+            }));
+        }
+        std::unique_lock<std::mutex> lk(mtx);
+        running = pick_next();
+        cond.notify_all();
+        cond.wait(lk, [this] { return running == -1; });
+    }//bodies不能抛出异常,测试框架在外层捕获
+    std::vector<int> trace() const {
+        std::vector<int> res;
+        for (auto const& decision : decisions) { res.push_back(decision.first); }
+        return res;
+    }//把这个序列作为forced传入,就能重放这次执行
+    bool next_exhaustive(std::vector<int>& next) const {
+        for (int i = decisions.size();i-- > 0;) {
+            if (decisions[i].first + 1 < decisions[i].second) {
+                next.clear();
+                for (int j = 0;j < i;j++) { next.push_back(decisions[j].first); }
+                next.push_back(decisions[i].first + 1);
+                return true;
+            }
+        }
+        return false;
+    }//深度优先地枚举选择序列:找到最后一个还有其他选择的位置,之后的选择都从头开始
+    static test_scheduler*& this_thread_scheduler() {
+        thread_local test_scheduler* scheduler = nullptr;
+        return scheduler;
+    }
+};
+inline void schedule_point() {
+#if defined(SCHEDULE_TEST)
+    if (test_scheduler* const scheduler = test_scheduler::this_thread_scheduler()) { scheduler->yield(); }
+#endif
+}
+
+//操作历史与线性一致性检查
+//每个操作记录调用和返回的逻辑时间,以及在顺序模型上重放并比较结果的函数
+//检查时搜索一个全序:不违反实时顺序(一个操作返回后才调用的操作必须排在它之后),并且在顺序模型上每个操作的结果都相同
+template<typename Model>
+class operation_history {
+private:
+    struct operation {
+        int thread;
+        std::string description;
+        std::uint64_t invoked;
+        std::uint64_t responded;
+        std::function<bool(Model&)> replay;
+    };
+    std::mutex mtx;
+    std::uint64_t clock = 0;
+    std::vector<operation> operations;
+    bool search(Model const& model, std::vector<char>& done, std::size_t remaining, std::vector<int>& order) const {
+        if (!remaining) { return true; }
+        std::uint64_t first_response = UINT64_MAX;
+        for (std::size_t i = 0;i < operations.size();i++) {
+            if (!done[i]) { first_response = std::min(first_response, operations[i].responded); }
+        }
+        for (std::size_t i = 0;i < operations.size();i++) {
+            if (done[i] || operations[i].invoked > first_response) { continue; }
+            //调用晚于某个未排序操作的返回,不能排在那个操作之前
+            Model next(model);
+            if (!operations[i].replay(next)) { continue; }
+            done[i] = 1;
+            order.push_back(i);
+            if (search(next, done, remaining - 1, order)) { return true; }
+            order.pop_back();
+            done[i] = 0;
+        }
+        return false;
+    }
+    std::uint64_t tick() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return clock++;
+    }
+public:
+    //real在被测试的容器上执行操作,spec在顺序模型上执行同一个操作,两者的结果需要能比较和输出
+    template<typename Real, typename Spec>
+    void call(int thread, std::string description, Real real, Spec spec) {
+        schedule_point();
+        std::uint64_t const invoked = tick();
+        auto const result = real();
+        std::uint64_t const responded = tick();
+        std::ostringstream os;
+        os << "thread " << thread << ": " << description << " -> " << result;
+        std::lock_guard<std::mutex> lk(mtx);
+        operations.push_back(operation{ thread, os.str(), invoked, responded,
+            [spec, result](Model& model) { return spec(model) == result; } });
+    }
+    bool linearizable(Model const& initial, std::string* report = nullptr) const {
+        std::vector<char> done(operations.size(), 0);
+        std::vector<int> order;
+        if (search(initial, done, operations.size(), order)) { return true; }
+        if (report) {
+            std::ostringstream os;
+            os << "history is not linearizable:\n";
+            for (operation const& op : operations) {
+                os << "  [" << op.invoked << ", " << op.responded << "] " << op.description << "\n";
+            }
+            *report = os.str();
+        }
+        return false;
+    }
+};
+
+//构建多线程测试代码(chapter10):环境布置、每个线程的并发代码、结束后的断言,以及用来判断线性一致性的顺序模型
+//每次执行都重新构造State;post返回false、线程抛出异常或历史不满足线性一致性时,报告这次执行的种子和选择序列
+template<typename State, typename Model>
+struct schedule_test {
+    std::function<void(State&)> setup;
+    std::vector<std::function<void(State&, operation_history<Model>&, int)>> threads;
+    std::function<bool(State&)> post;
+    Model model;
+};
+struct schedule_options {
+    test_scheduler::mode strategy = test_scheduler::mode::random;
+    std::uint64_t seed = 1;
+    int executions = 1000;
+    std::vector<int> replay;
+    //replay不为空时只重放这一个选择序列
+};
+struct schedule_result {
+    bool passed = true;
+    int executions = 0;
+    std::uint64_t seed = 0;
+    std::vector<int> trace;
+    std::string failure;
+};
+inline std::ostream& operator<<(std::ostream& os, schedule_result const& result) {
+    os << (result.passed ? "passed" : "FAILED") << " after " << result.executions << " executions";
+    if (!result.passed) {
+        os << "\nseed " << result.seed << ", replay {";
+        for (std::size_t i = 0;i < result.trace.size();i++) { os << (i ? "," : "") << result.trace[i]; }
+        os << "}\n" << result.failure;
+    }
+    return os;
+}
+template<typename State, typename Model>
+schedule_result run_schedule_test(schedule_test<State, Model> const& test, schedule_options const& options = schedule_options()) {
+    schedule_result result;
+    std::vector<int> forced = options.replay;
+    int const executions = options.replay.empty() ? options.executions : 1;
+    for (int execution = 0;execution < executions;execution++) {
+        std::uint64_t const seed = options.seed + execution;
+        std::unique_ptr<State> state(new State);
+        operation_history<Model> history;
+        if (test.setup) { test.setup(*state); }
+        std::vector<std::string> errors(test.threads.size());
+        std::vector<std::function<void()>> bodies;
+        for (int i = 0;i < int(test.threads.size());i++) {
+            bodies.push_back([&, i] {
+                try { test.threads[i](*state, history, i); }
+                catch (std::exception const& e) { errors[i] = e.what(); }
+                catch (...) { errors[i] = "unknown exception"; }
+            });
+        }
+        test_scheduler scheduler(options.replay.empty() ? options.strategy : test_scheduler::mode::exhaustive, seed, forced);
+        scheduler.run(bodies);
+        result.executions++;
+        std::string failure;
+        for (std::size_t i = 0;i < errors.size();i++) {
+            if (!errors[i].empty()) { failure += "thread " + std::to_string(i) + " threw: " + errors[i] + "\n"; }
+        }
+        if (failure.empty() && test.post && !test.post(*state)) { failure = "post-condition failed\n"; }
+        if (failure.empty()) { history.linearizable(test.model, &failure); }
+        if (!failure.empty()) {
+            result.passed = false;
+            result.seed = seed;
+            result.trace = scheduler.trace();
+            result.failure = failure;
+            return result;
+        }
+        if (options.strategy == test_scheduler::mode::exhaustive && options.replay.empty() &&
+            !scheduler.next_exhaustive(forced)) { break; }
+        //穷举时所有的选择序列都已经执行过,提前结束
+    }
+    return result;
+}
+
+template <typename Iterator, typename T>
+T simd_accumulate(Iterator first, Iterator last, T init);
 template <typename Iterator, typename T>
 struct accumulate_block {
     void operator()(Iterator first, Iterator last, T& result) {
-        result = std::accumulate(first, last, result);
+        result = simd_accumulate(first, last, result);
     }
 };
 
 struct empty_stack : std::exception {
     const char* what() const throw() { return "empty stack!"; }
 };
+struct task_cancelled : std::exception {
+    const char* what() const throw() { return "task cancelled!"; }
+};
+struct task_expired : task_cancelled {
+    const char* what() const throw() { return "task deadline expired!"; }
+};
+//排队的任务在开始执行前被取消或超过截止时间时,future中保存的异常
 template<typename T>
 class thread_safe_stack {
 private:
     std::stack<T> data;
     mutable std::mutex mtx;
+    std::condition_variable cond;
+    template<typename Clock, typename Dur>
+    std::unique_lock<std::mutex> wait_data_until(TimePoint<Clock, Dur> const& deadline) {
+        std::unique_lock<std::mutex> lk(mtx);
+        if (!cond.wait_until(lk, deadline, [this] { return !data.empty(); })) { lk.unlock(); }
+        return lk;
+    }//返回的锁没有持有互斥量时,表示已经超时
 public:
     thread_safe_stack() {};
     thread_safe_stack(const thread_safe_stack& other) {
@@ -88,21 +1132,52 @@ public:
     }
     thread_safe_stack& operator=(const thread_safe_stack&) = delete;
     void push(T value) {
-        std::lock_guard<std::mutex> lk(mtx);
-        data.push(std::move(value));
+        schedule_point();
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            data.push(std::move(value));
+        }
+        cond.notify_one();
     }
     std::shared_ptr<T> pop() {
+        schedule_point();
         std::lock_guard<std::mutex> lk(mtx);
         std::shared_ptr<T> const res(std::make_shared<T>(std::move(data.top())));
         data.pop();
         return res;
     }
     void pop(T& value) {
+        schedule_point();
         std::lock_guard<std::mutex> lk(mtx);
         if (data.empty()) throw empty_stack();
         value = std::move(data.top());
         data.pop();
     }
+    //限时的pop:栈为空时最多等待到deadline,超时返回空指针/false,不会抛出empty_stack
+    template<typename Clock, typename Dur>
+    std::shared_ptr<T> try_pop_until(TimePoint<Clock, Dur> const& deadline) {
+        std::unique_lock<std::mutex> lk(wait_data_until(deadline));
+        if (!lk.owns_lock()) { return std::shared_ptr<T>(); }
+        std::shared_ptr<T> const res(std::make_shared<T>(std::move(data.top())));
+        data.pop();
+        return res;
+    }
+    template<typename Clock, typename Dur>
+    bool try_pop_until(T& value, TimePoint<Clock, Dur> const& deadline) {
+        std::unique_lock<std::mutex> lk(wait_data_until(deadline));
+        if (!lk.owns_lock()) { return false; }
+        value = std::move(data.top());
+        data.pop();
+        return true;
+    }
+    template<typename Rep, typename Period>
+    std::shared_ptr<T> try_pop_for(Duration<Rep, Period> const& timeout) {
+        return try_pop_until(SteadyClock::now() + timeout);
+    }
+    template<typename Rep, typename Period>
+    bool try_pop_for(T& value, Duration<Rep, Period> const& timeout) {
+        return try_pop_until(value, SteadyClock::now() + timeout);
+    }
     bool empty() const {
         std::lock_guard<std::mutex> lk(mtx);
         return data.empty();
@@ -117,24 +1192,25 @@ private:
         std::shared_ptr<T> data;
         std::unique_ptr<node> next;
     };
+    typedef profiled_mutex<checked_mutex> tail_mutex_type;
     std::unique_ptr<node> head;
-    node* tail;
     std::mutex head_mtx;
-    std::mutex tail_mtx;
+    //head_mtx与条件变量一起使用,必须是std::mutex
     std::condition_variable cond;
+    cache_padded<tail_mutex_type> tail_mtx{ "thread_safe_queue::tail_mtx" };
+    node* tail;
+    //填充只让tail_mtx离开head、head_mtx和cond所在的缓存行,生产者获取tail_mtx时不会使消费者持有的head_mtx所在的行失效
+    //两侧并没有完全分开:消费者每次pop都通过get_tail获取tail_mtx并读取tail(tail在tail_mtx之后的下一个缓存行上)
+    //生产者push之后也要获取一次head_mtx再通知,所以push和pop仍然会在这几个缓存行之间来回传递
     node* get_tail() {
-        std::lock_guard<std::mutex> tail_lk(tail_mtx);
+        std::lock_guard<tail_mutex_type> tail_lk(tail_mtx);
         return tail;
     }
     std::unique_ptr<node> pop_head() {
-        std::lock_guard<std::mutex> head_lock(head_mtx);
-        if (head.get() == get_tail()) {
-            return nullptr;
-        }
         std::unique_ptr<node> old_head = std::move(head);
         head = std::move(old_head->next);
         return old_head;
-    }
+    }//调用者需要持有head_mtx
     std::unique_lock<std::mutex> wait_data() {
         std::unique_lock<std::mutex> head_lk(head_mtx);
         cond.wait(head_lk, [&] { return head.get() != get_tail(); });
@@ -145,12 +1221,33 @@ private:
         return pop_head();
     }
     std::unique_ptr<node> wait_pop_head(T& value) {
-        std::unique_ptr<std::mutex> head_lk(wait_data());
+        std::unique_lock<std::mutex> head_lk(wait_data());
         value = std::move(*head->data);
         return pop_head();
 
     }
+    template<typename Clock, typename Dur>
+    std::unique_lock<std::mutex> wait_data_until(stop_token const& token, TimePoint<Clock, Dur> const& deadline) {
+        std::unique_lock<std::mutex> head_lk(head_mtx);
+        if (!stoppable_wait_until(cond, head_lk, token, deadline, [&] { return head.get() != get_tail(); })) {
+            head_lk.unlock();
+        }
+        return head_lk;
+    }//返回的锁没有持有互斥量时,表示等待被停止或者超时
+    template<typename Clock, typename Dur>
+    std::unique_ptr<node> wait_pop_head_until(stop_token const& token, TimePoint<Clock, Dur> const& deadline) {
+        std::unique_lock<std::mutex> head_lk(wait_data_until(token, deadline));
+        return head_lk.owns_lock() ? pop_head() : std::unique_ptr<node>();
+    }
+    template<typename Clock, typename Dur>
+    std::unique_ptr<node> wait_pop_head_until(T& value, stop_token const& token, TimePoint<Clock, Dur> const& deadline) {
+        std::unique_lock<std::mutex> head_lk(wait_data_until(token, deadline));
+        if (!head_lk.owns_lock()) { return std::unique_ptr<node>(); }
+        value = std::move(*head->data);
+        return pop_head();
+    }
     std::unique_ptr<node> try_pop_head() {
+        schedule_point();
         std::lock_guard<std::mutex> head_lk(head_mtx);
         if (head.get() == get_tail()) {
             return std::unique_ptr<node>();
@@ -158,6 +1255,7 @@ private:
         return pop_head();
     }
     std::unique_ptr<node> try_pop_head(T& value) {
+        schedule_point();
         std::lock_guard<std::mutex> head_lk(head_mtx);
         if (head.get() == get_tail()) {
             return std::unique_ptr<node>();
@@ -184,16 +1282,69 @@ public:
     void wait_pop(T& value) {
         std::unique_ptr<node> const old_head = wait_pop_head(value);
     }
+    //可停止的等待:token被停止时返回空指针/false,用于关闭服务时立即唤醒所有消费者
+    std::shared_ptr<T> wait_pop(stop_token const& token) {
+        std::unique_ptr<node> const old_head = wait_pop_head_until(token, SteadyClock::time_point::max());
+        return old_head ? old_head->data : std::shared_ptr<T>();
+    }
+    bool wait_pop(T& value, stop_token const& token) {
+        return static_cast<bool>(wait_pop_head_until(value, token, SteadyClock::time_point::max()));
+    }
+    template<typename Rep, typename Period>
+    std::shared_ptr<T> wait_pop_for(Duration<Rep, Period> const& timeout, stop_token const& token = stop_token()) {
+        std::unique_ptr<node> const old_head = wait_pop_head_until(token, SteadyClock::now() + timeout);
+        return old_head ? old_head->data : std::shared_ptr<T>();
+    }
+    template<typename Rep, typename Period>
+    bool wait_pop_for(T& value, Duration<Rep, Period> const& timeout, stop_token const& token = stop_token()) {
+        return static_cast<bool>(wait_pop_head_until(value, token, SteadyClock::now() + timeout));
+    }
+    //限时的try_pop:队列为空时最多等待到deadline,超时返回空指针/false;_for的超时从SteadyClock的当前时间开始计算
+    template<typename Clock, typename Dur>
+    std::shared_ptr<T> try_pop_until(TimePoint<Clock, Dur> const& deadline) {
+        std::unique_ptr<node> const old_head = wait_pop_head_until(stop_token(), deadline);
+        return old_head ? old_head->data : std::shared_ptr<T>();
+    }
+    template<typename Clock, typename Dur>
+    bool try_pop_until(T& value, TimePoint<Clock, Dur> const& deadline) {
+        return static_cast<bool>(wait_pop_head_until(value, stop_token(), deadline));
+    }
+    template<typename Rep, typename Period>
+    std::shared_ptr<T> try_pop_for(Duration<Rep, Period> const& timeout) {
+        return try_pop_until(SteadyClock::now() + timeout);
+    }
+    template<typename Rep, typename Period>
+    bool try_pop_for(T& value, Duration<Rep, Period> const& timeout) {
+        return try_pop_until(value, SteadyClock::now() + timeout);
+    }
+    //可中断的等待:使用当前线程的中断上下文(interruptible_thread的中断标志,或线程池任务的令牌和截止时间)
+    //被中断时抛出thread_interrupted,与interruption_point()相同
+    std::shared_ptr<T> interruptible_wait_pop() {
+        interrupt_context const& context = this_thread_interrupt_context;
+        std::unique_ptr<node> const old_head = wait_pop_head_until(context.token, context.deadline);
+        if (!old_head) { throw thread_interrupted(); }
+        return old_head->data;
+    }
+    void interruptible_wait_pop(T& value) {
+        interrupt_context const& context = this_thread_interrupt_context;
+        if (!wait_pop_head_until(value, context.token, context.deadline)) { throw thread_interrupted(); }
+    }
     void push(T value) {
         std::shared_ptr<T> new_data(std::make_shared<T>(std::move(value)));
         std::unique_ptr<node> tmp(new node);
+        schedule_point();
         {
-            std::lock_guard<std::mutex> tail_lk(tail_mtx);
+            std::lock_guard<tail_mutex_type> tail_lk(tail_mtx);
             tail->data = new_data;
             node* const new_tail = tmp.get();
             tail->next = std::move(tmp);
             tail = new_tail;
         }
+        {
+            std::lock_guard<std::mutex> head_lk(head_mtx);
+        }
+        //等待者持有head_mtx检查条件,但tail只在tail_mtx下修改,不经过head_mtx的通知可能落在检查条件和开始等待之间而丢失
+        //获取一次head_mtx之后,等待者要么还没有检查条件(会看到新的tail),要么已经在等待(会收到通知)
         cond.notify_one();
     }
     bool empty() {
@@ -201,4 +1352,1133 @@ public:
         return (head.get() == get_tail());
     }
     //chapter5
-};
\ No newline at end of file
+};
+
+class function_wrapper {
+private:
+    struct impl_base {
+        virtual void call() = 0;
+        virtual ~impl_base() {}
+    };
+    std::unique_ptr<impl_base> impl;
+    template<typename Func>
+    struct impl_type :impl_base {
+        Func func;
+        impl_type(Func&& func_) :func(std::move(func_)) {}
+        void call() { func(); };
+    };
+public:
+    template<typename Func>
+    function_wrapper(Func&& func) :
+        impl(new impl_type<typename std::decay<Func>::type>(std::move(func))) {}
+    void operator()() { impl->call(); }
+    function_wrapper() = default;
+    function_wrapper(function_wrapper&& other) :impl(std::move(other.impl)) {}
+    function_wrapper& operator=(function_wrapper&& other) {
+        impl = std::move(other.impl);
+        return *this;
+    }
+    function_wrapper(const function_wrapper&) = delete;
+    function_wrapper(function_wrapper&) = delete;
+    function_wrapper& operator=(const function_wrapper&) = delete;
+    //chapter8
+};
+
+class work_steal_queue {
+private:
+    typedef function_wrapper data_type;
+    typedef profiled_mutex<checked_mutex> mutex_type;
+    std::deque<data_type> queue;
+    mutable cache_padded<mutex_type> mtx{ "work_steal_queue::mtx" };
+    //每个工作线程的队列单独分配,对齐后相邻的两个队列不会落在同一个缓存行上
+public:
+    work_steal_queue() {}
+    work_steal_queue(const work_steal_queue& other) = delete;
+    work_steal_queue& operator=(const work_steal_queue& other) = delete;
+    void push(data_type data) {
+        schedule_point();
+        std::lock_guard<mutex_type> lk(mtx);
+        queue.push_front(std::move(data));
+    }
+    bool empty() const {
+        schedule_point();
+        std::lock_guard<mutex_type> lk(mtx);
+        return queue.empty();
+    }
+    bool try_pop(data_type& res) {
+        schedule_point();
+        std::lock_guard<mutex_type> lk(mtx);
+        if (queue.empty()) { return false; }
+        res = std::move(queue.front());
+        queue.pop_front();
+        return true;
+    }
+    bool try_steal(data_type& res) {
+        schedule_point();
+        std::lock_guard<mutex_type> lk(mtx);
+        if (queue.empty()) { return false; }
+        res = std::move(queue.back());
+        queue.pop_back();
+        return true;
+    }
+    //chapter8
+};
+
+//拥有任务窃取的线程池
+//工作线程在构造时创建,之后一直存在,并行算法的每次调用只需要提交任务,不需要再创建线程
+//没有任务时工作线程先让出时间片,一段时间后在条件变量上休眠,避免空闲的线程池一直占用CPU
+class thread_pool4 {
+private:
+    typedef function_wrapper task_type;
+    cache_padded<std::atomic_bool> done;
+    thread_safe_queue<task_type> pool_work_queue;
+    std::vector<std::unique_ptr<work_steal_queue>> queues;
+    cache_padded<std::atomic<int>> pending;
+    cache_padded<std::atomic<int>> sleepers;
+    std::mutex sleep_mtx;
+    std::condition_variable sleep_cond;
+    cache_padded<std::atomic<int>> future_waiters;
+    //done每次循环都会被所有工作线程读取,pending每次提交和执行任务都会被修改
+    //sleepers和future_waiters在每次提交和完成任务时被读取,只在休眠和等待时修改,它们各自独占缓存行
+    std::mutex done_mtx;
+    std::condition_variable done_cond;
+    std::vector<std::thread> threads;
+    join_threads joiner;
+    //joiner最后声明,析构时最先汇入工作线程,此时队列和条件变量都还存在
+    inline static thread_local work_steal_queue* local_work_queue = nullptr;
+    inline static thread_local int index = 0;
+    inline static thread_local thread_pool4* local_pool = nullptr;
+    //local_pool用于区分当前线程是否为本线程池的工作线程,工作线程向其他线程池提交任务时不能放入自己的本地队列
+    void worker_thread(int index_) {
+        index = index_;
+        local_pool = this;
+        local_work_queue = queues[index].get();
+        int idle = 0;
+        while (!done) {
+            if (try_run_pending_task()) { idle = 0; }
+            else if (++idle < 64) { std::this_thread::yield(); }
+            else {
+                wait_for_task();
+                idle = 0;
+            }
+        }
+    }
+    void wait_for_task() {
+        std::unique_lock<std::mutex> lk(sleep_mtx);
+        ++sleepers;
+        sleep_cond.wait(lk, [this] { return done || pending.load() > 0; });
+        --sleepers;
+    }
+    void notify_task() {
+        if (sleepers.load() > 0) {
+            std::lock_guard<std::mutex> lk(sleep_mtx);
+            sleep_cond.notify_one();
+        }
+        //pending和sleepers都使用seq_cst,提交者和休眠者至少有一方能看到对方的修改,因此不会丢失唤醒
+        //只有存在休眠的线程时才需要获取互斥量,繁忙时提交任务不会因此产生竞争
+    }
+    void notify_done() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (future_waiters.load() > 0) {
+            std::lock_guard<std::mutex> lk(done_mtx);
+            done_cond.notify_all();
+        }
+    }//与notify_task相同,只有存在阻塞等待future的线程时才获取互斥量
+    template<typename T>
+    static bool is_ready(std::future<T> const& f) {
+        return f.wait_for(Sec(0)) == std::future_status::ready;
+    }
+    template<typename T, typename Clock, typename Dur>
+    bool wait_until_impl(std::future<T> const& f, stop_token const& token, TimePoint<Clock, Dur> const& deadline) {
+        bool const forever = deadline == TimePoint<Clock, Dur>::max();
+        if (local_pool == this) {
+            while (!is_ready(f)) {
+                if (token.stop_requested() || (!forever && Clock::now() >= deadline)) { return false; }
+                run_pending_task();
+            }
+            return true;
+        }
+        //工作线程在等待时继续执行其他任务,与wait相同
+        ++future_waiters;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::unique_lock<std::mutex> lk(done_mtx);
+        bool const ready = stoppable_wait_until(done_cond, lk, token, deadline, [&] { return is_ready(f); });
+        --future_waiters;
+        return ready;
+        //其他线程在done_cond上休眠,每个任务完成时被唤醒检查一次,停止时由回调立即唤醒
+    }
+    bool pop_task_from_local_queue(task_type& task) {
+        return local_pool == this && local_work_queue && local_work_queue->try_pop(task);
+    }
+    bool pop_task_from_pool_queue(task_type& task) {
+        return pool_work_queue.try_pop(task);
+    }
+    bool pop_task_from_other_thread_queue(task_type& task) {
+        for (std::size_t i = 0;i < queues.size();i++) {
+            std::size_t const new_index = (index + i + 1) % queues.size();
+            if (queues[new_index]->try_steal(task)) { return true; }
+        }
+        return false;
+    }
+    template<typename Result>
+    std::future<Result> push_task(std::packaged_task<Result()> task) {
+        std::future<Result> res(task.get_future());
+        if (local_pool == this && local_work_queue) { local_work_queue->push(std::move(task)); }
+        else { pool_work_queue.push(std::move(task)); }
+        pending.fetch_add(1);
+        notify_task();
+        return res;
+    }
+public:
+    explicit thread_pool4(unsigned thread_count = std::thread::hardware_concurrency()) :
+        done(false), pending(0), sleepers(0), future_waiters(0), joiner(threads) {
+        if (!thread_count) { thread_count = 2; }
+        try {
+            for (unsigned i = 0;i < thread_count;i++) {
+                queues.push_back(std::unique_ptr<work_steal_queue>(new work_steal_queue));
+            }
+            for (unsigned i = 0;i < thread_count;i++) {
+                threads.push_back(std::thread(&thread_pool4::worker_thread, this, i));
+            }
+            //先创建所有队列,工作线程启动后就可能去窃取其他线程的队列
+        }
+        catch (...) {
+            done = true;
+            throw;
+        }
+    }
+    thread_pool4(thread_pool4 const&) = delete;
+    thread_pool4& operator=(thread_pool4 const&) = delete;
+    //提交的任务继承提交者的中断上下文:在可取消的任务中提交的子任务,会随父任务一起被取消或超时
+    //不在任何中断上下文中提交时与原来相同,没有额外的开销
+    template <typename Function>
+    std::future<typename std::result_of<Function()>::type> submit(Function func) {
+        typedef typename std::result_of<Function()>::type result_type;
+        interrupt_context const& context = this_thread_interrupt_context;
+        if (context.token.stop_possible() || context.has_deadline()) {
+            return submit(std::move(func), context.token, context.deadline);
+        }
+        return push_task(std::packaged_task<result_type()>(std::move(func)));
+    }
+    //可取消的任务:token被停止或者到达deadline后,还在排队的任务出队时不再执行,future中保存task_cancelled或task_expired
+    //已经开始执行的任务通过interruption_point()检查,在检查点抛出thread_interrupted
+    //显式传入的token代替继承的token,截止时间取两者中较早的一个
+    template <typename Function>
+    std::future<typename std::result_of<Function()>::type>
+        submit(Function func, stop_token token,
+               SteadyClock::time_point deadline = SteadyClock::time_point::max()) {
+        typedef typename std::result_of<Function()>::type result_type;
+        interrupt_context context{ token.stop_possible() ? std::move(token) : this_thread_interrupt_context.token,
+            std::min(deadline, this_thread_interrupt_context.deadline) };
+        return push_task(std::packaged_task<result_type()>(
+            [func = std::move(func), context = std::move(context)]() mutable -> result_type {
+            if (context.token.stop_requested()) { throw task_cancelled(); }
+            if (context.has_deadline() && SteadyClock::now() >= context.deadline) { throw task_expired(); }
+            this_thread_interrupt_context = std::move(context);
+            return func();
+        }));
+    }
+    template <typename Function, typename Rep, typename Period>
+    std::future<typename std::result_of<Function()>::type>
+        submit_for(Function func, stop_token token, Duration<Rep, Period> const& timeout) {
+        return submit(std::move(func), std::move(token),
+                      SteadyClock::now() + std::chrono::duration_cast<SteadyClock::duration>(timeout));
+    }
+    bool try_run_pending_task() {
+        task_type task;
+        if (pop_task_from_local_queue(task) ||
+            pop_task_from_pool_queue(task) ||
+            pop_task_from_other_thread_queue(task)) {
+            pending.fetch_sub(1);
+            interrupt_context outer(std::move(this_thread_interrupt_context));
+            this_thread_interrupt_context = interrupt_context();
+            task();
+            this_thread_interrupt_context = std::move(outer);
+            notify_done();
+            return true;
+            //在wait中执行其他任务时,先清空当前任务的中断上下文,执行完再恢复
+        }
+        return false;
+    }
+    void run_pending_task() {
+        if (!try_run_pending_task()) { std::this_thread::yield(); }
+    }
+    template<typename T>
+    void wait(std::future<T> const& f) {
+        while (f.wait_for(Sec(0)) != std::future_status::ready) { run_pending_task(); }
+    }//等待期间执行其他任务,任务中再提交并等待子任务也不会使所有工作线程阻塞
+    //可停止的等待:token被停止时返回false;非工作线程阻塞等待而不是轮询
+    //只能用于本线程池submit返回的future,其他来源的future完成时不会唤醒等待者
+    template<typename T>
+    bool wait(std::future<T> const& f, stop_token const& token) {
+        return wait_until_impl(f, token, SteadyClock::time_point::max());
+    }
+    //限时的等待:超时或token被停止时返回false,与wait相同,工作线程在等待期间继续执行其他任务
+    template<typename T, typename Clock, typename Dur>
+    bool wait_until(std::future<T> const& f, TimePoint<Clock, Dur> const& deadline,
+                    stop_token const& token = stop_token()) {
+        return wait_until_impl(f, token, deadline);
+    }
+    template<typename T, typename Rep, typename Period>
+    bool wait_for(std::future<T> const& f, Duration<Rep, Period> const& timeout,
+                  stop_token const& token = stop_token()) {
+        return wait_until_impl(f, token, SteadyClock::now() + timeout);
+    }
+    template<typename T>
+    void interruptible_wait(std::future<T> const& f) {
+        interrupt_context const context = this_thread_interrupt_context;
+        if (!wait_until_impl(f, context.token, context.deadline)) { throw thread_interrupted(); }
+    }//使用当前线程的中断上下文,被中断或者超过截止时间时抛出thread_interrupted
+    unsigned size() const { return threads.size(); }
+    bool has_idle_threads() const { return pending.load() < static_cast<int>(threads.size()); }
+    //排队的任务少于工作线程数时,说明有线程可能处于空闲,这只是一个近似值,用于决定是否继续划分任务
+    ~thread_pool4() {
+        done = true;
+        std::lock_guard<std::mutex> lk(sleep_mtx);
+        sleep_cond.notify_all();
+    }
+    //chapter8
+};
+//进程内共享的线程池,并行算法默认使用这个线程池
+inline thread_pool4& default_pool() {
+    static thread_pool4 pool;
+    return pool;
+}
+
+//等待一组任务完成,与join_threads类似,无论以何种方式离开作用域,已提交的任务都会被等待
+//任务可能引用调用者栈上的数据,提前返回(例如抛出异常)时必须先等待任务结束
+template<typename T>
+class join_tasks {
+private:
+    std::vector<std::future<T>>& futures;
+    thread_pool4& pool;
+public:
+    join_tasks(std::vector<std::future<T>>& futures_, thread_pool4& pool_) :futures(futures_), pool(pool_) {}
+    ~join_tasks() {
+        for (std::size_t i = 0;i < futures.size();i++) {
+            if (futures[i].valid()) { pool.wait(futures[i]); }
+        }
+    }
+};
+
+//并行算法的划分提示,值为0时表示由划分器自动决定
+struct grain_hint {
+    long min_grain;         //每个块最少处理的元素个数
+    long max_grain;         //每个块最多处理的元素个数
+    double ns_per_item;     //已知每个元素的处理开销(纳秒)时可以跳过测量
+    grain_hint(long min_grain_ = 0, long max_grain_ = 0, double ns_per_item_ = 0) :
+        min_grain(min_grain_), max_grain(max_grain_), ns_per_item(ns_per_item_) {}
+};
+
+//自适应划分器
+//固定的min_per_thread对廉价的操作来说太小,任务调度的开销会超过计算本身;对昂贵的操作来说,按线程数平均划分又会导致负载不均衡
+//划分器先串行处理一段逐次翻倍的前缀并计时,得到每个元素的开销,再据此计算块大小(grain),使每个块的运行时间约为target_ns
+//测量用的前缀是真正被处理的元素,测量本身不会浪费计算
+class adaptive_partitioner {
+private:
+    static constexpr double target_ns = 20000;  //每个块的目标运行时间,远大于提交和窃取一个任务的开销
+    static constexpr double probe_ns = 5000;    //测量至少持续的时间,避免时钟精度带来的误差
+    thread_pool4& pool_;
+    grain_hint hint;
+    long grain_;
+    void set_cost(double ns_per_item) {
+        double const grain = ns_per_item > 0 ? target_ns / ns_per_item : target_ns;
+        grain_ = grain < 1 ? 1 : grain > 1e15 ? long(1e15) : static_cast<long>(grain);
+        if (hint.min_grain > 0 && grain_ < hint.min_grain) { grain_ = hint.min_grain; }
+        if (hint.max_grain > 0 && grain_ > hint.max_grain) { grain_ = hint.max_grain; }
+    }
+public:
+    explicit adaptive_partitioner(thread_pool4& pool = default_pool(), grain_hint hint_ = grain_hint()) :
+        pool_(pool), hint(hint_), grain_(1) {
+        set_cost(hint.ns_per_item);
+    }
+    template<typename Iterator, typename Func>
+    Iterator measure(Iterator first, Iterator last, Func func) {
+        if (hint.ns_per_item > 0) { return first; }
+        long length = std::distance(first, last);
+        long const max_probe = length / (4 * (long(pool_.size()) + 1));
+        //串行测量的部分不超过每个线程应得份额的1/4
+        long probe = 1;
+        long processed = 0;
+        SteadyClock::duration elapsed(0);
+        while (length > 0) {
+            long const chunk = std::min(probe, length);
+            Iterator chunk_end = first;
+            std::advance(chunk_end, chunk);
+            auto const start = SteadyClock::now();
+            bool const stop = func(first, chunk_end);
+            elapsed += SteadyClock::now() - start;
+            first = chunk_end;
+            length -= chunk;
+            processed += chunk;
+            if (stop) { return last; }
+            if (elapsed >= std::chrono::nanoseconds(long(probe_ns)) || processed >= max_probe) { break; }
+            probe *= 2;
+        }
+        set_cost(std::chrono::duration<double, std::nano>(elapsed).count() / processed);
+        return first;
+    }//以func(begin,end)处理逐次翻倍的前缀并计时,func返回true时表示提前结束(返回last),否则返回未处理部分的起点
+    long grain() const { return grain_; }
+    long num_blocks(long length) const {
+        long const blocks = (length + grain_ - 1) / grain_;
+        return std::max(1L, std::min(long(pool_.size()) + 1, blocks));
+    }//静态划分时使用的块数
+    bool should_split(long length) const { return length >= 2 * grain_ && pool_.has_idle_threads(); }
+    //延迟二分:只有剩余部分足够大,并且有线程可能空闲时才拆分出一半交给线程池
+    thread_pool4& pool() const { return pool_; }
+};
+
+template<typename Iterator, typename T, typename Func, typename Combine>
+T adaptive_reduce_impl(Iterator first, Iterator last, T identity, Func func, Combine combine,
+                       adaptive_partitioner const& part) {
+    thread_pool4& pool = part.pool();
+    long length = std::distance(first, last);
+    std::vector<std::future<T>> futures;
+    join_tasks<T> joiner(futures, pool);
+    T result = identity;
+    while (length > 0) {
+        if (part.should_split(length)) {
+            Iterator mid_point = first;
+            std::advance(mid_point, length / 2);
+            futures.push_back(pool.submit([=, &part] {
+                return adaptive_reduce_impl(mid_point, last, identity, func, combine, part);
+            }));
+            last = mid_point;
+            length = length / 2;
+            //拆分出的右半部分交给线程池,当前线程继续处理左半部分
+        }
+        else {
+            long const chunk = std::min(length, part.grain());
+            Iterator chunk_end = first;
+            std::advance(chunk_end, chunk);
+            result = combine(result, func(first, chunk_end));
+            first = chunk_end;
+            length -= chunk;
+            //每处理完一个块都重新检查是否有空闲的线程,执行昂贵操作时也能及时拆分
+        }
+    }
+    for (int i = futures.size() - 1;i >= 0;i--) {
+        pool.wait(futures[i]);
+        result = combine(result, futures[i].get());
+    }
+    //后拆分出的部分在左侧,逆序合并使结果保持元素的原有顺序,combine只需要满足结合律
+    return result;
+}
+//按自适应的块大小并行归约[first,last),func(begin,end)返回一个块的结果,combine合并两个结果
+template<typename Iterator, typename T, typename Func, typename Combine>
+T adaptive_reduce(Iterator first, Iterator last, T identity, Func func, Combine combine,
+                  thread_pool4& pool = default_pool(), grain_hint hint = grain_hint()) {
+    adaptive_partitioner part(pool, hint);
+    T result = identity;
+    first = part.measure(first, last, [&](Iterator begin, Iterator end) {
+        result = combine(result, func(begin, end));
+        return false;
+    });
+    if (std::distance(first, last) <= part.grain()) {
+        return first == last ? result : combine(result, func(first, last));
+    }//剩余的工作不足一个块时直接串行处理
+    return combine(result, adaptive_reduce_impl(first, last, identity, func, combine, part));
+}
+//按自适应的块大小并行处理[first,last),func(begin,end)处理一个块
+template<typename Iterator, typename Func>
+void adaptive_for_each_block(Iterator first, Iterator last, Func func,
+                             thread_pool4& pool = default_pool(), grain_hint hint = grain_hint()) {
+    adaptive_reduce(first, last, 0, [&func](Iterator begin, Iterator end) {
+        func(begin, end);
+        return 0;
+    }, [](int, int) { return 0; }, pool, hint);
+}
+
+//向量化的块内核
+//并行算法把数据划分给各个线程后,每个线程在自己的块上仍是逐个元素的标量循环
+//对于算术类型的连续存储的数据,使用AVX2一条指令处理8个int/float或4个long long/double
+//是否使用AVX2在运行时根据CPU决定,不支持的CPU、非x86平台和其他类型都使用通用的标量版本
+//浮点数的求和与点积会改变运算的顺序,结果可能与顺序累加有舍入误差;含NaN时min/max的结果与std::min不同
+#ifdef SIMD_AVX2_DISPATCH
+#define AVX2_TARGET __attribute__((target("avx2")))
+inline bool cpu_has_avx2() {
+    static bool const has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2;
+}
+struct avx2_i32 {
+    typedef std::int32_t value_type;
+    typedef __m256i vec;
+    static int const width = 8;
+    AVX2_TARGET static vec load(void const* p) { return _mm256_loadu_si256(static_cast<__m256i const*>(p)); }
+    AVX2_TARGET static void store(void* p, vec v) { _mm256_storeu_si256(static_cast<__m256i*>(p), v); }
+    AVX2_TARGET static vec set1(value_type x) { return _mm256_set1_epi32(x); }
+    AVX2_TARGET static vec add(vec a, vec b) { return _mm256_add_epi32(a, b); }
+    AVX2_TARGET static vec mul(vec a, vec b) { return _mm256_mullo_epi32(a, b); }
+    AVX2_TARGET static vec min(vec a, vec b) { return _mm256_min_epi32(a, b); }
+    AVX2_TARGET static vec max(vec a, vec b) { return _mm256_max_epi32(a, b); }
+    AVX2_TARGET static vec scan(vec x) {
+        x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+        x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+        //移位只在128位的通道内进行,此时两个通道分别完成了扫描
+        return _mm256_add_epi32(x, _mm256_shuffle_epi32(_mm256_permute2x128_si256(x, x, 0x08), 0xFF));
+        //把低通道的最后一个值广播后加到高通道上
+    }
+    AVX2_TARGET static vec last(vec x) { return _mm256_permutevar8x32_epi32(x, _mm256_set1_epi32(7)); }
+    AVX2_TARGET static vec shift_in(vec x, vec carry) {
+        return _mm256_blend_epi32(_mm256_permutevar8x32_epi32(x, _mm256_setr_epi32(0, 0, 1, 2, 3, 4, 5, 6)), carry, 0x01);
+    }//所有元素右移一位,空出的第一位填入carry,用于从包含当前元素的前缀得到不包含当前元素的前缀
+};
+struct avx2_i64 {
+    typedef std::int64_t value_type;
+    typedef __m256i vec;
+    static int const width = 4;
+    AVX2_TARGET static vec load(void const* p) { return _mm256_loadu_si256(static_cast<__m256i const*>(p)); }
+    AVX2_TARGET static void store(void* p, vec v) { _mm256_storeu_si256(static_cast<__m256i*>(p), v); }
+    AVX2_TARGET static vec set1(value_type x) { return _mm256_set1_epi64x(x); }
+    AVX2_TARGET static vec add(vec a, vec b) { return _mm256_add_epi64(a, b); }
+    AVX2_TARGET static vec mul(vec a, vec b) {
+        vec const cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                                           _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+        return _mm256_add_epi64(_mm256_mul_epu32(a, b), _mm256_slli_epi64(cross, 32));
+    }//AVX2没有64位的乘法,用32位的乘法拼出结果的低64位
+    AVX2_TARGET static vec min(vec a, vec b) { return _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(a, b)); }
+    AVX2_TARGET static vec max(vec a, vec b) { return _mm256_blendv_epi8(b, a, _mm256_cmpgt_epi64(a, b)); }
+    AVX2_TARGET static vec scan(vec x) {
+        x = _mm256_add_epi64(x, _mm256_slli_si256(x, 8));
+        return _mm256_add_epi64(x, _mm256_shuffle_epi32(_mm256_permute2x128_si256(x, x, 0x08), 0xEE));
+    }
+    AVX2_TARGET static vec last(vec x) { return _mm256_permute4x64_epi64(x, 0xFF); }
+    AVX2_TARGET static vec shift_in(vec x, vec carry) {
+        return _mm256_blend_epi32(_mm256_permute4x64_epi64(x, 0x90), carry, 0x03);
+    }
+};
+struct avx2_f32 {
+    typedef float value_type;
+    typedef __m256 vec;
+    static int const width = 8;
+    AVX2_TARGET static vec load(void const* p) { return _mm256_loadu_ps(static_cast<float const*>(p)); }
+    AVX2_TARGET static void store(void* p, vec v) { _mm256_storeu_ps(static_cast<float*>(p), v); }
+    AVX2_TARGET static vec set1(value_type x) { return _mm256_set1_ps(x); }
+    AVX2_TARGET static vec add(vec a, vec b) { return _mm256_add_ps(a, b); }
+    AVX2_TARGET static vec mul(vec a, vec b) { return _mm256_mul_ps(a, b); }
+    AVX2_TARGET static vec min(vec a, vec b) { return _mm256_min_ps(a, b); }
+    AVX2_TARGET static vec max(vec a, vec b) { return _mm256_max_ps(a, b); }
+    AVX2_TARGET static vec scan(vec x) {
+        x = _mm256_add_ps(x, _mm256_castsi256_ps(_mm256_slli_si256(_mm256_castps_si256(x), 4)));
+        x = _mm256_add_ps(x, _mm256_castsi256_ps(_mm256_slli_si256(_mm256_castps_si256(x), 8)));
+        return _mm256_add_ps(x, _mm256_permute_ps(_mm256_permute2f128_ps(x, x, 0x08), 0xFF));
+    }
+    AVX2_TARGET static vec last(vec x) { return _mm256_permutevar8x32_ps(x, _mm256_set1_epi32(7)); }
+    AVX2_TARGET static vec shift_in(vec x, vec carry) {
+        return _mm256_blend_ps(_mm256_permutevar8x32_ps(x, _mm256_setr_epi32(0, 0, 1, 2, 3, 4, 5, 6)), carry, 0x01);
+    }
+};
+struct avx2_f64 {
+    typedef double value_type;
+    typedef __m256d vec;
+    static int const width = 4;
+    AVX2_TARGET static vec load(void const* p) { return _mm256_loadu_pd(static_cast<double const*>(p)); }
+    AVX2_TARGET static void store(void* p, vec v) { _mm256_storeu_pd(static_cast<double*>(p), v); }
+    AVX2_TARGET static vec set1(value_type x) { return _mm256_set1_pd(x); }
+    AVX2_TARGET static vec add(vec a, vec b) { return _mm256_add_pd(a, b); }
+    AVX2_TARGET static vec mul(vec a, vec b) { return _mm256_mul_pd(a, b); }
+    AVX2_TARGET static vec min(vec a, vec b) { return _mm256_min_pd(a, b); }
+    AVX2_TARGET static vec max(vec a, vec b) { return _mm256_max_pd(a, b); }
+    AVX2_TARGET static vec scan(vec x) {
+        x = _mm256_add_pd(x, _mm256_castsi256_pd(_mm256_slli_si256(_mm256_castpd_si256(x), 8)));
+        return _mm256_add_pd(x, _mm256_permute_pd(_mm256_permute2f128_pd(x, x, 0x08), 0xF));
+    }
+    AVX2_TARGET static vec last(vec x) { return _mm256_permute4x64_pd(x, 0xFF); }
+    AVX2_TARGET static vec shift_in(vec x, vec carry) { return _mm256_blend_pd(_mm256_permute4x64_pd(x, 0x90), carry, 0x01); }
+};
+
+//以下内核只处理宽度整数倍的部分,剩余的元素由调用者以原本的类型处理
+template<typename Ops>
+AVX2_TARGET typename Ops::value_type avx2_lane(typename Ops::vec v, int lane) {
+    typename Ops::value_type lanes[Ops::width];
+    Ops::store(lanes, v);
+    return lanes[lane];
+}
+template<typename Ops, typename Combine>
+AVX2_TARGET typename Ops::value_type avx2_fold(typename Ops::vec v, Combine combine) {
+    typename Ops::value_type lanes[Ops::width];
+    Ops::store(lanes, v);
+    typename Ops::value_type result = lanes[0];
+    for (int i = 1;i < Ops::width;i++) { result = combine(result, lanes[i]); }
+    return result;
+}
+template<typename Ops>
+AVX2_TARGET typename Ops::value_type avx2_sum(void const* p, std::size_t n) {
+    typedef typename Ops::value_type value_type;
+    value_type const* data = static_cast<value_type const*>(p);
+    typename Ops::vec acc0 = Ops::set1(0), acc1 = Ops::set1(0);
+    std::size_t i = 0;
+    for (;i + 2 * Ops::width <= n;i += 2 * Ops::width) {
+        acc0 = Ops::add(acc0, Ops::load(data + i));
+        acc1 = Ops::add(acc1, Ops::load(data + i + Ops::width));
+    }
+    //两个累加器交替使用,下一次加法不必等待上一次的结果
+    if (i < n) { acc0 = Ops::add(acc0, Ops::load(data + i)); }
+    return avx2_fold<Ops>(Ops::add(acc0, acc1), std::plus<value_type>());
+}
+template<typename Ops, bool Max>
+AVX2_TARGET typename Ops::value_type avx2_min_max(void const* p, std::size_t n) {
+    typedef typename Ops::value_type value_type;
+    value_type const* data = static_cast<value_type const*>(p);
+    typename Ops::vec acc = Ops::load(data);
+    for (std::size_t i = Ops::width;i < n;i += Ops::width) {
+        acc = Max ? Ops::max(acc, Ops::load(data + i)) : Ops::min(acc, Ops::load(data + i));
+    }
+    return avx2_fold<Ops>(acc, [](value_type a, value_type b) { return Max ? std::max(a, b) : std::min(a, b); });
+}
+template<typename Ops>
+AVX2_TARGET typename Ops::value_type avx2_dot(void const* a, void const* b, std::size_t n) {
+    typedef typename Ops::value_type value_type;
+    value_type const* x = static_cast<value_type const*>(a);
+    value_type const* y = static_cast<value_type const*>(b);
+    typename Ops::vec acc = Ops::set1(0);
+    for (std::size_t i = 0;i < n;i += Ops::width) {
+        acc = Ops::add(acc, Ops::mul(Ops::load(x + i), Ops::load(y + i)));
+    }
+    return avx2_fold<Ops>(acc, std::plus<value_type>());
+}
+template<typename Ops>
+AVX2_TARGET typename Ops::value_type avx2_scan(void const* in, void* out, std::size_t n,
+                                               typename Ops::value_type carry, bool inclusive) {
+    typedef typename Ops::value_type value_type;
+    value_type const* src = static_cast<value_type const*>(in);
+    value_type* dst = static_cast<value_type*>(out);
+    typename Ops::vec acc = Ops::set1(carry);
+    for (std::size_t i = 0;i < n;i += Ops::width) {
+        typename Ops::vec const x = Ops::add(Ops::scan(Ops::load(src + i)), acc);
+        Ops::store(dst + i, inclusive ? x : Ops::shift_in(x, acc));
+        acc = Ops::last(x);
+    }
+    //寄存器内扫描log(width)步完成,块之间只需要传递最后一个元素的广播值
+    return avx2_lane<Ops>(acc, 0);
+}
+template<typename T, typename Enable = void>
+struct simd_ops { typedef void type; };
+template<typename T>
+struct simd_ops<T, typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value && sizeof(T) == 4>::type> {
+    typedef avx2_i32 type;
+};
+template<typename T>
+struct simd_ops<T, typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value && sizeof(T) == 8>::type> {
+    typedef avx2_i64 type;
+};
+template<> struct simd_ops<float> { typedef avx2_f32 type; };
+template<> struct simd_ops<double> { typedef avx2_f64 type; };
+#else
+template<typename T>
+struct simd_ops { typedef void type; };
+#endif
+//simd_ops<T>::type为void时表示该类型没有向量化的版本
+
+template<typename T>
+std::size_t simd_prefix(std::size_t n) {
+#ifdef SIMD_AVX2_DISPATCH
+    typedef typename simd_ops<T>::type ops;
+    if constexpr (!std::is_void<ops>::value) {
+        if (cpu_has_avx2()) { return n - n % ops::width; }
+    }
+#endif
+    return 0;
+}//可以交给向量内核处理的元素个数,为0时全部使用标量版本
+template<typename T>
+T simd_sum(T const* data, std::size_t n, T init) {
+    std::size_t const vec_n = simd_prefix<T>(n);
+#ifdef SIMD_AVX2_DISPATCH
+    if constexpr (!std::is_void<typename simd_ops<T>::type>::value) {
+        if (vec_n) { init = init + static_cast<T>(avx2_sum<typename simd_ops<T>::type>(data, vec_n)); }
+    }
+#endif
+    for (std::size_t i = vec_n;i < n;i++) { init = init + data[i]; }
+    return init;
+}
+template<typename T>
+T simd_min(T const* data, std::size_t n) {
+    std::size_t const vec_n = simd_prefix<T>(n);
+    T result = data[0];
+#ifdef SIMD_AVX2_DISPATCH
+    if constexpr (!std::is_void<typename simd_ops<T>::type>::value) {
+        if (vec_n) { result = static_cast<T>(avx2_min_max<typename simd_ops<T>::type, false>(data, vec_n)); }
+    }
+#endif
+    for (std::size_t i = vec_n;i < n;i++) { result = std::min(result, data[i]); }
+    return result;
+}//n必须大于0
+template<typename T>
+T simd_max(T const* data, std::size_t n) {
+    std::size_t const vec_n = simd_prefix<T>(n);
+    T result = data[0];
+#ifdef SIMD_AVX2_DISPATCH
+    if constexpr (!std::is_void<typename simd_ops<T>::type>::value) {
+        if (vec_n) { result = static_cast<T>(avx2_min_max<typename simd_ops<T>::type, true>(data, vec_n)); }
+    }
+#endif
+    for (std::size_t i = vec_n;i < n;i++) { result = std::max(result, data[i]); }
+    return result;
+}//n必须大于0
+template<typename T>
+T simd_dot(T const* a, T const* b, std::size_t n, T init) {
+    std::size_t const vec_n = simd_prefix<T>(n);
+#ifdef SIMD_AVX2_DISPATCH
+    if constexpr (!std::is_void<typename simd_ops<T>::type>::value) {
+        if (vec_n) { init = init + static_cast<T>(avx2_dot<typename simd_ops<T>::type>(a, b, vec_n)); }
+    }
+#endif
+    for (std::size_t i = vec_n;i < n;i++) { init = init + a[i] * b[i]; }
+    return init;
+}
+template<typename T>
+T simd_scan(T const* in, T* out, std::size_t n, T carry, bool inclusive) {
+    std::size_t const vec_n = simd_prefix<T>(n);
+#ifdef SIMD_AVX2_DISPATCH
+    if constexpr (!std::is_void<typename simd_ops<T>::type>::value) {
+        if (vec_n) { carry = static_cast<T>(avx2_scan<typename simd_ops<T>::type>(in, out, vec_n, carry, inclusive)); }
+    }
+#endif
+    for (std::size_t i = vec_n;i < n;i++) {
+        T const value = in[i];
+        if (inclusive) { out[i] = carry = carry + value; }
+        else {
+            out[i] = carry;
+            carry = carry + value;
+        }
+    }
+    return carry;
+}//返回包含最后一个元素的前缀,in和out可以相同
+
+//字节查找内核:一次比较64个字节,得到两个字节在其中出现的位置的位掩码(第i位对应第i个字节)
+//比逐个字节比较少了大量的分支,调用者用位运算依次取出每个出现的位置
+struct byte_masks {
+    std::uint64_t first;
+    std::uint64_t second;
+};
+#ifdef SIMD_AVX2_DISPATCH
+AVX2_TARGET inline byte_masks byte_masks_avx2(char const* p, char first, char second) {
+    __m256i const lo = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p));
+    __m256i const hi = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p + 32));
+    __m256i const a = _mm256_set1_epi8(first);
+    __m256i const b = _mm256_set1_epi8(second);
+    std::uint64_t const first_lo = std::uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, a)));
+    std::uint64_t const first_hi = std::uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, a)));
+    std::uint64_t const second_lo = std::uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, b)));
+    std::uint64_t const second_hi = std::uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, b)));
+    return byte_masks{ first_lo | (first_hi << 32), second_lo | (second_hi << 32) };
+}
+inline byte_masks byte_masks_sse2(char const* p, char first, char second) {
+    __m128i const a = _mm_set1_epi8(first);
+    __m128i const b = _mm_set1_epi8(second);
+    byte_masks masks{ 0, 0 };
+    for (int i = 0;i < 4;i++) {
+        __m128i const v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p + 16 * i));
+        masks.first |= std::uint64_t(std::uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, a)))) << (16 * i);
+        masks.second |= std::uint64_t(std::uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, b)))) << (16 * i);
+    }
+    return masks;
+}//SSE2是x86-64的基本指令集,不需要检测
+#endif
+typedef byte_masks(*byte_masks_func)(char const*, char, char);
+inline byte_masks_func select_byte_masks() {
+#ifdef SIMD_AVX2_DISPATCH
+    return cpu_has_avx2() ? byte_masks_avx2 : byte_masks_sse2;
+#else
+    return nullptr;
+#endif
+}//调用者在处理一段数据前选择一次,之后每64个字节调用一次;返回nullptr时没有向量化的版本,逐字节比较不如直接使用memchr
+
+//C++17没有contiguous_iterator的概念,这里只识别指针和std::vector(vector<bool>除外)的迭代器
+template<typename Iterator>
+struct is_contiguous_iterator {
+    typedef typename std::remove_const<typename std::iterator_traits<Iterator>::value_type>::type element_type;
+    static constexpr bool value = std::is_pointer<Iterator>::value ||
+        (!std::is_same<element_type, bool>::value &&
+         (std::is_same<Iterator, typename std::vector<element_type>::iterator>::value ||
+          std::is_same<Iterator, typename std::vector<element_type>::const_iterator>::value));
+};
+//迭代器指向连续存储的数据时,返回数据的指针,否则返回nullptr
+template<typename Iterator>
+auto contiguous_data(Iterator it) -> typename std::iterator_traits<Iterator>::pointer {
+    if constexpr (std::is_pointer<Iterator>::value) { return it; }
+    else if constexpr (is_contiguous_iterator<Iterator>::value) { return &*it; }
+    else { return nullptr; }
+}
+template<typename Iterator>
+bool use_simd(Iterator first, Iterator last) {
+    typedef typename std::iterator_traits<Iterator>::value_type value_type;
+    return first != last && !std::is_void<typename simd_ops<value_type>::type>::value &&
+        contiguous_data(first) != nullptr;
+}
+template <typename Iterator, typename T>
+T simd_accumulate(Iterator first, Iterator last, T init) {
+    typedef typename std::iterator_traits<Iterator>::value_type value_type;
+    if constexpr (std::is_same<value_type, T>::value) {
+        if (use_simd(first, last)) { return simd_sum(&*first, std::distance(first, last), init); }
+    }
+    return std::accumulate(first, last, init);
+}//只在累加的类型与元素类型相同时向量化,例如int元素以long long累加时结果不能在int的通道中计算
+
+//分块的并行前缀和(扫描)
+//第一趟:每个块各自归约得到块的和;之后串行扫描所有块的和,得到每个块的偏移;第二趟:每个块以偏移为初值进行局部扫描
+//总的工作量约为2n,与串行扫描同阶,块之间只在两趟之间同步一次,不需要逐块传递期望值
+//op只需要满足结合律,inclusive为false时计算不包含当前元素的前缀(exclusive)
+template<typename InputIt, typename OutputIt, typename T, typename BinaryOp>
+OutputIt scan_block(InputIt first, InputIt last, OutputIt d_first, T& acc, BinaryOp op, bool inclusive) {
+    typedef typename std::iterator_traits<InputIt>::value_type value_type;
+    typedef typename std::iterator_traits<OutputIt>::value_type output_type;
+    if constexpr (std::is_same<value_type, T>::value && std::is_same<output_type, T>::value &&
+                  (std::is_same<BinaryOp, std::plus<>>::value || std::is_same<BinaryOp, std::plus<T>>::value)) {
+        if (use_simd(first, last) && contiguous_data(d_first)) {
+            std::size_t const n = std::distance(first, last);
+            acc = simd_scan(&*first, &*d_first, n, acc, inclusive);
+            std::advance(d_first, n);
+            return d_first;
+        }
+    }//算术类型的加法使用寄存器内扫描
+    for (;first != last;++first, ++d_first) {
+        T const value = *first;
+        //先读出元素再写入,输入和输出是同一个序列时也能得到正确的结果
+        if (inclusive) {
+            acc = op(acc, value);
+            *d_first = acc;
+        }
+        else {
+            *d_first = acc;
+            acc = op(acc, value);
+        }
+    }
+    return d_first;
+}
+template<typename T, typename InputIt, typename BinaryOp>
+T reduce_block(InputIt first, InputIt last, BinaryOp op) {
+    T sum = *first;
+    ++first;
+    if constexpr (std::is_same<typename std::iterator_traits<InputIt>::value_type, T>::value &&
+                  (std::is_same<BinaryOp, std::plus<>>::value || std::is_same<BinaryOp, std::plus<T>>::value)) {
+        return simd_accumulate(first, last, sum);
+    }
+    for (;first != last;++first) { sum = op(sum, *first); }
+    return sum;
+}//非空的块的和,不需要单位元
+template<typename InputIt, typename OutputIt, typename T, typename BinaryOp>
+OutputIt parallel_scan_impl(InputIt first, InputIt last, OutputIt d_first, T init, BinaryOp op,
+                            bool inclusive, thread_pool4& pool, grain_hint hint) {
+    adaptive_partitioner part(pool, hint);
+    first = part.measure(first, last, [&](InputIt begin, InputIt end) {
+        d_first = scan_block(begin, end, d_first, init, op, inclusive);
+        return false;
+    });
+    //测量时串行扫描的前缀已经写入输出,init随之成为剩余部分的初值
+    long const length = std::distance(first, last);
+    if (!length) { return d_first; }
+    long const num_blocks = part.num_blocks(length);
+    long const block_size = length / num_blocks;
+    std::vector<InputIt> block_starts(num_blocks + 1);
+    std::vector<OutputIt> out_starts(num_blocks);
+    block_starts[0] = first;
+    out_starts[0] = d_first;
+    for (long i = 1;i < num_blocks;i++) {
+        block_starts[i] = block_starts[i - 1];
+        std::advance(block_starts[i], block_size);
+        out_starts[i] = out_starts[i - 1];
+        std::advance(out_starts[i], block_size);
+    }
+    block_starts[num_blocks] = last;
+    std::vector<T> offsets(num_blocks, init);
+    {
+        std::vector<std::future<T>> futures(num_blocks > 2 ? num_blocks - 2 : 0);
+        join_tasks<T> joiner(futures, pool);
+        for (long i = 1;i < num_blocks - 1;i++) {
+            futures[i - 1] = pool.submit([&block_starts, op, i] {
+                return reduce_block<T>(block_starts[i], block_starts[i + 1], op);
+            });
+        }
+        //最后一个块的和不会被用到,不需要归约
+        T acc = init;
+        scan_block(block_starts[0], block_starts[1], out_starts[0], acc, op, inclusive);
+        //第一个块的偏移就是init,调用线程在第一趟中直接完成它的扫描
+        for (long i = 1;i < num_blocks;i++) {
+            offsets[i] = acc;
+            if (i < num_blocks - 1) {
+                pool.wait(futures[i - 1]);
+                acc = op(acc, futures[i - 1].get());
+            }
+        }
+        //串行扫描块的和,块的数量不超过线程数加一,这一步的开销可以忽略
+    }
+    OutputIt result = d_first;
+    {
+        std::vector<std::future<OutputIt>> futures(num_blocks - 1);
+        join_tasks<OutputIt> joiner(futures, pool);
+        for (long i = 1;i < num_blocks - 1;i++) {
+            futures[i - 1] = pool.submit([&block_starts, &out_starts, &offsets, op, inclusive, i] {
+                T acc = offsets[i];
+                return scan_block(block_starts[i], block_starts[i + 1], out_starts[i], acc, op, inclusive);
+            });
+        }
+        if (num_blocks > 1) {
+            T acc = offsets[num_blocks - 1];
+            result = scan_block(block_starts[num_blocks - 1], last, out_starts[num_blocks - 1], acc, op, inclusive);
+        }
+        else {
+            result = out_starts[0];
+            std::advance(result, length);
+        }
+        for (long i = 1;i < num_blocks - 1;i++) {
+            pool.wait(futures[i - 1]);
+            futures[i - 1].get();
+        }
+        //传递任务中的异常
+    }
+    return result;
+}
+template<typename InputIt, typename OutputIt, typename BinaryOp = std::plus<>>
+OutputIt parallel_inclusive_scan(InputIt first, InputIt last, OutputIt d_first, BinaryOp op = BinaryOp(),
+                                 thread_pool4& pool = default_pool(), grain_hint hint = grain_hint()) {
+    typedef typename std::iterator_traits<InputIt>::value_type value_type;
+    if (first == last) { return d_first; }
+    value_type init = *first;
+    *d_first = init;
+    return parallel_scan_impl(++first, last, ++d_first, init, op, true, pool, hint);
+    //没有初值时,第一个元素本身就是第一个前缀,op不需要单位元
+}
+template<typename InputIt, typename OutputIt, typename T, typename BinaryOp = std::plus<>>
+OutputIt parallel_exclusive_scan(InputIt first, InputIt last, OutputIt d_first, T init, BinaryOp op = BinaryOp(),
+                                 thread_pool4& pool = default_pool(), grain_hint hint = grain_hint()) {
+    return parallel_scan_impl(first, last, d_first, init, op, false, pool, hint);
+}
+//与std::inclusive_scan/std::exclusive_scan的参数顺序相同,输出可以与输入是同一个序列
+
+
+//每个线程使用局部累加器的并行归约
+//adaptive_reduce在每个块上返回一个新的结果再两两合并,结果是一个映射之类的容器时,每次合并都要复制或分配整个容器
+//这里每个参与的线程只有一个局部累加器,就地累加它领取的所有块,最后才把所有局部累加器按树形两两合并,合并的轮数为log(线程数)
+//accumulate(acc, transform(*it))就地修改累加器,merge(into, std::move(from))把一个累加器合并到另一个中
+//块是动态领取的,合并的顺序与元素的顺序无关,merge需要满足交换律和结合律(例如计数,直方图,分组)
+template<typename Iterator, typename Accumulator, typename Transform, typename Accumulate, typename Merge>
+Accumulator parallel_transform_reduce(Iterator first, Iterator last, Accumulator identity, Transform transform,
+                                      Accumulate accumulate, Merge merge,
+                                      thread_pool4& pool = default_pool(), grain_hint hint = grain_hint()) {
+    Accumulator result = identity;
+    if constexpr (!std::is_base_of<std::random_access_iterator_tag,
+                                   typename std::iterator_traits<Iterator>::iterator_category>::value) {
+        for (;first != last;++first) { accumulate(result, transform(*first)); }
+        return result;
+        //块需要通过下标直接定位,非随机访问的迭代器只能顺序处理
+    }
+    else {
+        adaptive_partitioner part(pool, hint);
+        first = part.measure(first, last, [&](Iterator begin, Iterator end) {
+            for (;begin != end;++begin) { accumulate(result, transform(*begin)); }
+            return false;
+        });
+        long const length = last - first;
+        long const block_size = part.grain();
+        long const num_blocks = (length + block_size - 1) / block_size;
+        if (num_blocks <= 1) {
+            for (;first != last;++first) { accumulate(result, transform(*first)); }
+            return result;
+        }
+        struct alignas(64) local_slot {
+            Accumulator acc;
+        };
+        //每个累加器独占缓存行,不同线程更新各自的累加器(例如映射的大小)时不会互相使对方的缓存失效
+        long const num_slots = std::min(long(pool.size()) + 1, num_blocks);
+        std::vector<local_slot> slots(num_slots, local_slot{ identity });
+        std::atomic<long> next_block(0);
+        auto run_slot = [&](long slot) {
+            Accumulator& acc = slots[slot].acc;
+            for (;;) {
+                long const begin = next_block.fetch_add(1, std::memory_order_relaxed) * block_size;
+                if (begin >= length) { return; }
+                long const end = std::min(begin + block_size, length);
+                for (Iterator it = first + begin;it != first + end;++it) { accumulate(acc, transform(*it)); }
+            }
+        };
+        auto run_parallel = [&](long count, auto func) {
+            std::vector<std::future<void>> futures(count - 1);
+            join_tasks<void> joiner(futures, pool);
+            for (long i = 1;i < count;i++) { futures[i - 1] = pool.submit([&func, i] { func(i); }); }
+            func(0);
+            for (long i = 0;i < count - 1;i++) {
+                pool.wait(futures[i]);
+                futures[i].get();
+            }
+        };
+        run_parallel(num_slots, run_slot);
+        for (long stride = 1;stride < num_slots;stride *= 2) {
+            long const pairs = (num_slots - stride + 2 * stride - 1) / (2 * stride);
+            run_parallel(pairs, [&slots, stride, &merge](long pair) {
+                long const into = pair * 2 * stride;
+                merge(slots[into].acc, std::move(slots[into + stride].acc));
+            });
+        }
+        //第k轮把下标相差2^k的累加器两两合并,同一轮中的合并互不相关,可以并行执行
+        merge(result, std::move(slots[0].acc));
+        return result;
+    }
+}
+
+
+//可扩展性测试(chapter10)
+//同样的工作量分别用1,2,4...个线程完成,记录吞吐量(每秒操作数),单个操作耗时的中位数和99分位数,以及相对串行版本的加速比
+//串行版本不使用任何同步,加速比与线程数的差距就是同步、竞争和串行部分的代价(chapter7-3中的Amdahl定律)
+//读取时钟本身有几十纳秒的开销,所以单个操作只对每sample_every次调用采样一次耗时
+class benchmark_timer {
+private:
+    std::uint64_t ops = 0;
+    std::uint64_t calls = 0;
+    int sample_every;
+    std::vector<std::uint64_t> samples;
+    friend class benchmark_suite;
+    template<typename Func>
+    static void invoke(Func& func) {
+        if constexpr (std::is_void<decltype(func())>::value) { func(); }
+        else {
+            auto const result = func();
+            asm volatile("" : : "r"(&result) : "memory");
+        }
+    }//返回值的地址交给一段空的汇编,编译器不能再把没有副作用的计算(例如只读的查找)整个删除
+public:
+    explicit benchmark_timer(int sample_every_ = 16) :sample_every(sample_every_) {}
+    template<typename Func>
+    void measure(Func&& func, std::uint64_t items = 1) {
+        ops += items;
+        if (items == 1 && calls++ % sample_every) {
+            invoke(func);
+            return;
+        }
+        SteadyClock::time_point const start = SteadyClock::now();
+        invoke(func);
+        samples.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(SteadyClock::now() - start).count());
+    }//一次调用处理多个元素时(例如并行算法),items是这次调用完成的操作数,这样的调用足够长,每次都记录耗时
+    template<typename Func>
+    void measure_counted(Func&& func) {
+        if (calls++ % sample_every) {
+            ops += func();
+            return;
+        }
+        SteadyClock::time_point const start = SteadyClock::now();
+        std::uint64_t const items = func();
+        std::uint64_t const elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(SteadyClock::now() - start).count();
+        if (items) { samples.push_back(elapsed); }
+        ops += items;
+    }//操作数在调用之后才知道时(例如领取工作),func返回完成的操作数,返回0的调用不计入操作数和延迟
+};
+struct benchmark_result {
+    std::string name;
+    std::string config;
+    int threads;
+    std::uint64_t ops;
+    double seconds;
+    double ops_per_sec;
+    double p50_ns;
+    double p99_ns;
+    double speedup;
+    //没有串行版本时加速比为0
+};
+class benchmark_suite {
+private:
+    std::vector<int> counts;
+    int sample_every;
+    std::map<std::string, double> serial_rate;
+    std::vector<benchmark_result> results;
+    static double percentile(std::vector<std::uint64_t>& samples, double p) {
+        if (samples.empty()) { return 0; }
+        std::size_t const index = std::min(samples.size() - 1, std::size_t(p * samples.size()));
+        std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+        return samples[index];
+    }
+    benchmark_result const& record(std::string const& name, std::string const& config, int threads,
+                                   double seconds, std::vector<cache_padded<benchmark_timer>> const& timers) {
+        benchmark_result result{ name, config, threads, 0, seconds, 0, 0, 0, 0 };
+        std::vector<std::uint64_t> samples;
+        for (benchmark_timer const& timer : timers) {
+            result.ops += timer.ops;
+            samples.insert(samples.end(), timer.samples.begin(), timer.samples.end());
+        }
+        result.ops_per_sec = seconds > 0 ? result.ops / seconds : 0;
+        result.p50_ns = percentile(samples, 0.5);
+        result.p99_ns = percentile(samples, 0.99);
+        auto const serial = serial_rate.find(name);
+        if (serial != serial_rate.end() && serial->second > 0) { result.speedup = result.ops_per_sec / serial->second; }
+        results.push_back(result);
+        return results.back();
+    }
+    static std::string json_string(std::string const& str) {
+        std::string res = "\"";
+        for (char c : str) {
+            if (c == '"' || c == '\\') { res += '\\'; }
+            res += c;
+        }
+        return res + "\"";
+    }
+public:
+    explicit benchmark_suite(std::vector<int> counts_ = default_thread_counts(), int sample_every_ = 16) :
+        counts(std::move(counts_)), sample_every(sample_every_) {}
+    static std::vector<int> default_thread_counts() {
+        int const limit = std::max(4u, 2 * std::thread::hardware_concurrency());
+        std::vector<int> res;
+        for (int threads = 1;threads <= limit;threads *= 2) { res.push_back(threads); }
+        return res;
+    }//超过硬件线程数的部分用来观察超额订阅时的性能下降
+    std::vector<int> const& thread_counts() const { return counts; }
+    std::vector<benchmark_result> const& get_results() const { return results; }
+    benchmark_result const& serial(std::string const& name, std::function<void(benchmark_timer&)> body) {
+        run_caller(name, "serial", 1, body);
+        serial_rate[name] = results.back().ops_per_sec;
+        results.back().speedup = 1;
+        return results.back();
+    }//同一个名字的后续测试都以这个结果为基准计算加速比
+    benchmark_result const& run_caller(std::string const& name, std::string const& config, int threads,
+                                       std::function<void(benchmark_timer&)> body) {
+        std::vector<cache_padded<benchmark_timer>> timers(1, cache_padded<benchmark_timer>(sample_every));
+        SteadyClock::time_point const start = SteadyClock::now();
+        body(timers[0]);
+        return record(name, config, threads, Duration<double, std::ratio<1>>(SteadyClock::now() - start).count(), timers);
+    }//在调用线程上执行,threads只用于记录(例如线程池或并行算法内部使用的线程数)
+    benchmark_result const& run(std::string const& name, std::string const& config, int threads,
+                                std::function<void(int, benchmark_timer&)> body) {
+        std::vector<cache_padded<benchmark_timer>> timers(threads, cache_padded<benchmark_timer>(sample_every));
+        //每个线程只修改自己的计时器,计时器之间不能共享缓存行,否则测试本身就会产生伪共享
+        std::atomic<int> ready(0);
+        std::atomic<bool> go(false);
+        SteadyClock::time_point start;
+        {
+            std::vector<std::thread> workers;
+            join_threads joiner(workers);
+            for (int i = 0;i < threads;i++) {
+                workers.push_back(std::thread([&, i] {
+                    ready++;
+                    while (!go.load(std::memory_order_acquire)) { std::this_thread::yield(); }
+                    body(i, timers[i]);
+                }));
+            }
+            while (ready.load() != threads) { std::this_thread::yield(); }
+            start = SteadyClock::now();
+            go.store(true, std::memory_order_release);
+        }
+        //所有线程都创建完成后才同时开始,创建线程的时间不计入测试
+        return record(name, config, threads, Duration<double, std::ratio<1>>(SteadyClock::now() - start).count(), timers);
+    }//body(i, timer)在第i个线程上执行,由body根据i分配生产者和消费者之类的角色
+    void write_csv(std::ostream& os) const {
+        os << "name,config,threads,ops,seconds,ops_per_sec,p50_ns,p99_ns,speedup\n";
+        for (benchmark_result const& r : results) {
+            os << r.name << "," << r.config << "," << r.threads << "," << r.ops << "," << r.seconds << ","
+                << r.ops_per_sec << "," << r.p50_ns << "," << r.p99_ns << "," << r.speedup << "\n";
+        }
+    }//config中不使用逗号
+    void write_json(std::ostream& os) const {
+        os << "[\n";
+        for (std::size_t i = 0;i < results.size();i++) {
+            benchmark_result const& r = results[i];
+            os << "  {\"name\": " << json_string(r.name) << ", \"config\": " << json_string(r.config)
+                << ", \"threads\": " << r.threads << ", \"ops\": " << r.ops << ", \"seconds\": " << r.seconds
+                << ", \"ops_per_sec\": " << r.ops_per_sec << ", \"p50_ns\": " << r.p50_ns
+                << ", \"p99_ns\": " << r.p99_ns << ", \"speedup\": " << r.speedup << "}"
+                << (i + 1 < results.size() ? ",\n" : "\n");
+        }
+        os << "]\n";
+    }
+    void write(std::ostream& os, std::string const& format) const {
+        if (format == "json") { write_json(os); }
+        else { write_csv(os); }
+    }
+};